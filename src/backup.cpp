@@ -2,6 +2,11 @@
 #include <iostream>
 #include <filesystem>
 #include <vector>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <algorithm>
 #include <multiblob.h>
 #include <errors/base.h>
 #include <openssl/sha.h>
@@ -11,8 +16,14 @@
 
 interlaced_ans::Backup::Backup(
         uint64_t max_kernels,
-        uint64_t max_blob_size
-) : _max_kernels(max_kernels), _max_blob_size(max_blob_size) {}
+        uint64_t max_blob_size,
+        uint64_t max_workers,
+        uint64_t max_memory,
+        uint64_t archive_threshold,
+        uint64_t states,
+        Engine engine
+) : _max_kernels(max_kernels), _max_blob_size(max_blob_size), _max_workers(std::max(max_workers, uint64_t(1))),
+    _max_memory(max_memory), _archive_threshold(archive_threshold), _states(states), _engine(engine) {}
 
 std::string interlaced_ans::Backup::get_path_suffix(const std::string &prefix, const std::string &path) {
     return path.substr(prefix.length(), path.length());
@@ -22,6 +33,75 @@ std::string interlaced_ans::Backup::remove_irans_ext(const std::string &path) {
     return path.substr(0, path.length() - 6);
 }
 
+uint64_t interlaced_ans::Backup::kernel_count(uint64_t file_size) const {
+    // Optimize kernel count at 1KiB per kernel.
+    uint64_t estimated_kernel_count = file_size / 1024;
+
+    return std::max(
+            uint64_t(INTERLACED_ANS_DEFAULT_N_KERNELS),
+            std::min(estimated_kernel_count, _max_kernels)
+    );
+}
+
+uint64_t interlaced_ans::Backup::memory_footprint(uint64_t file_size, uint64_t kernel_count) const {
+    // A blob in flight holds its symbols plus one stride-sized output buffer and 2KB of counters per stride.
+    uint64_t stride_size = std::max(_max_blob_size / kernel_count, uint64_t(1));
+    uint64_t blob_size = std::max(std::min(file_size, _max_blob_size), uint64_t(1));
+    uint64_t blob_count = (file_size / _max_blob_size) + (file_size % _max_blob_size != 0);
+    uint64_t strides = (blob_size / stride_size) + (blob_size % stride_size != 0);
+
+    uint64_t blob_footprint = blob_size + strides * (stride_size + 256 * sizeof(uint64_t));
+    uint64_t blobs_in_flight = std::clamp(blob_count, uint64_t(1), uint64_t(INTERLACED_ANS_DEFAULT_BLOBS_IN_FLIGHT));
+
+    return blob_footprint * blobs_in_flight;
+}
+
+void interlaced_ans::Backup::log(const std::string &msg) {
+    std::unique_lock<std::mutex> lk(_log_mutex);
+    std::cout << msg << std::endl;
+}
+
+void interlaced_ans::Backup::log_error(const std::string &msg) {
+    std::unique_lock<std::mutex> lk(_log_mutex);
+    std::cerr << msg << std::endl;
+}
+
+std::vector<std::string> interlaced_ans::Backup::for_each_file(
+        const std::vector<std::string> &path_suffixes,
+        const std::function<void(const std::string &)> &fn
+) {
+    std::atomic<uint64_t> next_index = 0;
+    std::vector<std::string> failed;
+    std::mutex failed_mutex;
+
+    auto worker = [&]() {
+        uint64_t i;
+        while ((i = next_index++) < path_suffixes.size()) {
+            try {
+                fn(path_suffixes[i]);
+            } catch (std::exception &e) {
+                log_error("[BACKUP] Failed to process " + path_suffixes[i] + ": " + e.what());
+
+                std::unique_lock<std::mutex> lk(failed_mutex);
+                failed.push_back(path_suffixes[i]);
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    uint64_t n_workers = std::min(_max_workers, uint64_t(path_suffixes.size()));
+    for (uint64_t i = 0; i < n_workers; i++) {
+        workers.emplace_back(worker);
+    }
+
+    for (auto &w: workers) {
+        w.join();
+    }
+
+    std::sort(failed.begin(), failed.end());
+    return failed;
+}
+
 void interlaced_ans::Backup::backup(const std::string &source_dir, const std::string &target_dir) {
     if (!std::filesystem::is_directory(source_dir)) {
         throw BaseErrors::InvalidOperationException("[BACKUP] Source directory not found");
@@ -49,31 +129,64 @@ void interlaced_ans::Backup::backup(const std::string &source_dir, const std::st
         }
     }
 
-    std::unordered_map<std::string, std::string> hashes;
+    std::sort(path_suffixes.begin(), path_suffixes.end());
+
+    // Ordered, so that hashes.dat does not depend on which worker finished first.
+    std::map<std::string, std::string> hashes;
+    std::mutex hashes_mutex;
+    Semaphore memory(_max_memory);
 
-    for (auto &path_suffix : path_suffixes) {
+    if (_archive_threshold != 0) {
+        std::vector<std::string> archived_suffixes;
+        std::vector<std::string> remaining_suffixes;
+
+        for (const auto &path_suffix: path_suffixes) {
+            if (std::filesystem::file_size(source_dir + path_suffix) < _archive_threshold) {
+                archived_suffixes.push_back(path_suffix);
+            } else {
+                remaining_suffixes.push_back(path_suffix);
+            }
+        }
+
+        if (!archived_suffixes.empty()) {
+            create_archive(source_dir, target_dir, archived_suffixes, hashes);
+        }
+
+        path_suffixes = remaining_suffixes;
+    }
+
+    auto failed_files = for_each_file(path_suffixes, [&](const std::string &path_suffix) {
         std::string source_path = source_dir + path_suffix;
         std::string destination_path = target_dir + path_suffix + ".irans";
 
-        // Optimize kernel count at 1KiB per kernel.
         uint64_t file_size = std::filesystem::file_size(source_path);
-        uint64_t estimated_kernel_count = file_size / 1024;
+        uint64_t kernels = kernel_count(file_size);
 
-        uint64_t kernel_count = std::max(
-                uint64_t(INTERLACED_ANS_DEFAULT_N_KERNELS),
-                std::min(estimated_kernel_count, _max_kernels)
-        );
+        log("[BACKUP] Processing file: " + source_path + " with " + std::to_string(kernels) + " kernel(s)");
 
-        std::cout << "[BACKUP] Processing file: " << source_path << " with " << kernel_count << " kernel(s)"
-                  << std::endl;
+        uint64_t footprint = memory_footprint(file_size, kernels);
+        uint64_t reserved = memory.acquire(footprint + HASH_CHUNK_SIZE);
 
-        hashes[hash_string(path_suffix)] = hash_file(source_path);
+        try {
+            // Hash on a separate thread while the file is being compressed.
+            auto hash = std::async(std::launch::async, hash_file, source_path);
 
-        auto codec = MultiBlobCodec(kernel_count, _max_blob_size);
-        codec.compress_file(source_path, destination_path);
+            auto codec = MultiBlobCodec(kernels, _max_blob_size, false, footprint,
+                                        INTERLACED_ANS_DEFAULT_BLOBS_IN_FLIGHT, _states, _engine);
+            codec.compress_file(source_path, destination_path);
 
-        std::cout << "[BACKUP] Completed backup for file: " << source_path << std::endl;
-    }
+            auto file_hash = hash.get();
+
+            std::unique_lock<std::mutex> lk(hashes_mutex);
+            hashes[hash_string(path_suffix)] = file_hash;
+        } catch (...) {
+            memory.release(reserved);
+            throw;
+        }
+
+        memory.release(reserved);
+        log("[BACKUP] Completed backup for file: " + source_path);
+    });
 
     auto hash_file_path = target_dir + "/hashes.dat";
 
@@ -86,6 +199,17 @@ void interlaced_ans::Backup::backup(const std::string &source_dir, const std::st
 
     std::fclose(fp);
 
+    if (!failed_files.empty()) {
+        std::cerr << "[BACKUP] Could not back up the following files: " << std::endl << std::endl;
+        for (const auto &item: failed_files) {
+            std::cerr << "\t[-] " << source_dir + item << std::endl;
+        }
+
+        throw BaseErrors::InvalidOperationException(
+                "[BACKUP] Backup failed for " + std::to_string(failed_files.size()) + " file(s)"
+        );
+    }
+
     std::cout << "[BACKUP] Backup completed successfully" << std::endl;
 }
 
@@ -131,57 +255,77 @@ void interlaced_ans::Backup::restore(const std::string &source_dir, const std::s
             std::string dir_path = target_dir + path_suffix;
 
             std::filesystem::create_directory(dir_path);
-        } else {
+        } else if (path_suffix != "/hashes.dat" && path_suffix != INTERLACED_ANS_ARCHIVE_FILE &&
+                   path_suffix != INTERLACED_ANS_ARCHIVE_INDEX_FILE) {
             path_suffixes.push_back(path_suffix);
         }
     }
 
+    std::sort(path_suffixes.begin(), path_suffixes.end());
+
     std::vector<std::string> failed_files;
+    std::mutex failed_mutex;
 
-    for (auto &path_suffix : path_suffixes) {
-        if (path_suffix == "/hashes.dat") {
-            continue;
-        }
+    if (std::filesystem::exists(source_dir + INTERLACED_ANS_ARCHIVE_INDEX_FILE)) {
+        failed_files = restore_archive(source_dir, target_dir);
+    }
+    Semaphore memory(_max_memory);
 
+    // Workers only look hashes up, which must not insert into the map.
+    const auto &expected_hashes = hashes;
+
+    auto failed_suffixes = for_each_file(path_suffixes, [&](const std::string &path_suffix) {
         std::string source_path = source_dir + path_suffix;
         std::string original_suffix = remove_irans_ext(path_suffix);
         std::string destination_path = target_dir + original_suffix;
 
-        // Optimize kernel count at 1KiB per kernel.
         uint64_t file_size = std::filesystem::file_size(source_path);
-        uint64_t estimated_kernel_count = file_size / 1024;
+        uint64_t kernels = kernel_count(file_size);
 
-        uint64_t kernel_count = std::max(
-                uint64_t(INTERLACED_ANS_DEFAULT_N_KERNELS),
-                std::min(estimated_kernel_count, _max_kernels)
-        );
+        log("[BACKUP] Processing file: " + source_path + " with " + std::to_string(kernels) + " kernel(s)");
+
+        uint64_t footprint = memory_footprint(file_size, kernels);
+        uint64_t reserved = memory.acquire(footprint + HASH_CHUNK_SIZE);
+
+        std::string hash;
+        try {
+            auto codec = MultiBlobCodec(kernels, _max_blob_size, false, footprint);
+            codec.decompress_file(source_path, destination_path);
+
+            log("[BACKUP] Validating file: " + destination_path);
+            hash = hash_file(destination_path);
+        } catch (...) {
+            memory.release(reserved);
+            throw;
+        }
 
-        std::cout << "[BACKUP] Processing file: " << source_path << " with " << kernel_count << " kernel(s)"
-                  << std::endl;
+        memory.release(reserved);
 
-        auto codec = MultiBlobCodec(kernel_count, _max_blob_size);
-        codec.decompress_file(source_path, destination_path);
+        auto expected = expected_hashes.find(hash_string(original_suffix));
 
-        std::cout << "[BACKUP] Validating file: " << destination_path << std::endl;
-        auto hash = hash_file(destination_path);
-        auto hash_suf = hash_string(original_suffix);
+        if (expected == expected_hashes.end()) {
+            log_error("[BACKUP] Hash not found for file: " + original_suffix);
 
-        if (!hashes.contains(hash_suf)) {
-            std::cerr << "[BACKUP] Hash not found for file: " << original_suffix << std::endl;
+            std::unique_lock<std::mutex> lk(failed_mutex);
             failed_files.push_back(destination_path);
-            continue;
+            return;
         }
 
-        if (hash != hashes[hash_suf]) {
-            std::cerr << "[BACKUP] Validation failed for: " << destination_path << std::endl;
-            std::cerr << "[BACKUP] Original file hash: " << hashes[hash_suf] << std::endl;
-            std::cerr << "[BACKUP] Restored file hash: " << hash << std::endl;
-            failed_files.push_back(destination_path);
+        if (hash != expected->second) {
+            log_error("[BACKUP] Validation failed for: " + destination_path + "\n" +
+                      "[BACKUP] Original file hash: " + expected->second + "\n" +
+                      "[BACKUP] Restored file hash: " + hash);
 
-            continue;
+            std::unique_lock<std::mutex> lk(failed_mutex);
+            failed_files.push_back(destination_path);
+            return;
         }
 
-        std::cout << "[BACKUP] Completed restoration for file: " << source_path << std::endl;
+        log("[BACKUP] Completed restoration for file: " + source_path);
+    });
+
+    for (const auto &path_suffix: failed_suffixes) {
+        failed_files.push_back(target_dir + remove_irans_ext(path_suffix));
     }
 
     if (failed_files.empty()) {
@@ -189,11 +333,347 @@ void interlaced_ans::Backup::restore(const std::string &source_dir, const std::s
         return;
     }
 
+    std::sort(failed_files.begin(), failed_files.end());
+
     std::cerr << "[BACKUP] Could not complete restoration for the following files: " << std::endl << std::endl;
     for (const auto &item: failed_files) {
         std::cout << "\t[-] " << item << std::endl;
     }
 }
+void interlaced_ans::Backup::create_archive(
+        const std::string &source_dir,
+        const std::string &target_dir,
+        const std::vector<std::string> &path_suffixes,
+        std::map<std::string, std::string> &hashes
+) {
+    archive_index index{.blob_size = _max_blob_size};
+
+    uint64_t archive_size = 0;
+    for (const auto &path_suffix: path_suffixes) {
+        uint64_t file_size = std::filesystem::file_size(source_dir + path_suffix);
+        index.entries.push_back(archive_entry{.path = path_suffix, .offset = archive_size, .length = file_size});
+        archive_size += file_size;
+    }
+
+    std::cout << "[BACKUP] Archiving " << index.entries.size() << " file(s) (" << archive_size << " bytes)"
+              << std::endl;
+
+    // Files are concatenated in index order and hashed as they are read.
+    uint64_t next_entry = 0;
+    uint64_t remaining = 0;
+    FILE *fp = nullptr;
+    SHA512_CTX sha512;
+
+    auto next_file = [&]() {
+        while (fp == nullptr && next_entry < index.entries.size()) {
+            auto &entry = index.entries[next_entry];
+
+            fp = std::fopen((source_dir + entry.path).c_str(), "rb");
+            if (fp == nullptr) {
+                throw BaseErrors::InvalidOperationException("[BACKUP] Cannot open file: " + source_dir + entry.path);
+            }
+
+            SHA512_Init(&sha512);
+            remaining = entry.length;
+
+            if (remaining == 0) {
+                std::fclose(fp);
+                fp = nullptr;
+                entry.hash = digest_string(&sha512);
+                next_entry++;
+            }
+        }
+    };
+
+    auto read = [&](uint64_t size) {
+        auto data = rainman::ptr<uint8_t>(size);
+        uint64_t filled = 0;
+
+        while (filled < size) {
+            next_file();
+
+            auto &entry = index.entries[next_entry];
+            uint64_t n = std::min(remaining, size - filled);
+
+            if (std::fread(data.pointer() + filled, 1, n, fp) != n) {
+                throw BaseErrors::InvalidOperationException("[BACKUP] File changed while archiving: " +
+                                                            source_dir + entry.path);
+            }
+
+            SHA512_Update(&sha512, data.pointer() + filled, n);
+            filled += n;
+            remaining -= n;
+
+            if (remaining == 0) {
+                std::fclose(fp);
+                fp = nullptr;
+                entry.hash = digest_string(&sha512);
+                next_entry++;
+            }
+        }
+
+        return data;
+    };
+
+    try {
+        auto codec = MultiBlobCodec(_max_kernels, _max_blob_size, false, _max_memory,
+                                    INTERLACED_ANS_DEFAULT_BLOBS_IN_FLIGHT, _states, _engine);
+        index.blob_offsets = codec.compress(read, archive_size, target_dir + INTERLACED_ANS_ARCHIVE_FILE);
+
+        // Trailing empty files are never reached by the reader.
+        next_file();
+    } catch (...) {
+        if (fp != nullptr) {
+            std::fclose(fp);
+        }
+
+        throw;
+    }
+
+    write_index(target_dir + INTERLACED_ANS_ARCHIVE_INDEX_FILE, index);
+
+    for (const auto &entry: index.entries) {
+        hashes[hash_string(entry.path)] = entry.hash;
+    }
+
+    std::cout << "[BACKUP] Archived " << index.entries.size() << " file(s) into " << index.blob_offsets.size()
+              << " blob(s)" << std::endl;
+}
+
+std::vector<std::string> interlaced_ans::Backup::restore_archive(
+        const std::string &source_dir,
+        const std::string &target_dir
+) {
+    auto index = read_index(source_dir + INTERLACED_ANS_ARCHIVE_INDEX_FILE);
+
+    std::cout << "[BACKUP] Restoring " << index.entries.size() << " archived file(s)" << std::endl;
+
+    std::vector<std::string> failed_files;
+    uint64_t next_entry = 0;
+    uint64_t remaining = 0;
+    FILE *fp = nullptr;
+    SHA512_CTX sha512;
+
+    auto finish_file = [&]() {
+        auto &entry = index.entries[next_entry];
+
+        std::fclose(fp);
+        fp = nullptr;
+        next_entry++;
+
+        if (digest_string(&sha512) != entry.hash) {
+            std::cerr << "[BACKUP] Validation failed for: " << target_dir + entry.path << std::endl;
+            failed_files.push_back(target_dir + entry.path);
+        }
+    };
+
+    auto next_file = [&]() {
+        while (fp == nullptr && next_entry < index.entries.size()) {
+            auto &entry = index.entries[next_entry];
+
+            fp = std::fopen((target_dir + entry.path).c_str(), "wb");
+            if (fp == nullptr) {
+                throw BaseErrors::InvalidOperationException("[BACKUP] Cannot create file: " + target_dir + entry.path);
+            }
+
+            SHA512_Init(&sha512);
+            remaining = entry.length;
+
+            if (remaining == 0) {
+                finish_file();
+            }
+        }
+    };
+
+    auto write = [&](rainman::ptr<uint8_t> &data) {
+        uint64_t offset = 0;
+
+        while (offset < data.size()) {
+            next_file();
+            if (fp == nullptr) {
+                throw BaseErrors::InvalidOperationException("[BACKUP] Archive is larger than its index");
+            }
+
+            uint64_t n = std::min(remaining, data.size() - offset);
+            std::fwrite(data.pointer() + offset, 1, n, fp);
+            SHA512_Update(&sha512, data.pointer() + offset, n);
+
+            offset += n;
+            remaining -= n;
+
+            if (remaining == 0) {
+                finish_file();
+            }
+        }
+    };
+
+    try {
+        auto codec = MultiBlobCodec(_max_kernels, index.blob_size, false, _max_memory);
+        codec.decompress(source_dir + INTERLACED_ANS_ARCHIVE_FILE, write);
+
+        next_file();
+    } catch (...) {
+        if (fp != nullptr) {
+            std::fclose(fp);
+        }
+
+        throw;
+    }
+
+    if (fp != nullptr || next_entry != index.entries.size()) {
+        throw BaseErrors::InvalidOperationException("[BACKUP] Archive is smaller than its index");
+    }
+
+    return failed_files;
+}
+
+void interlaced_ans::Backup::extract(const std::string &source_dir, const std::string &path, const std::string &dst) {
+    if (!std::filesystem::is_directory(source_dir)) {
+        throw BaseErrors::InvalidOperationException("[BACKUP] Source directory not found");
+    }
+
+    if (std::filesystem::exists(dst)) {
+        throw BaseErrors::InvalidOperationException("[BACKUP] Destination is not empty");
+    }
+
+    std::string path_suffix = path.starts_with("/") ? path : "/" + path;
+    std::string index_path = source_dir + INTERLACED_ANS_ARCHIVE_INDEX_FILE;
+
+    if (std::filesystem::exists(index_path)) {
+        auto index = read_index(index_path);
+        auto entry = std::find_if(index.entries.begin(), index.entries.end(), [&](const archive_entry &e) {
+            return e.path == path_suffix;
+        });
+
+        if (entry != index.entries.end()) {
+            std::cout << "[BACKUP] Extracting archived file: " << path_suffix << std::endl;
+
+            auto codec = MultiBlobCodec(_max_kernels, index.blob_size, false, _max_memory);
+
+            SHA512_CTX sha512;
+            SHA512_Init(&sha512);
+            FILE *fp = std::fopen(dst.c_str(), "wb");
+
+            // Only the blobs overlapping [offset, offset + length) are decoded.
+            uint64_t end = entry->offset + entry->length;
+            for (uint64_t offset = entry->offset; offset < end;) {
+                uint64_t blob_index = offset / index.blob_size;
+                uint64_t blob_start = blob_index * index.blob_size;
+
+                if (blob_index >= index.blob_offsets.size()) {
+                    throw BaseErrors::InvalidOperationException("[BACKUP] Archive index has no blob for: " + path_suffix);
+                }
+
+                auto data = codec.decompress_blob(source_dir + INTERLACED_ANS_ARCHIVE_FILE,
+                                                  index.blob_offsets[blob_index]);
+
+                if (blob_start + data.size() <= offset) {
+                    throw BaseErrors::InvalidOperationException("[BACKUP] Archive is smaller than its index");
+                }
+
+                uint64_t n = std::min(end, blob_start + data.size()) - offset;
+                std::fwrite(data.pointer() + offset - blob_start, 1, n, fp);
+                SHA512_Update(&sha512, data.pointer() + offset - blob_start, n);
+
+                offset += n;
+            }
+
+            std::fclose(fp);
+
+            if (digest_string(&sha512) != entry->hash) {
+                throw BaseErrors::InvalidOperationException("[BACKUP] Validation failed for: " + dst);
+            }
+
+            std::cout << "[BACKUP] Extraction completed" << std::endl;
+            return;
+        }
+    }
+
+    std::string source_path = source_dir + path_suffix + ".irans";
+    if (!std::filesystem::exists(source_path)) {
+        throw BaseErrors::InvalidOperationException("[BACKUP] File not found in backup: " + path_suffix);
+    }
+
+    std::cout << "[BACKUP] Extracting file: " << source_path << std::endl;
+
+    uint64_t kernels = kernel_count(std::filesystem::file_size(source_path));
+    auto codec = MultiBlobCodec(kernels, _max_blob_size, false, _max_memory);
+    codec.decompress_file(source_path, dst);
+
+    std::cout << "[BACKUP] Extraction completed" << std::endl;
+}
+
+void interlaced_ans::Backup::write_index(const std::string &path, const archive_index &index) {
+    FILE *fp = std::fopen(path.c_str(), "wb");
+
+    auto write_u64 = [&](uint64_t x) {
+        std::fwrite(&x, sizeof(x), 1, fp);
+    };
+
+    write_u64(index.blob_size);
+    write_u64(index.blob_offsets.size());
+    for (uint64_t offset: index.blob_offsets) {
+        write_u64(offset);
+    }
+
+    write_u64(index.entries.size());
+    for (const auto &entry: index.entries) {
+        write_u64(entry.path.length());
+        std::fwrite(entry.path.c_str(), 1, entry.path.length(), fp);
+        write_u64(entry.offset);
+        write_u64(entry.length);
+        std::fwrite(entry.hash.c_str(), 1, 2 * SHA512_DIGEST_LENGTH, fp);
+    }
+
+    std::fclose(fp);
+}
+
+interlaced_ans::archive_index interlaced_ans::Backup::read_index(const std::string &path) {
+    FILE *fp = std::fopen(path.c_str(), "rb");
+    if (fp == nullptr) {
+        throw BaseErrors::InvalidOperationException("[BACKUP] Cannot open archive index");
+    }
+
+    bool truncated = false;
+    auto read_u64 = [&]() {
+        uint64_t x = 0;
+        truncated |= std::fread(&x, sizeof(x), 1, fp) != 1;
+        return x;
+    };
+
+    auto read_string = [&](uint64_t length) {
+        std::string str(length, '\0');
+        truncated |= std::fread(str.data(), 1, length, fp) != length;
+        return str;
+    };
+
+    archive_index index{};
+    index.blob_size = read_u64();
+
+    uint64_t blob_count = read_u64();
+    for (uint64_t i = 0; i < blob_count && !truncated; i++) {
+        index.blob_offsets.push_back(read_u64());
+    }
+
+    uint64_t entry_count = read_u64();
+    for (uint64_t i = 0; i < entry_count && !truncated; i++) {
+        archive_entry entry{};
+        entry.path = read_string(read_u64());
+        entry.offset = read_u64();
+        entry.length = read_u64();
+        entry.hash = read_string(2 * SHA512_DIGEST_LENGTH);
+
+        index.entries.push_back(entry);
+    }
+
+    std::fclose(fp);
+
+    if (truncated) {
+        throw BaseErrors::InvalidOperationException("[BACKUP] Archive index is truncated");
+    }
+
+    return index;
+}
 
 std::string interlaced_ans::Backup::hash_file(const std::string &file_path) {
     unsigned char hash[SHA512_DIGEST_LENGTH];
@@ -238,4 +718,14 @@ std::string interlaced_ans::Backup::hash_string(const std::string &str) {
     return ss.str();
 }
 
+std::string interlaced_ans::Backup::digest_string(SHA512_CTX *ctx) {
+    unsigned char hash[SHA512_DIGEST_LENGTH];
+    SHA512_Final(hash, ctx);
+
+    std::stringstream ss;
+    for (unsigned char i : hash) {
+        ss << std::hex << std::setw(2) << std::setfill('0') << (int) i;
+    }
 
+    return ss.str();
+}
@@ -1,17 +1,80 @@
 #ifndef INTERLACED_ANS_BACKUP_H
 #define INTERLACED_ANS_BACKUP_H
 
+// Default files processed concurrently: 4
+#define INTERLACED_ANS_DEFAULT_BACKUP_WORKERS 4
+
+// Files below this size are packed into a shared archive in archive mode: 1MB
+#define INTERLACED_ANS_DEFAULT_ARCHIVE_THRESHOLD 1048576
+
+// Backed up files keep their path with '.irans' appended, so names without that suffix cannot collide with them.
+#define INTERLACED_ANS_ARCHIVE_FILE "/archive.dat"
+#define INTERLACED_ANS_ARCHIVE_INDEX_FILE "/archive.idx"
+
 #include <cstdint>
 #include <string>
+#include <vector>
+#include <map>
+#include <functional>
 #include <condition_variable>
 #include <utils/semaphore.h>
 #include <multiblob.h>
+#include <openssl/sha.h>
 
 namespace interlaced_ans {
+    // Location of a file inside the decoded archive stream.
+    struct archive_entry {
+        std::string path;
+        uint64_t offset = 0;
+        uint64_t length = 0;
+        std::string hash{};
+    };
+
+    struct archive_index {
+        uint64_t blob_size = 0;
+        std::vector<uint64_t> blob_offsets{};
+        std::vector<archive_entry> entries{};
+    };
+
     class Backup {
     private:
         uint64_t _max_kernels;
         uint64_t _max_blob_size;
+        uint64_t _max_workers;
+        uint64_t _max_memory;
+        uint64_t _archive_threshold;
+
+        // Coding options of the files and the archive written by backup(). Restoring reads them from the files.
+        uint64_t _states;
+        Engine _engine;
+        std::mutex _log_mutex;
+
+        [[nodiscard]] uint64_t kernel_count(uint64_t file_size) const;
+
+        [[nodiscard]] uint64_t memory_footprint(uint64_t file_size, uint64_t kernel_count) const;
+
+        void log(const std::string &msg);
+
+        void log_error(const std::string &msg);
+
+        // Runs fn on up to _max_workers files at a time. Failed files are logged and returned.
+        std::vector<std::string> for_each_file(
+                const std::vector<std::string> &path_suffixes,
+                const std::function<void(const std::string &)> &fn
+        );
+
+        void create_archive(
+                const std::string &source_dir,
+                const std::string &target_dir,
+                const std::vector<std::string> &path_suffixes,
+                std::map<std::string, std::string> &hashes
+        );
+
+        std::vector<std::string> restore_archive(const std::string &source_dir, const std::string &target_dir);
+
+        static void write_index(const std::string &path, const archive_index &index);
+
+        static archive_index read_index(const std::string &path);
 
         static std::string get_path_suffix(const std::string &prefix, const std::string &path);
 
@@ -21,12 +84,25 @@ namespace interlaced_ans {
 
         static std::string hash_string(const std::string &str);
 
+        static std::string digest_string(SHA512_CTX *ctx);
+
     public:
-        Backup(uint64_t max_kernels, uint64_t max_blob_size = INTERLACED_ANS_DEFAULT_BLOB_SIZE);
+        Backup(
+                uint64_t max_kernels,
+                uint64_t max_blob_size = INTERLACED_ANS_DEFAULT_BLOB_SIZE,
+                uint64_t max_workers = INTERLACED_ANS_DEFAULT_BACKUP_WORKERS,
+                uint64_t max_memory = INTERLACED_ANS_DEFAULT_MAX_MEMORY,
+                uint64_t archive_threshold = 0,
+                uint64_t states = INTERLACED_ANS_DEFAULT_STATES,
+                Engine engine = INTERLACED_ANS_DEFAULT_ENGINE
+        );
 
         void backup(const std::string &source_dir, const std::string &target_dir);
 
         void restore(const std::string &source_dir, const std::string &target_dir);
+
+        // Restores a single file from a backup, decoding only the archive blobs that cover it.
+        void extract(const std::string &source_dir, const std::string &path, const std::string &dst);
     };
 }
 
@@ -0,0 +1,18 @@
+#ifndef INTERLACED_ANS_ENGINE_H
+#define INTERLACED_ANS_ENGINE_H
+
+#include <cstdint>
+
+namespace interlaced_ans {
+    // rANS engines that strides can be coded with. The engine of a file is recorded in its header.
+    enum class Engine : uint64_t {
+        // 64-bit state renormalized 32 bits at a time, with frequencies of RANS64_SCALE bits.
+        RANS64 = 0,
+
+        // 32-bit state renormalized 16 bits at a time, with frequencies of RANS32_SCALE bits. It needs no 64-bit
+        // integer math, which many GPUs emulate slowly, at the cost of coarser frequencies.
+        RANS32 = 1
+    };
+}
+
+#endif
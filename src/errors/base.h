@@ -1,6 +1,9 @@
 #ifndef INTERLACED_ANS_ERRORS_BASE_H
 #define INTERLACED_ANS_ERRORS_BASE_H
 
+#include <string>
+#include <exception>
+
 namespace BaseErrors {
     class InvalidOperationException : public std::exception {
     public:
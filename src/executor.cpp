@@ -0,0 +1,28 @@
+#include "executor.h"
+#include <errors/base.h>
+
+using namespace interlaced_ans;
+
+#ifdef INTERLACED_ANS_OPENCL
+Executor ExecutorProvider::_executor = Executor::OPENCL;
+#else
+Executor ExecutorProvider::_executor = Executor::NATIVE;
+#endif
+
+void ExecutorProvider::set(Executor executor) {
+#ifndef INTERLACED_ANS_OPENCL
+    if (executor == Executor::OPENCL) {
+        throw BaseErrors::InvalidOperationException("irans was built without OpenCL");
+    }
+#endif
+
+    _executor = executor;
+}
+
+Executor ExecutorProvider::get() {
+    return _executor;
+}
+
+bool ExecutorProvider::native() {
+    return _executor == Executor::NATIVE;
+}
@@ -0,0 +1,25 @@
+#ifndef INTERLACED_ANS_EXECUTOR_H
+#define INTERLACED_ANS_EXECUTOR_H
+
+namespace interlaced_ans {
+    enum class Executor {
+        // Host threads, no OpenCL runtime required.
+        NATIVE,
+
+        // OpenCL kernels on the devices loaded by DeviceProvider. Only in builds with INTERLACED_ANS_OPENCL.
+        OPENCL
+    };
+
+    class ExecutorProvider {
+    private:
+        static Executor _executor;
+    public:
+        static void set(Executor executor);
+
+        static Executor get();
+
+        static bool native();
+    };
+}
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef INTERLACED_ANS_FORMAT_H
+#define INTERLACED_ANS_FORMAT_H
+
+#include <cstdint>
+#include <engine.h>
+
+/*
+ * .irans layout (all integers are little-endian u64 unless noted):
+ *
+ *   magic, version, blob_count, states, engine                                  <- states from version 3,
+ *                                                                                  engine from version 8
+ *   blob_count x (ftable, encoder_output | stored marker, size, bytes)          <- stored blobs from version 5
+ *   [end marker]                                                                <- streamed files only
+ *   blob_count x (compressed offset, uncompressed offset, uncompressed size)    <- blob index
+ *   index offset, magic                                                         <- trailer
+ *
+ * Streamed files (version 2) do not know their blob count when the header is written. They store
+ * INTERLACED_ANS_FORMAT_STREAMED instead and terminate the blobs with an end marker, which cannot be
+ * mistaken for the first entry of an ftable since normalized frequencies are below 2^24.
+ *
+ * Version 3 records the number of interleaved rANS states every stride was coded with. Older files
+ * were always coded with a single state.
+ *
+ * Version 4 gives every stride a residue stream of its own, so that residues are coded in parallel,
+ * and stores strides that do not compress. An encoder output then carries the size of each stream
+ * after input_residues. Older files code all residues into one stream.
+ *
+ * Version 5 stores blobs that would not shrink as they are. Their ftable is replaced by a marker, which
+ * like the end marker cannot be a normalized frequency, followed by the blob size and its bytes.
+ *
+ * Version 6 replaces the 2KB ftable by the blob's histogram, which the decoder normalizes the same way
+ * the encoder did. It is written as its length in bytes followed by one varint per symbol count, where
+ * a zero count is followed by a varint with the number of further zero counts.
+ *
+ * Version 7 packs the per-stride headers. After true_size, stride_size and input_size, an encoder output
+ * holds the byte length of the headers and the number of words after them, then output_ns, input_residues
+ * and residual_ns of each stride as varints, the rANS words of every stride and the residue streams.
+ *
+ * Version 8 records the rANS engine (see engine.h) after the number of states. Older files were always
+ * coded with Rans64. The engine also sets the scale the decoder normalizes the histograms to.
+ *
+ * Legacy files (version 0) start directly with blob_count and carry no index. A legacy blob count
+ * can never equal the magic, which is how the two are told apart.
+ */
+
+// "iRANS" followed by three NUL bytes, read as a little-endian u64.
+#define INTERLACED_ANS_FORMAT_MAGIC 0x000000534e415269ull
+
+#define INTERLACED_ANS_FORMAT_LEGACY 0
+#define INTERLACED_ANS_FORMAT_VERSION 8
+
+// First version that records the number of interleaved states.
+#define INTERLACED_ANS_FORMAT_STATES_VERSION 3
+
+// First version with a residue stream per stride.
+#define INTERLACED_ANS_FORMAT_RESIDUE_STREAMS_VERSION 4
+
+// First version that stores histograms instead of normalized frequency tables.
+#define INTERLACED_ANS_FORMAT_HISTOGRAM_VERSION 6
+
+// First version with varint stride headers.
+#define INTERLACED_ANS_FORMAT_COMPACT_HEADERS_VERSION 7
+
+// First version that records the rANS engine.
+#define INTERLACED_ANS_FORMAT_ENGINE_VERSION 8
+
+#define INTERLACED_ANS_FORMAT_STREAMED UINT64_MAX
+#define INTERLACED_ANS_FORMAT_END_MARKER UINT64_MAX
+#define INTERLACED_ANS_FORMAT_STORED_MARKER (UINT64_MAX - 1)
+
+// Path that stands for stdin or stdout.
+#define INTERLACED_ANS_STDIO_PATH "-"
+
+namespace interlaced_ans {
+    struct file_header {
+        uint64_t version;
+        uint64_t blob_count;
+
+        // Interleaved rANS states per stride.
+        uint64_t states = 1;
+
+        Engine engine = Engine::RANS64;
+
+        [[nodiscard]] bool streamed() const {
+            return blob_count == INTERLACED_ANS_FORMAT_STREAMED;
+        }
+    };
+
+    struct blob_index_entry {
+        // Byte offset of the blob's ftable in the compressed file.
+        uint64_t compressed_offset;
+
+        // Position and size of the blob's symbols in the original file.
+        uint64_t offset;
+        uint64_t size;
+    };
+}
+
+#endif
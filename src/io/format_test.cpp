@@ -0,0 +1,267 @@
+/*
+ * Decodes .irans files written by every format version into the data they were compressed from.
+ * The fixtures in testdata were made from input.bin with the release that introduced each version, using
+ * "irans -x cpu -m c -b 8192 -j 8" plus the states and engine in their names.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <string>
+#include <multiblob.h>
+#include <io/reader.h>
+#include <io/writer.h>
+#include <opencl/freq_dist.h>
+#include <executor.h>
+#include <errors/base.h>
+#include <utils/simd.h>
+
+using namespace interlaced_ans;
+
+namespace {
+    struct fixture {
+        std::string name;
+
+        // Streamed files have no blob index, so only the whole file can be decoded.
+        bool indexed;
+    };
+
+    const std::vector<fixture> fixtures = {
+            {"legacy.irans",             true},
+            {"v1.irans",                 true},
+            {"v2.irans",                 true},
+            {"v2_streamed.irans",        false},
+            {"v3_x4.irans",              true},
+            {"v4_x2.irans",              true},
+            {"v5.irans",                 true},
+            {"v6_x8.irans",              true},
+            {"v6_streamed.irans",        false},
+            {"v7_x4.irans",              true},
+            {"v8_x2.irans",              true},
+            {"v8_rans32_x4.irans",       true},
+            {"v8_rans32_streamed.irans", false},
+    };
+
+    int failures = 0;
+
+    void check(bool condition, const std::string &what) {
+        if (!condition) {
+            std::cerr << "FAIL: " << what << std::endl;
+            failures++;
+        }
+    }
+
+    std::vector<uint8_t> read_file(const std::string &path) {
+        std::ifstream file(path, std::ios::binary);
+        return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    }
+
+    std::string temp_path(const std::string &name) {
+        auto path = std::filesystem::temp_directory_path() / ("irans_format_test_" + name);
+        std::filesystem::remove(path);
+        return path.string();
+    }
+
+    void test_decode(const std::string &dir, const fixture &f, const std::vector<uint8_t> &expected) {
+        for (auto level: {SimdLevel::SCALAR, SimdLevel::AVX2, SimdLevel::AVX512}) {
+            Simd::set(level);
+
+            auto dst = temp_path(f.name);
+            MultiBlobCodec().decompress_file(dir + "/" + f.name, dst);
+            check(read_file(dst) == expected, f.name + " decodes with " + Simd::name(level));
+            std::filesystem::remove(dst);
+        }
+
+        if (!f.indexed) {
+            return;
+        }
+
+        // Ranges that start and end inside strides, cross blobs and run past the end of the data.
+        const std::vector<std::pair<uint64_t, uint64_t>> ranges = {
+                {0,                   1},
+                {1000,                5000},
+                {8191,                2},
+                {8000,                12000},
+                {expected.size() - 7, 100},
+        };
+
+        for (auto [offset, length]: ranges) {
+            auto range = MultiBlobCodec().decompress_range(dir + "/" + f.name, offset, length);
+            uint64_t end = std::min<uint64_t>(offset + length, expected.size());
+
+            check(range.size() == end - offset &&
+                  std::equal(expected.begin() + offset, expected.begin() + end, range.pointer()),
+                  f.name + " decodes range " + std::to_string(offset) + "+" + std::to_string(length));
+        }
+    }
+
+    // Blobs of uniform bytes are stored as they are, so the file barely grows.
+    void test_stored_blobs() {
+        std::vector<uint8_t> data(100000);
+        uint64_t seed = 5;
+
+        for (auto &x: data) {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            x = seed >> 56;
+        }
+
+        auto src = temp_path("random.bin");
+        auto compressed = temp_path("random.irans");
+        auto dst = temp_path("random.out");
+
+        std::ofstream(src, std::ios::binary).write((const char *) data.data(), (std::streamsize) data.size());
+
+        MultiBlobCodec(8, 8192).compress_file(src, compressed);
+        MultiBlobCodec().decompress_file(compressed, dst);
+
+        check(read_file(dst) == data, "random data round-trips");
+        check(std::filesystem::file_size(compressed) < data.size() + 1024, "random blobs are stored");
+
+        for (const auto &path: {src, compressed, dst}) {
+            std::filesystem::remove(path);
+        }
+    }
+
+    // Histograms with zero runs at either end, counts of every varint length and no zeros at all.
+    void test_histograms() {
+        std::vector<std::vector<uint64_t>> histograms(4, std::vector<uint64_t>(256));
+        histograms[1][0] = 1;
+        histograms[1][255] = 1ull << 40;
+        histograms[2]['a'] = 127;
+        histograms[2]['b'] = 128;
+        histograms[2]['z'] = UINT64_MAX;
+
+        for (uint64_t i = 0; i < 256; i++) {
+            histograms[3][i] = i * i + 1;
+        }
+
+        auto path = temp_path("histograms");
+
+        {
+            Writer writer(path);
+            for (const auto &h: histograms) {
+                auto histogram = rainman::ptr<uint64_t>(256);
+                std::copy(h.begin(), h.end(), histogram.pointer());
+                writer.write_histogram(histogram);
+            }
+        }
+
+        Reader reader(path);
+        for (const auto &h: histograms) {
+            auto histogram = reader.read_histogram(reader.read_u64());
+            check(std::equal(h.begin(), h.end(), histogram.pointer()), "histogram round-trips");
+        }
+
+        std::filesystem::remove(path);
+    }
+
+    // Writes the encoder outputs of every engine and number of states back to back and reads their varint stride headers
+    // and packed words through both kinds of reader.
+    void test_encoder_outputs(const std::vector<uint8_t> &expected) {
+        const uint64_t sentinel = 0x1234567890abcdefull;
+        const std::vector<uint64_t> states = {1, 2, 4, 8};
+        const std::vector<Engine> engines = {Engine::RANS64, Engine::RANS32};
+
+        auto histogram = FrequencyDistribution().cpu_freq_dist(expected.data(), expected.size());
+        auto path = temp_path("outputs");
+
+        {
+            Writer writer(path);
+            for (auto engine: engines) {
+                for (auto k: states) {
+                    auto ftable = InterlacedRansCodec::normalized(histogram, engine);
+                    auto codec = InterlacedRansCodec(ftable, false, k, engine);
+                    codec.create_ctable();
+
+                    auto output = codec.cpu_encode(expected.data(), expected.size(), 1024);
+                    uint64_t start = writer.tell();
+
+                    writer.write(output);
+                    check(writer.tell() - start == Writer::size(output), "Writer::size matches what is written");
+                }
+            }
+
+            writer.write(sentinel);
+        }
+
+        for (bool mapped: {false, true}) {
+            Reader reader(path, mapped);
+            auto label = std::string(mapped ? "mapped" : "stdio") + " reader";
+
+            for (auto engine: engines) {
+                for (auto k: states) {
+                    auto header = file_header{
+                            .version = INTERLACED_ANS_FORMAT_VERSION,
+                            .blob_count = 1,
+                            .states = k,
+                            .engine = engine
+                    };
+                    auto output = reader.read_encoder_output(header);
+
+                    auto ftable = InterlacedRansCodec::normalized(histogram, engine);
+                    auto codec = InterlacedRansCodec(ftable, false, 1, engine);
+                    codec.create_ctable();
+
+                    std::vector<uint8_t> decoded(expected.size());
+                    codec.cpu_decode(output, decoded.data());
+                    check(decoded == expected, label + " decodes " + std::to_string(k) + " state(s) of engine " +
+                                               std::to_string((uint64_t) engine));
+                }
+            }
+
+            check(reader.read_u64() == sentinel, label + " stops at the end of the outputs");
+        }
+
+        std::filesystem::remove(path);
+    }
+
+    // A file cut short must be rejected instead of decoding zero-filled data.
+    void test_truncated(const std::string &dir, const fixture &f) {
+        auto data = read_file(dir + "/" + f.name);
+        auto src = temp_path("truncated_" + f.name);
+
+        std::ofstream(src, std::ios::binary).write((const char *) data.data(), (std::streamsize) data.size() / 2);
+
+        auto dst = temp_path(f.name);
+        bool thrown = false;
+
+        try {
+            MultiBlobCodec().decompress_file(src, dst);
+        } catch (const BaseErrors::InvalidOperationException &) {
+            thrown = true;
+        }
+
+        check(thrown, "truncated " + f.name + " is rejected");
+        std::filesystem::remove(src);
+        std::filesystem::remove(dst);
+    }
+}
+
+int main(int argc, const char *argv[]) {
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " <testdata directory>" << std::endl;
+        return 2;
+    }
+
+    std::string dir = argv[1];
+    ExecutorProvider::set(Executor::NATIVE);
+
+    auto expected = read_file(dir + "/input.bin");
+    check(!expected.empty(), "input.bin is readable");
+
+    for (const auto &f: fixtures) {
+        test_decode(dir, f, expected);
+        test_truncated(dir, f);
+    }
+
+    test_stored_blobs();
+    test_histograms();
+    test_encoder_outputs(expected);
+
+    if (failures == 0) {
+        std::cout << "All format tests passed" << std::endl;
+    }
+
+    return failures != 0;
+}
@@ -0,0 +1,87 @@
+#include "mapped_file.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstring>
+#include <errors/base.h>
+
+using namespace interlaced_ans;
+
+MappedFile::MappedFile(const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw BaseErrors::InvalidOperationException("Failed to open file for mapping: " + filename);
+    }
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        throw BaseErrors::InvalidOperationException("Cannot map a non-regular file: " + filename);
+    }
+
+    _size = st.st_size;
+
+    // Zero-length mappings are invalid.
+    if (_size != 0) {
+        void *data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            throw BaseErrors::InvalidOperationException("Failed to map file: " + filename);
+        }
+
+        _data = static_cast<uint8_t *>(data);
+        madvise(_data, _size, MADV_SEQUENTIAL);
+    }
+
+    close(fd);
+}
+
+MappedFile::MappedFile(const std::string &filename, uint64_t size) : _size(size) {
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw BaseErrors::InvalidOperationException("Failed to create file for mapping: " + filename);
+    }
+
+    // The blocks are reserved up front, since running out of space while writing through a shared mapping
+    // raises SIGBUS instead of an error.
+    if (size != 0) {
+        int err = posix_fallocate(fd, 0, (off_t) size);
+        if (err != 0) {
+            close(fd);
+            unlink(filename.c_str());
+            throw BaseErrors::InvalidOperationException("Failed to reserve " + std::to_string(size) + " bytes for " +
+                                                        filename + ": " + std::strerror(err));
+        }
+    }
+
+    if (_size != 0) {
+        void *data = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            throw BaseErrors::InvalidOperationException("Failed to map file: " + filename);
+        }
+
+        _data = static_cast<uint8_t *>(data);
+    }
+
+    close(fd);
+}
+
+void MappedFile::release(uint64_t offset, uint64_t size) const {
+    // madvise needs a page-aligned start, so only whole pages inside the range are released.
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uint64_t start = (offset + page_size - 1) / page_size * page_size;
+    uint64_t end = std::min(offset + size, _size) / page_size * page_size;
+
+    if (_data != nullptr && start < end) {
+        madvise(_data + start, end - start, MADV_DONTNEED);
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (_data != nullptr) {
+        munmap(_data, _size);
+    }
+}
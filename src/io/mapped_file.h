@@ -0,0 +1,44 @@
+#ifndef INTERLACED_ANS_MAPPED_FILE_H
+#define INTERLACED_ANS_MAPPED_FILE_H
+
+#include <cstdint>
+#include <string>
+
+namespace interlaced_ans {
+    /*
+     * A file mapped into memory. Sources are mapped read-only, destinations are created with their
+     * final size and mapped shared, so that writes to data() land in the file without going through stdio.
+     */
+    class MappedFile {
+    private:
+        uint8_t *_data = nullptr;
+        uint64_t _size = 0;
+
+    public:
+        // Maps an existing file for reading.
+        explicit MappedFile(const std::string &filename);
+
+        // Creates (or truncates) a file of 'size' bytes with its blocks allocated and maps it for writing. Throws
+        // if the space cannot be reserved.
+        MappedFile(const std::string &filename, uint64_t size);
+
+        MappedFile(const MappedFile &) = delete;
+
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        [[nodiscard]] uint8_t *data() const {
+            return _data;
+        }
+
+        [[nodiscard]] uint64_t size() const {
+            return _size;
+        }
+
+        // Tells the kernel that [offset, offset + size) will not be accessed again.
+        void release(uint64_t offset, uint64_t size) const;
+
+        ~MappedFile();
+    };
+}
+
+#endif
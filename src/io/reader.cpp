@@ -1,74 +1,383 @@
 #include "reader.h"
+#include <vector>
+#include <cstring>
+#include <errors/base.h>
+#include <utils/varint.h>
 
 using namespace interlaced_ans;
 
-Reader::Reader(const std::string &filename) {
+Reader::Reader(const std::string &filename, bool mapped) {
+    if (filename == INTERLACED_ANS_STDIO_PATH) {
+        _file = stdin;
+        return;
+    }
+
+    if (mapped) {
+        try {
+            _map = std::make_unique<MappedFile>(filename);
+            return;
+        } catch (BaseErrors::InvalidOperationException &) {
+            // Pipes and other special files are read through stdio instead.
+        }
+    }
+
     _file = std::fopen(filename.c_str(), "rb");
 }
 
 Reader::~Reader() {
-    std::fclose(_file);
+    if (_file != nullptr && _file != stdin) {
+        std::fclose(_file);
+    }
+}
+
+void Reader::read(void *dst, uint64_t size) {
+    if (_map) {
+        uint64_t available = _map->size() - std::min(_position, _map->size());
+        if (size > available) {
+            _position = _map->size() + 1;
+            throw BaseErrors::InvalidOperationException("Unexpected end of file");
+        }
+
+        if (size != 0) {
+            std::memcpy(dst, _map->data() + _position, size);
+        }
+
+        _position += size;
+        return;
+    }
+
+    if (std::fread(dst, 1, size, _file) != size) {
+        throw BaseErrors::InvalidOperationException("Unexpected end of file");
+    }
+}
+
+bool Reader::eof() {
+    if (_map) {
+        return _position > _map->size();
+    }
+
+    return std::feof(_file) || std::ferror(_file);
+}
+
+void Reader::skip(uint64_t size) {
+    if (_map) {
+        _position += size;
+        return;
+    }
+
+    std::fseek(_file, (long) size, SEEK_CUR);
 }
 
 uint64_t Reader::read_u64() {
-    uint64_t x;
-    std::fread(&x, sizeof(x), 1, _file);
+    uint64_t x = 0;
+    read(&x, sizeof(x));
 
     return x;
 }
 
+file_header Reader::read_header() {
+    uint64_t magic = read_u64();
+    if (magic != INTERLACED_ANS_FORMAT_MAGIC) {
+        return file_header{.version = INTERLACED_ANS_FORMAT_LEGACY, .blob_count = magic};
+    }
+
+    uint64_t version = read_u64();
+    if (version > INTERLACED_ANS_FORMAT_VERSION) {
+        throw BaseErrors::InvalidOperationException("Unsupported .irans format version: " + std::to_string(version));
+    }
+
+    auto header = file_header{.version = version, .blob_count = read_u64()};
+    if (version >= INTERLACED_ANS_FORMAT_STATES_VERSION) {
+        header.states = read_u64();
+    }
+
+    if (version >= INTERLACED_ANS_FORMAT_ENGINE_VERSION) {
+        header.engine = Engine(read_u64());
+
+        if (header.engine != Engine::RANS64 && header.engine != Engine::RANS32) {
+            throw BaseErrors::InvalidOperationException("Unsupported rANS engine: " +
+                                                        std::to_string((uint64_t) header.engine));
+        }
+    }
+
+    return header;
+}
+
+std::vector<blob_index_entry> Reader::read_index(const file_header &header) {
+    if (header.version == INTERLACED_ANS_FORMAT_LEGACY) {
+        throw BaseErrors::InvalidOperationException("Legacy .irans files have no blob index");
+    }
+
+    if (_map) {
+        _position = _map->size() - std::min(_map->size(), 2 * sizeof(uint64_t));
+    } else {
+        std::fseek(_file, -2 * (long) sizeof(uint64_t), SEEK_END);
+    }
+
+    uint64_t trailer_offset = tell();
+    uint64_t index_offset = read_u64();
+    if (read_u64() != INTERLACED_ANS_FORMAT_MAGIC || index_offset > trailer_offset) {
+        throw BaseErrors::InvalidOperationException("Blob index not found");
+    }
+
+    seek(index_offset);
+
+    // The index fills the space up to the trailer, which also covers streamed files without a blob count.
+    std::vector<blob_index_entry> index((trailer_offset - index_offset) / sizeof(blob_index_entry));
+    read(index.data(), sizeof(blob_index_entry) * index.size());
+
+    return index;
+}
+
 rainman::ptr<uint64_t> Reader::read_ftable() {
     auto ftable = rainman::ptr<uint64_t>(256);
-    std::fread(ftable.pointer(), sizeof(uint64_t), ftable.size(), _file);
+    read(ftable.pointer(), sizeof(uint64_t) * ftable.size());
+
+    return ftable;
+}
+
+rainman::ptr<uint64_t> Reader::read_ftable(uint64_t first) {
+    auto ftable = rainman::ptr<uint64_t>(256);
+    ftable[0] = first;
+    read(ftable.pointer() + 1, sizeof(uint64_t) * (ftable.size() - 1));
 
     return ftable;
 }
 
-encoder_output Reader::read_encoder_output() {
+rainman::ptr<uint64_t> Reader::read_histogram(uint64_t size) {
+    // A histogram never takes more than a 10-byte varint per symbol.
+    if (size > 256 * 10) {
+        throw BaseErrors::InvalidOperationException("Histogram is too large");
+    }
+
+    std::vector<uint8_t> bytes(size);
+    read(bytes.data(), size);
+
+    auto histogram = rainman::ptr<uint64_t>(256);
+    const uint8_t *p = bytes.data();
+    const uint8_t *end = p + size;
+
+    for (uint64_t i = 0; i < histogram.size(); i++) {
+        histogram[i] = Varint::get(p, end);
+
+        if (histogram[i] == 0) {
+            uint64_t run = Varint::get(p, end);
+            if (run >= histogram.size() - i) {
+                throw BaseErrors::InvalidOperationException("Histogram has too many symbols");
+            }
+
+            for (; run > 0; run--) {
+                histogram[++i] = 0;
+            }
+        }
+    }
+
+    return histogram;
+}
+
+encoder_output Reader::read_encoder_output(const file_header &header) {
     auto output = encoder_output();
+    output.states = header.states;
+    output.engine = header.engine;
 
     uint64_t true_size{};
     uint64_t stride_size{};
     uint64_t input_size{};
 
     // Read true-size, stride-size and input-size
-    std::fread(&true_size, sizeof(true_size), 1, _file);
-    std::fread(&stride_size, sizeof(stride_size), 1, _file);
-    std::fread(&input_size, sizeof(input_size), 1, _file);
+    read(&true_size, sizeof(true_size));
+    read(&stride_size, sizeof(stride_size));
+    read(&input_size, sizeof(input_size));
 
     output.input_size = input_size;
     output.stride_size = stride_size;
 
-    uint64_t u32_size = stride_size >> 2;
-
     output.output_ns = rainman::ptr<uint64_t>(true_size);
+    output.output_offsets = rainman::ptr<uint64_t>(true_size);
     output.input_residues = rainman::ptr<uint64_t>(true_size);
-    output.cl_outputs = rainman::ptr<uint32_t>(true_size * u32_size);
+
+    if (header.version >= INTERLACED_ANS_FORMAT_COMPACT_HEADERS_VERSION) {
+        read_compact_strides(output);
+        return output;
+    }
 
     // Read output_ns
-    std::fread(output.output_ns.pointer(), sizeof(uint64_t), output.output_ns.size(), _file);
+    read(output.output_ns.pointer(), sizeof(uint64_t) * output.output_ns.size());
 
     // Read input-residues
-    std::fread(output.input_residues.pointer(), sizeof(uint64_t), output.input_residues.size(), _file);
+    read(output.input_residues.pointer(), sizeof(uint64_t) * output.input_residues.size());
 
-    // Write cl_outputs
+    // Read residual_ns
+    output.shared_residues = header.version < INTERLACED_ANS_FORMAT_RESIDUE_STREAMS_VERSION;
+    if (!output.shared_residues) {
+        output.residual_ns = rainman::ptr<uint64_t>(true_size);
+        read(output.residual_ns.pointer(), sizeof(uint64_t) * output.residual_ns.size());
+    }
+
+    // Read cl_outputs, whose strides are packed behind each other
+    uint64_t words = 0;
     for (uint64_t i = 0; i < true_size; i++) {
-        std::fread(output.cl_outputs.pointer() + u32_size * i, sizeof(uint32_t), output.output_ns[i], _file);
+        output.output_offsets[i] = words;
+        words += output.output_ns[i];
     }
 
+    output.cl_outputs = rainman::ptr<uint32_t>(words);
+    read(output.cl_outputs.pointer(), sizeof(uint32_t) * words);
+
     // Read residual_output
     uint64_t residual_output_size = 1;
-    std::fread(&residual_output_size, sizeof(residual_output_size), 1, _file);
+    read(&residual_output_size, sizeof(residual_output_size));
 
     output.residual_output = rainman::ptr<uint32_t>(residual_output_size);
-    std::fread(output.residual_output.pointer(), sizeof(uint32_t), output.residual_output.size(), _file);
+    read(output.residual_output.pointer(), sizeof(uint32_t) * output.residual_output.size());
 
     return output;
 }
 
+void Reader::read_compact_strides(encoder_output &output) {
+    uint64_t true_size = output.output_ns.size();
+    uint64_t u32_size = output.stride_size >> 2;
+
+    uint64_t header_size = read_u64();
+    uint64_t payload_size = read_u64();
+
+    // Mapped readers parse the headers in place, others read them into a buffer of their own.
+    rainman::ptr<uint8_t> buffer;
+    const uint8_t *p;
+
+    if (mapped()) {
+        p = view(header_size);
+    } else {
+        buffer = rainman::ptr<uint8_t>(header_size);
+        read(buffer.pointer(), header_size);
+        p = buffer.pointer();
+    }
+
+    output.residual_ns = rainman::ptr<uint64_t>(true_size);
+
+    const uint8_t *end = p + header_size;
+    uint64_t words = 0;
+    uint64_t residual_words = 0;
+
+    for (uint64_t i = 0; i < true_size; i++) {
+        output.output_ns[i] = Varint::get(p, end);
+        output.input_residues[i] = Varint::get(p, end);
+        output.residual_ns[i] = Varint::get(p, end);
+
+        if (output.output_ns[i] > u32_size) {
+            throw BaseErrors::InvalidOperationException("Stride has more words than fit in it");
+        }
+
+        output.output_offsets[i] = words;
+        words += output.output_ns[i];
+        residual_words += output.residual_ns[i];
+    }
+
+    if (p != end) {
+        throw BaseErrors::InvalidOperationException("Stride headers do not match their size");
+    }
+
+    if (words + residual_words != payload_size) {
+        throw BaseErrors::InvalidOperationException("Stride headers do not match the payload size");
+    }
+
+    // The strides' words stay packed behind each other, as they are in the file.
+    output.cl_outputs = rainman::ptr<uint32_t>(words);
+    read(output.cl_outputs.pointer(), sizeof(uint32_t) * words);
+
+    output.residual_output = rainman::ptr<uint32_t>(residual_words);
+    read(output.residual_output.pointer(), sizeof(uint32_t) * residual_words);
+}
+
+uint64_t Reader::skip_encoder_output(const file_header &header) {
+    uint64_t true_size = read_u64();
+    skip(sizeof(uint64_t));
+    uint64_t input_size = read_u64();
+
+    if (header.version >= INTERLACED_ANS_FORMAT_COMPACT_HEADERS_VERSION) {
+        uint64_t header_size = read_u64();
+        skip(header_size + sizeof(uint32_t) * read_u64());
+
+        return input_size;
+    }
+
+    std::vector<uint64_t> output_ns(true_size);
+    read(output_ns.data(), sizeof(uint64_t) * true_size);
+    skip(sizeof(uint64_t) * true_size);
+
+    if (header.version >= INTERLACED_ANS_FORMAT_RESIDUE_STREAMS_VERSION) {
+        skip(sizeof(uint64_t) * true_size);
+    }
+
+    uint64_t payload_size = 0;
+    for (uint64_t n: output_ns) {
+        payload_size += n;
+    }
+
+    skip(sizeof(uint32_t) * payload_size);
+    skip(sizeof(uint32_t) * read_u64());
+
+    return input_size;
+}
+
 rainman::ptr<uint8_t> Reader::read_data(uint64_t size) {
     auto tmp_data = rainman::ptr<uint8_t>(size);
 
-    std::fread(tmp_data.pointer(), sizeof(uint8_t), tmp_data.size(), _file);
+    read(tmp_data.pointer(), tmp_data.size());
     return tmp_data;
 }
+
+rainman::ptr<uint8_t> Reader::read_available(uint64_t size) {
+    if (_map) {
+        size = std::min(size, _map->size() - std::min(_position, _map->size()));
+        return read_data(size);
+    }
+
+    auto tmp_data = rainman::ptr<uint8_t>(size);
+    uint64_t filled = std::fread(tmp_data.pointer(), 1, size, _file);
+
+    if (filled == size) {
+        return tmp_data;
+    }
+
+    auto data = rainman::ptr<uint8_t>(filled);
+    if (filled != 0) {
+        std::memcpy(data.pointer(), tmp_data.pointer(), filled);
+    }
+
+    return data;
+}
+
+const uint8_t *Reader::view(uint64_t size) {
+    if (!_map || _position + size > _map->size()) {
+        throw BaseErrors::InvalidOperationException("Cannot view past the end of a mapped file");
+    }
+
+    const uint8_t *data = _map->data() + _position;
+    _position += size;
+
+    return data;
+}
+
+void Reader::release(uint64_t offset, uint64_t size) {
+    if (_map) {
+        _map->release(offset, size);
+    }
+}
+
+void Reader::seek(uint64_t offset) {
+    if (_map) {
+        _position = offset;
+        return;
+    }
+
+    std::fseek(_file, (long) offset, SEEK_SET);
+}
+
+uint64_t Reader::tell() {
+    if (_map) {
+        return _position;
+    }
+
+    return std::ftell(_file);
+}
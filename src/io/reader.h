@@ -3,25 +3,77 @@
 
 #include <cstdio>
 #include <string>
+#include <memory>
+#include <vector>
 #include <rainman/rainman.h>
 #include <opencl/interlaced_rans64.h>
+#include <io/mapped_file.h>
+#include <io/format.h>
 
 namespace interlaced_ans {
     class Reader {
     private:
-        FILE *_file;
+        FILE *_file = nullptr;
+        std::unique_ptr<MappedFile> _map;
+        uint64_t _position = 0;
+
+        // Reads exactly 'size' bytes and throws if the input ends before that.
+        void read(void *dst, uint64_t size);
+
+        // Reads the varint stride headers and words of a version 7 encoder output.
+        void read_compact_strides(encoder_output &output);
 
     public:
-        Reader(const std::string &filename);
+        // Mapped readers serve reads from a memory mapping and fall back to stdio if the file cannot be mapped.
+        // Reads from stdin if filename is INTERLACED_ANS_STDIO_PATH.
+        explicit Reader(const std::string &filename, bool mapped = false);
+
+        [[nodiscard]] bool mapped() const {
+            return _map != nullptr;
+        }
 
         uint64_t read_u64();
 
+        // Reads the file header, accepting legacy files that start with the blob count.
+        file_header read_header();
+
+        // Reads the trailing blob index of a versioned file, which must be seekable. The read position is left undefined.
+        std::vector<blob_index_entry> read_index(const file_header &header);
+
+        // True once a read has run past the end of the input.
+        bool eof();
+
+        void skip(uint64_t size);
+
         rainman::ptr<uint64_t> read_ftable();
 
-        encoder_output read_encoder_output();
+        // Reads the rest of an ftable whose first entry has already been read.
+        rainman::ptr<uint64_t> read_ftable(uint64_t first);
+
+        // Reads a version 6 histogram whose length in bytes has already been read.
+        rainman::ptr<uint64_t> read_histogram(uint64_t size);
+
+        // Reads an encoder output in the layout of the file's version.
+        encoder_output read_encoder_output(const file_header &header);
+
+        // Skips an encoder output and returns the size of the blob it decodes to.
+        uint64_t skip_encoder_output(const file_header &header);
 
         rainman::ptr<uint8_t> read_data(uint64_t size);
 
+        // Reads up to 'size' bytes, stopping early only at the end of the input.
+        rainman::ptr<uint8_t> read_available(uint64_t size);
+
+        // Returns the next 'size' bytes of a mapped reader without copying them. The view lives as long as the reader.
+        const uint8_t *view(uint64_t size);
+
+        // Drops mapped pages in [offset, offset + size) that are no longer needed from memory.
+        void release(uint64_t offset, uint64_t size);
+
+        void seek(uint64_t offset);
+
+        uint64_t tell();
+
         ~Reader();
     };
 }
@@ -1,51 +1,147 @@
 #include "writer.h"
+#include <utils/varint.h>
 
 using namespace interlaced_ans;
 
 Writer::Writer(const std::string &filename) {
+    if (filename == INTERLACED_ANS_STDIO_PATH) {
+        _file = stdout;
+        return;
+    }
+
     remove(filename.c_str());
     _file = std::fopen(filename.c_str(), "wb");
 }
 
+void Writer::write(const void *data, uint64_t size) {
+    _position += std::fwrite(data, 1, size, _file);
+}
+
 void Writer::write(uint64_t x) {
-    std::fwrite(&x, sizeof(x), 1, _file);
+    write(&x, sizeof(x));
+}
+
+void Writer::write_header(uint64_t blob_count, uint64_t states, Engine engine) {
+    write(INTERLACED_ANS_FORMAT_MAGIC);
+    write(INTERLACED_ANS_FORMAT_VERSION);
+    write(blob_count);
+    write(states);
+    write((uint64_t) engine);
+}
+
+void Writer::write_index(const std::vector<blob_index_entry> &index) {
+    uint64_t index_offset = tell();
+
+    write(index.data(), sizeof(blob_index_entry) * index.size());
+    write(index_offset);
+    write(INTERLACED_ANS_FORMAT_MAGIC);
 }
 
 void Writer::write(const rainman::ptr<uint64_t> &ftable) {
-    std::fwrite(ftable.pointer(), sizeof(uint64_t), ftable.size(), _file);
+    write(ftable.pointer(), sizeof(uint64_t) * ftable.size());
 }
 
 void Writer::write(const encoder_output& output) {
     uint64_t true_size = output.input_residues.size();
 
     // Write true-size, stride-size and input-size
-    std::fwrite(&true_size, sizeof(true_size), 1, _file);
-    std::fwrite(&output.stride_size, sizeof(output.stride_size), 1, _file);
-    std::fwrite(&output.input_size, sizeof(output.input_size), 1, _file);
+    write(true_size);
+    write(output.stride_size);
+    write(output.input_size);
+
+    // Write the stride headers and the number of words that follow them
+    auto headers = pack_headers(output);
+    uint64_t payload_size = output.residual_output.size();
 
-    // Write output_ns
-    std::fwrite(output.output_ns.pointer(), sizeof(uint64_t), output.output_ns.size(), _file);
+    for (uint64_t i = 0; i < true_size; i++) {
+        payload_size += output.output_ns[i];
+    }
 
-    // Write input-residues
-    std::fwrite(output.input_residues.pointer(), sizeof(uint64_t), output.input_residues.size(), _file);
+    write(headers.size());
+    write(payload_size);
+    write(headers.data(), headers.size());
 
-    // Write cl_outputs
-    uint64_t u32_size = output.stride_size >> 2;
+    // Write cl_outputs, one write per run of strides that are packed behind each other
+    for (uint64_t i = 0; i < true_size;) {
+        uint64_t first = output.output_offsets[i];
+        uint64_t words = 0;
 
-    for (uint64_t i = 0; i < true_size; i++) {
-        std::fwrite(output.cl_outputs.pointer() + u32_size * i, sizeof(uint32_t), output.output_ns[i], _file);
+        do {
+            words += output.output_ns[i++];
+        } while (i < true_size && output.output_offsets[i] == first + words);
+
+        write(output.cl_outputs.pointer() + first, sizeof(uint32_t) * words);
     }
 
     // Write residual_output
-    uint64_t residual_output_size = output.residual_output.size();
-    std::fwrite(&residual_output_size, sizeof(residual_output_size), 1, _file);
-    std::fwrite(output.residual_output.pointer(), sizeof(uint32_t), output.residual_output.size(), _file);
+    write(output.residual_output.pointer(), sizeof(uint32_t) * output.residual_output.size());
+}
+
+std::vector<uint8_t> Writer::pack_headers(const encoder_output &output) {
+    std::vector<uint8_t> bytes;
+
+    for (uint64_t i = 0; i < output.input_residues.size(); i++) {
+        Varint::put(bytes, output.output_ns[i]);
+        Varint::put(bytes, output.input_residues[i]);
+        Varint::put(bytes, output.residual_ns[i]);
+    }
+
+    return bytes;
+}
+
+void Writer::write_histogram(const rainman::ptr<uint64_t> &histogram) {
+    auto bytes = pack_histogram(histogram);
+
+    write(bytes.size());
+    write(bytes.data(), bytes.size());
+}
+
+std::vector<uint8_t> Writer::pack_histogram(const rainman::ptr<uint64_t> &histogram) {
+    std::vector<uint8_t> bytes;
+
+    for (uint64_t i = 0; i < histogram.size(); i++) {
+        Varint::put(bytes, histogram[i]);
+
+        if (histogram[i] == 0) {
+            uint64_t run = 0;
+            while (i + 1 < histogram.size() && histogram[i + 1] == 0) {
+                run++;
+                i++;
+            }
+
+            Varint::put(bytes, run);
+        }
+    }
+
+    return bytes;
+}
+
+uint64_t Writer::size(const encoder_output &output) {
+    uint64_t true_size = output.input_residues.size();
+    uint64_t words = output.residual_output.size();
+
+    for (uint64_t i = 0; i < true_size; i++) {
+        words += output.output_ns[i];
+    }
+
+    // Five sizes, the stride headers and the words.
+    return 5 * sizeof(uint64_t) + pack_headers(output).size() + words * sizeof(uint32_t);
 }
 
 void Writer::write(const rainman::ptr<uint8_t> &data) {
-    std::fwrite(data.pointer(), 1, data.size(), _file);
+    write(data.pointer(), data.size());
+}
+
+uint64_t Writer::tell() {
+    // Counted rather than queried, since pipes cannot report their position.
+    return _position;
 }
 
 Writer::~Writer() {
+    if (_file == stdout) {
+        std::fflush(_file);
+        return;
+    }
+
     std::fclose(_file);
 }
@@ -2,24 +2,53 @@
 #define INTERLACED_ANS_WRITER_H
 
 #include <string>
+#include <vector>
+#include <io/format.h>
 #include <opencl/interlaced_rans64.h>
 
 namespace interlaced_ans {
     class Writer {
     private:
         FILE *_file;
+        uint64_t _position = 0;
+
+        void write(const void *data, uint64_t size);
 
     public:
+        // Writes to stdout if filename is INTERLACED_ANS_STDIO_PATH.
         Writer(const std::string &filename);
 
         void write(uint64_t x);
 
+        void write_header(
+                uint64_t blob_count = INTERLACED_ANS_FORMAT_STREAMED,
+                uint64_t states = 1,
+                Engine engine = Engine::RANS64
+        );
+
+        // Writes the blob index followed by the trailer pointing at it.
+        void write_index(const std::vector<blob_index_entry> &index);
+
         void write(const rainman::ptr<uint64_t> &ftable);
 
+        // Writes a histogram in the compact form of version 6.
+        void write_histogram(const rainman::ptr<uint64_t> &histogram);
+
+        // Varints of a histogram, without the length that write_histogram puts before them.
+        static std::vector<uint8_t> pack_histogram(const rainman::ptr<uint64_t> &histogram);
+
         void write(const encoder_output& output);
 
+        // Varint output_ns, input_residues and residual_ns of every stride, as written by write(output).
+        static std::vector<uint8_t> pack_headers(const encoder_output &output);
+
+        // Number of bytes write(output) produces.
+        static uint64_t size(const encoder_output &output);
+
         void write(const rainman::ptr<uint8_t> &data);
 
+        uint64_t tell();
+
         ~Writer();
     };
 }
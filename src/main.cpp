@@ -1,9 +1,17 @@
 #include <iostream>
 #include <argparse/argparse.h>
 #include <rainman/rainman.h>
-#include <opencl/cl_helper.h>
 #include <multiblob.h>
 #include <backup.h>
+#include <io/writer.h>
+#include <executor.h>
+#include <utils/thread_pool.h>
+#include <utils/simd.h>
+
+#ifdef INTERLACED_ANS_OPENCL
+#include <opencl/cl_helper.h>
+#include <opencl/session.h>
+#endif
 
 int main(int argc, const char *argv[]) {
     argparse::ArgumentParser parser(
@@ -18,14 +26,19 @@ int main(int argc, const char *argv[]) {
 
     parser.add_argument()
             .names({"-x", "--executor"})
-            .description("Executor to use for codec operations (cpu/gpu)")
+            .description("Executor to use for codec operations (cpu/gpu/clcpu/opencl)."
+                         " 'cpu' runs natively on host threads without an OpenCL runtime,"
+                         " 'clcpu' runs the OpenCL kernels on CPU devices and 'opencl' on all OpenCL devices."
+                         " Builds without OpenCL only have 'cpu'.")
             .required(false);
 
+#ifdef INTERLACED_ANS_OPENCL
     parser.add_argument()
             .names({"-P", "--preferreddevice"})
             .description("Preferred OpenCL device to use for codec operations."
                          " Note that this must match the OpenCL device name of the given hardware.")
             .required(false);
+#endif
 
     parser.add_argument()
             .names({"-j", "--jobs"})
@@ -34,7 +47,7 @@ int main(int argc, const char *argv[]) {
 
     parser.add_argument()
             .names({"-t", "--threads"})
-            .description("Number of threads to run in parallel")
+            .description("Number of host threads used by the native (cpu) executor. Defaults to all cores.")
             .required(false);
 
     parser.add_argument()
@@ -47,25 +60,67 @@ int main(int argc, const char *argv[]) {
             .description("Set host memory-usage limit")
             .required(false);
 
+    parser.add_argument()
+            .names({"-n", "--inflight"})
+            .description("Maximum number of blobs in flight between reading, coding and writing."
+                         " This is further limited by the host memory-usage limit.")
+            .required(false);
+
+    parser.add_argument()
+            .names({"--simd"})
+            .description("Widest instruction set used by the native (cpu) decoder (scalar/avx2/avx512)."
+                         " Defaults to the best one the CPU supports.")
+            .required(false);
+
+    parser.add_argument()
+            .names({"-s", "--states"})
+            .description("Number of interleaved rANS states per stride when compressing (1, 2, 4 or 8)."
+                         " Decompression reads it from the file.")
+            .required(false);
+
+    parser.add_argument()
+            .names({"-e", "--engine"})
+            .description("rANS engine used when compressing (rans64/rans32). rans32 needs no 64-bit integer math,"
+                         " which suits GPUs that emulate it. Decompression reads it from the file.")
+            .required(false);
+
+    parser.add_argument()
+            .names({"-w", "--workers"})
+            .description("Number of files processed concurrently in backup mode")
+            .required(false);
+
     parser.add_argument()
             .names({"-i", "--input"})
-            .description("Path for input file/dir")
+            .description("Path for input file/dir, or '-' for stdin")
             .required(false);
 
     parser.add_argument()
             .names({"-o", "--output"})
-            .description("Path for output file/dir")
+            .description("Path for output file/dir, or '-' for stdout")
             .required(false);
 
     parser.add_argument()
             .names({"-m", "--mode"})
-            .description("Mode of operation (c for compression, d for decompression)")
+            .description("Mode of operation (c for compression, d for decompression,"
+                         " r for decompressing the byte range given by --offset and --length)")
             .required(false);
 
+    parser.add_argument()
+            .names({"--offset"})
+            .description("First byte of the original data to decompress in range mode")
+            .required(false);
+
+    parser.add_argument()
+            .names({"--length"})
+            .description("Number of bytes to decompress in range mode. Defaults to the end of the data.")
+            .required(false);
+
+#ifdef INTERLACED_ANS_OPENCL
     parser.add_argument()
             .names({"-l", "--listdevices"})
             .description("List all available OpenCL devices")
             .required(false);
+#endif
 
     parser.add_argument()
             .names({"--backup"})
@@ -77,6 +132,40 @@ int main(int argc, const char *argv[]) {
             .description("Decompress and restore a directory")
             .required(false);
 
+    parser.add_argument()
+            .names({"--archive"})
+            .description("Pack files smaller than 1MB into a shared archive with an index when backing up")
+            .required(false);
+
+    parser.add_argument()
+            .names({"--extract"})
+            .description("Restore a single file, given by its path relative to the backed up directory."
+                         " The input is the backup directory and the output is the restored file.")
+            .required(false);
+
+#ifdef INTERLACED_ANS_OPENCL
+    parser.add_argument()
+            .names({"--clearcache"})
+            .description("Delete all cached OpenCL program binaries")
+            .required(false);
+
+    parser.add_argument()
+            .names({"--nocache"})
+            .description("Always build OpenCL programs from source and do not update the binary cache")
+            .required(false);
+
+    parser.add_argument()
+            .names({"--chunked"})
+            .description("Move blobs to and from OpenCL devices in chunks through pinned buffers, overlapping the transfers with the kernels (experimental)")
+            .required(false);
+
+    parser.add_argument()
+            .names({"--probe"})
+            .description("Time the decode kernels with tables in local and in global memory on every device of the"
+                         " executor for the states (-s) and engine (-e) given, print the timings and exit")
+            .required(false);
+#endif
+
     parser.enable_help();
 
     auto err = parser.parse(argc, argv);
@@ -90,10 +179,12 @@ int main(int argc, const char *argv[]) {
         return 0;
     }
 
+#ifdef INTERLACED_ANS_OPENCL
     if (parser.exists("l")) {
         interlaced_ans::opencl::DeviceProvider::list_available_devices();
         return 0;
     }
+#endif
 
     bool verbose = parser.exists("v");
     std::string executor = "cpu";
@@ -102,8 +193,13 @@ int main(int argc, const char *argv[]) {
     std::string output;
     std::string preferred_device;
     uint64_t jobs = 64;
+    uint64_t threads = 0;
     uint64_t blob_size = 104857600;
     uint64_t max_mem = 1073741824;
+    uint64_t blobs_in_flight = INTERLACED_ANS_DEFAULT_BLOBS_IN_FLIGHT;
+    uint64_t backup_workers = INTERLACED_ANS_DEFAULT_BACKUP_WORKERS;
+    uint64_t states = INTERLACED_ANS_DEFAULT_STATES;
+    interlaced_ans::Engine engine = INTERLACED_ANS_DEFAULT_ENGINE;
 
     if (parser.exists("x")) {
         executor = parser.get<std::string>("x");
@@ -117,32 +213,117 @@ int main(int argc, const char *argv[]) {
     if (parser.exists("o")) {
         output = parser.get<std::string>("o");
     }
+#ifdef INTERLACED_ANS_OPENCL
     if (parser.exists("P")) {
         preferred_device = parser.get<std::string>("P");
     }
+#endif
     if (parser.exists("j")) {
         jobs = parser.get<uint64_t>("j");
     }
+    if (parser.exists("t")) {
+        threads = parser.get<uint64_t>("t");
+    }
     if (parser.exists("b")) {
         blob_size = parser.get<uint64_t>("b");
     }
     if (parser.exists("M")) {
         max_mem = parser.get<uint64_t>("M");
     }
+    if (parser.exists("n")) {
+        blobs_in_flight = parser.get<uint64_t>("n");
+    }
+    if (parser.exists("w")) {
+        backup_workers = parser.get<uint64_t>("w");
+    }
+    if (parser.exists("s")) {
+        states = parser.get<uint64_t>("s");
+    }
+
+#ifdef INTERLACED_ANS_OPENCL
+    interlaced_ans::opencl::ProgramProvider::set_verbose(verbose);
+    interlaced_ans::opencl::ProgramProvider::set_cache_enabled(!parser.exists("nocache"));
+    interlaced_ans::opencl::SessionProvider::set_chunked(parser.exists("chunked"));
+
+    if (parser.exists("clearcache")) {
+        interlaced_ans::opencl::ProgramProvider::clear_cache();
+        if (input.empty()) {
+            return 0;
+        }
+    }
+#endif
 
     // Set memory limit on host-machine
     rainman::Allocator().peak_size(max_mem);
 
+    ThreadPool::set_global_threads(threads);
+
+    if (parser.exists("simd")) {
+        auto simd = parser.get<std::string>("simd");
+
+        if (simd == "scalar") {
+            Simd::set(SimdLevel::SCALAR);
+        } else if (simd == "avx2") {
+            Simd::set(SimdLevel::AVX2);
+        } else if (simd == "avx512") {
+            Simd::set(SimdLevel::AVX512);
+        } else {
+            std::cerr << "Unknown instruction set: " << simd << std::endl;
+            return 1;
+        }
+    }
+
+    if (parser.exists("e")) {
+        auto name = parser.get<std::string>("e");
+
+        if (name == "rans64") {
+            engine = interlaced_ans::Engine::RANS64;
+        } else if (name == "rans32") {
+            engine = interlaced_ans::Engine::RANS32;
+        } else {
+            std::cerr << "Unknown rANS engine: " << name << std::endl;
+            return 1;
+        }
+    }
+
     if (executor == "cpu") {
-        interlaced_ans::opencl::DeviceProvider::load_devices<CL_DEVICE_TYPE_CPU>();
-    } else if (executor == "gpu") {
-        interlaced_ans::opencl::DeviceProvider::load_devices<CL_DEVICE_TYPE_GPU>();
+        interlaced_ans::ExecutorProvider::set(interlaced_ans::Executor::NATIVE);
     } else {
-        interlaced_ans::opencl::DeviceProvider::load_devices<CL_DEVICE_TYPE_ALL>();
-    }
+#ifdef INTERLACED_ANS_OPENCL
+        interlaced_ans::ExecutorProvider::set(interlaced_ans::Executor::OPENCL);
+
+        if (executor == "gpu") {
+            interlaced_ans::opencl::DeviceProvider::load_devices<CL_DEVICE_TYPE_GPU>();
+        } else if (executor == "clcpu") {
+            interlaced_ans::opencl::DeviceProvider::load_devices<CL_DEVICE_TYPE_CPU>();
+        } else {
+            interlaced_ans::opencl::DeviceProvider::load_devices<CL_DEVICE_TYPE_ALL>();
+        }
+
+        // Set opencl preferred device.
+        interlaced_ans::opencl::DeviceProvider::set_preferred_device(preferred_device);
+
+        if (parser.exists("probe")) {
+            if (!interlaced_ans::InterlacedRansCodec::valid_states(states)) {
+                std::cerr << "Number of states must be 1, 2, 4 or 8" << std::endl;
+                return 1;
+            }
+
+            std::cout << "Device\tLocal tables (ms)\tGlobal tables (ms)\tPicked" << std::endl;
+            for (const auto &device: interlaced_ans::opencl::DeviceProvider::devices()) {
+                auto probe = interlaced_ans::InterlacedRansCodec::probe_decode_tables(device, states, engine, verbose);
 
-    // Set opencl preferred device.
-    interlaced_ans::opencl::DeviceProvider::set_preferred_device(preferred_device);
+                std::cout << device.getInfo<CL_DEVICE_NAME>() << "\t" << probe.local_ms << "\t" << probe.global_ms
+                          << "\t" << (probe.global_ms < probe.local_ms ? "global" : "local") << std::endl;
+            }
+
+            return 0;
+        }
+#else
+        std::cerr << "irans was built without OpenCL, only the 'cpu' executor is available" << std::endl;
+        return 1;
+#endif
+    }
 
     if (input.empty()) {
         std::cerr << "Source file/dir not provided" << std::endl;
@@ -154,24 +335,44 @@ int main(int argc, const char *argv[]) {
         return 1;
     }
 
+    // Compressed or decompressed data goes to stdout, so logs are moved out of its way.
+    if (output == INTERLACED_ANS_STDIO_PATH) {
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+
     if (parser.exists("backup")) {
-        auto backup = interlaced_ans::Backup(jobs, blob_size);
+        uint64_t archive_threshold = parser.exists("archive") ? INTERLACED_ANS_DEFAULT_ARCHIVE_THRESHOLD : 0;
+
+        auto backup = interlaced_ans::Backup(jobs, blob_size, backup_workers, max_mem, archive_threshold, states,
+                                             engine);
         backup.backup(input, output);
         return 0;
     } else if (parser.exists("restore")) {
-        auto backup = interlaced_ans::Backup(jobs, blob_size);
+        auto backup = interlaced_ans::Backup(jobs, blob_size, backup_workers, max_mem);
         backup.restore(input, output);
         return 0;
+    } else if (parser.exists("extract")) {
+        auto backup = interlaced_ans::Backup(jobs, blob_size, backup_workers, max_mem);
+        backup.extract(input, parser.get<std::string>("extract"), output);
+        return 0;
     }
 
-    auto codec = interlaced_ans::MultiBlobCodec(jobs, blob_size, verbose);
+    auto codec = interlaced_ans::MultiBlobCodec(jobs, blob_size, verbose, max_mem, blobs_in_flight, states,
+                                                engine);
 
     if (mode == "c") {
         codec.compress_file(input, output);
     } else if (mode == "d") {
         codec.decompress_file(input, output);
+    } else if (mode == "r") {
+        uint64_t offset = parser.exists("offset") ? parser.get<uint64_t>("offset") : 0;
+        uint64_t length = parser.exists("length") ? parser.get<uint64_t>("length") : UINT64_MAX;
+
+        auto data = codec.decompress_range(input, offset, length);
+        interlaced_ans::Writer(output).write(data);
     } else {
-        std::cerr << "Invalid mode. Choose either 'c' for compression or 'd' for decompression." << std::endl;
+        std::cerr << "Invalid mode. Choose either 'c' for compression, 'd' for decompression"
+                     " or 'r' for range decompression." << std::endl;
         return 1;
     }
 }
@@ -2,91 +2,476 @@
 #include <iostream>
 #include <chrono>
 #include <filesystem>
+#include <cstring>
 #include <io/reader.h>
 #include <io/writer.h>
+#include <io/mapped_file.h>
 #include <opencl/freq_dist.h>
 #include <opencl/interlaced_rans64.h>
 #include <errors/base.h>
+#include <utils/pipeline.h>
+#include <executor.h>
+
+#ifdef INTERLACED_ANS_OPENCL
+#include <opencl/scheduler.h>
+#endif
 
 using namespace interlaced_ans;
 
-void MultiBlobCodec::compress_file(const std::string &src, const std::string &dst) {
-    if (src == dst) {
-        throw BaseErrors::InvalidOperationException("Source and destination cannot be the same");
+uint64_t MultiBlobCodec::compute_workers() {
+    if (ExecutorProvider::native()) {
+        return 1;
+    }
+
+#ifdef INTERLACED_ANS_OPENCL
+    // With several devices, extra workers queue blobs in DeviceScheduler so that it can see
+    // the backlog when deciding whether a slower device is worth using.
+    uint64_t n_devices = opencl::DeviceScheduler::size();
+    return n_devices == 1 ? 1 : 2 * n_devices;
+#else
+    return 1;
+#endif
+}
+
+uint64_t MultiBlobCodec::blobs_in_flight(uint64_t n_workers) const {
+    // Each blob in flight holds its input and an output buffer of roughly the same size,
+    // plus per-stride bookkeeping (256 u64 counters and two u64 headers per stride).
+    uint64_t blob_footprint = 2 * _blob_size + _n_kernels * (256 + 2) * sizeof(uint64_t);
+    uint64_t memory_limit = std::max(_max_memory / blob_footprint, uint64_t(1));
+
+    // Keep one blob being read and one being written on top of those being coded.
+    uint64_t wanted = std::max(_max_blobs_in_flight, n_workers + 2);
+
+    return std::max(std::min(wanted, memory_limit), uint64_t(1));
+}
+
+MultiBlobCodec::compressed_blob MultiBlobCodec::encode_blob(const blob_view &data, uint64_t stride_size) {
+    auto freq_dist = FrequencyDistribution(_verbose);
+
+    rainman::ptr<uint64_t> histogram;
+    rainman::ptr<uint64_t> ftable;
+    encoder_output output;
+
+    uint64_t table_size = 0;
+
+    // The histogram is enough to tell that a blob will not shrink, e.g. one that is already compressed.
+    auto compressible = [&]() {
+        table_size = sizeof(uint64_t) + Writer::pack_histogram(histogram).size();
+        return table_size + InterlacedRansCodec::estimate_size(histogram, stride_size, _states) < data.size;
+    };
+
+    if (ExecutorProvider::native()) {
+        histogram = freq_dist.cpu_freq_dist(data.data, data.size);
+        if (!compressible()) {
+            return store_blob(data);
+        }
+
+        ftable = InterlacedRansCodec::normalized(histogram, _engine);
+
+        auto codec = InterlacedRansCodec(ftable, _verbose, _states, _engine);
+        codec.create_ctable();
+
+        output = codec.cpu_encode(data.data, data.size, stride_size);
+    }
+#ifdef INTERLACED_ANS_OPENCL
+    else {
+        auto lease = opencl::DeviceLease(data.size);
+        auto device = lease.device();
+
+        // Counting and encoding run back to back on the device, so a blob that will not shrink is only
+        // detected once it is encoded.
+        auto codec = InterlacedRansCodec(rainman::ptr<uint64_t>(256), _verbose, _states, _engine);
+
+        output = codec.opencl_encode(data.data, data.size, stride_size, device, histogram);
+        lease.complete();
+
+        if (!compressible()) {
+            return store_blob(data);
+        }
+
+        ftable = codec.ftable();
+    }
+#endif
+
+    // Strides that do not compress are already stored, but the blob can still grow by its headers.
+    if (table_size + Writer::size(output) >= data.size) {
+        return store_blob(data);
+    }
+
+    return compressed_blob{.ftable = ftable, .histogram = histogram, .output = output};
+}
+
+MultiBlobCodec::compressed_blob MultiBlobCodec::store_blob(const blob_view &data) {
+    auto bytes = rainman::ptr<uint8_t>(data.size);
+    std::memcpy(bytes.pointer(), data.data, data.size);
+
+    auto blob = compressed_blob{.stored = bytes};
+    blob.output.input_size = data.size;
+
+    return blob;
+}
+
+MultiBlobCodec::compressed_blob MultiBlobCodec::read_blob(Reader &reader, const file_header &header, uint64_t first) {
+    if (first == INTERLACED_ANS_FORMAT_STORED_MARKER) {
+        uint64_t size = reader.read_u64();
+
+        auto blob = compressed_blob{.stored = reader.read_data(size)};
+        blob.output.input_size = size;
+
+        return blob;
+    }
+
+    rainman::ptr<uint64_t> ftable;
+    if (header.version >= INTERLACED_ANS_FORMAT_HISTOGRAM_VERSION) {
+        ftable = InterlacedRansCodec::normalized(reader.read_histogram(first), header.engine);
+    } else {
+        ftable = reader.read_ftable(first);
+    }
+
+    return compressed_blob{.ftable = ftable, .output = reader.read_encoder_output(header)};
+}
+
+void MultiBlobCodec::decode_blob(const compressed_blob &blob, uint8_t *dst) {
+    if (blob.stored) {
+        std::memcpy(dst, blob.stored->pointer(), blob.stored->size());
+        return;
     }
 
+    auto codec = InterlacedRansCodec(blob.ftable, _verbose, 1, blob.output.engine);
+    codec.create_ctable();
+
+    if (ExecutorProvider::native()) {
+        codec.cpu_decode(blob.output, dst);
+    }
+#ifdef INTERLACED_ANS_OPENCL
+    else {
+        auto lease = opencl::DeviceLease(blob.output.input_size);
+        codec.opencl_decode(blob.output, dst, lease.device());
+        lease.complete();
+    }
+#endif
+}
+
+std::vector<uint64_t> MultiBlobCodec::compress_views(
+        const view_reader_t &read,
+        std::optional<uint64_t> size,
+        const std::string &dst,
+        const std::function<void(const blob_view &)> &consumed
+) {
     if (std::filesystem::exists(dst)) {
         throw BaseErrors::InvalidOperationException("Destination is not empty");
     }
 
-    if (!std::filesystem::exists(src) || (std::filesystem::exists(src) && std::filesystem::is_directory(src))) {
-        throw BaseErrors::InvalidOperationException("Source file not found");
+    if (!InterlacedRansCodec::valid_states(_states)) {
+        throw BaseErrors::InvalidOperationException("Number of states must be 1, 2, 4 or 8");
     }
 
-    uint64_t file_size = std::filesystem::file_size(src);
-    uint64_t blob_count = (file_size / _blob_size) + (file_size % _blob_size != 0);
-
     uint64_t stride_size = _blob_size / _n_kernels;
+    if ((stride_size >> 2) < 2 * _states) {
+        throw BaseErrors::InvalidOperationException("Blob size is too small for the number of kernels and states");
+    }
+
     double total_time = 0.0;
 
     auto clock = std::chrono::high_resolution_clock();
     auto start = clock.now();
 
     Writer writer(dst);
-    Reader reader(src);
 
-    writer.write(blob_count);
+    if (size) {
+        writer.write_header((*size / _blob_size) + (*size % _blob_size != 0), _states, _engine);
+    } else {
+        writer.write_header(INTERLACED_ANS_FORMAT_STREAMED, _states, _engine);
+    }
+
+    std::vector<uint64_t> blob_offsets;
+    std::vector<blob_index_entry> index;
+    uint64_t decoded_offset = 0;
 
+    uint64_t n_workers = compute_workers();
+    auto pipeline = Pipeline<blob_view, compressed_blob>(blobs_in_flight(n_workers), n_workers);
     uint64_t counter = 0;
-    while (file_size > 0) {
-        if (_verbose) {
-            std::cout << "[MULTIBLOB]\t\tCompressing blob (" << ++counter << ")" << std::endl;
-        }
 
-        uint64_t curr_blob_size;
-        if (file_size < _blob_size) {
-            curr_blob_size = file_size;
-            file_size = 0;
-        } else {
-            curr_blob_size = _blob_size;
-            file_size -= _blob_size;
-        }
+    pipeline.run(
+            [&]() -> std::optional<blob_view> {
+                if (size && *size == 0) {
+                    return std::nullopt;
+                }
+
+                uint64_t curr_blob_size = size ? std::min(*size, _blob_size) : _blob_size;
+                auto view = read(curr_blob_size);
+
+                if (view.size == 0) {
+                    return std::nullopt;
+                }
+
+                if (size) {
+                    *size -= view.size;
+                }
+
+                return view;
+            },
+            [&](blob_view &tmp_data, uint64_t) {
+                uint64_t blob_index;
+                {
+                    std::unique_lock<std::mutex> lk(_log_mutex);
+                    blob_index = ++counter;
+                    if (_verbose) {
+                        std::cout << "[MULTIBLOB]\t\tCompressing blob (" << blob_index << ")" << std::endl;
+                    }
+                }
+
+                auto start_i = clock.now();
+                auto blob = encode_blob(tmp_data, stride_size);
+
+                if (consumed) {
+                    consumed(tmp_data);
+                }
+
+                auto diff = ((double) (clock.now() - start_i).count()) / 1000000000.0;
+                if (_verbose) {
+                    std::unique_lock<std::mutex> lk(_log_mutex);
+                    std::cout << "[MULTIBLOB]\t\tFinished compressing blob (" << blob_index << ") in " <<
+                              diff << "s" << (blob.stored ? " (stored)" : "") << std::endl;
+
+                    total_time += diff;
+                }
+
+                return blob;
+            },
+            [&](compressed_blob &blob) {
+                uint64_t compressed_offset = writer.tell();
+                blob_offsets.push_back(compressed_offset);
+                index.push_back(blob_index_entry{
+                        .compressed_offset = compressed_offset,
+                        .offset = decoded_offset,
+                        .size = blob.output.input_size
+                });
+
+                decoded_offset += blob.output.input_size;
+
+                if (blob.stored) {
+                    writer.write(INTERLACED_ANS_FORMAT_STORED_MARKER);
+                    writer.write(blob.output.input_size);
+                    writer.write(*blob.stored);
+                } else {
+                    writer.write_histogram(blob.histogram);
+                    writer.write(blob.output);
+                }
+            }
+    );
+
+    if (!size) {
+        writer.write(INTERLACED_ANS_FORMAT_END_MARKER);
+    }
 
-        auto tmp_data = reader.read_data(curr_blob_size);
+    writer.write_index(index);
 
-        auto start_i = clock.now();
-        auto freq_dist = FrequencyDistribution(_verbose);
+    if (_verbose) {
+        std::cout << "[MULTIBLOB]\t\tFinished compressing " << index.size() << " blob(s) in " <<
+                  total_time << "s" << std::endl;
 
-        auto ftable = freq_dist.opencl_freq_dist(tmp_data, stride_size);
-        auto codec = Rans64Codec(ftable, _verbose);
-        codec.normalize();
-        codec.create_ctable();
+        std::cout << "[MULTIBLOB]\t\tOperation finished in " <<
+                  ((double) (clock.now() - start).count()) / 1000000000.0 << "s" << std::endl;
+    }
 
-        auto output = codec.opencl_encode(tmp_data, stride_size);
+    return blob_offsets;
+}
 
-        auto diff = ((double) (clock.now() - start_i).count()) / 1000000000.0;
-        if (_verbose) {
-            std::cout << "[MULTIBLOB]\t\tFinished compressing blob (" << counter << ") in " <<
-                      diff << "s" << std::endl;
+std::vector<uint64_t> MultiBlobCodec::compress(const blob_reader_t &read, uint64_t size, const std::string &dst) {
+    return compress_views(
+            [&](uint64_t blob_size) {
+                auto data = read(blob_size);
+                return blob_view{.data = data.pointer(), .size = data.size(), .offset = 0, .owner = data};
+            },
+            size,
+            dst,
+            {}
+    );
+}
 
-            total_time += diff;
-        }
+void MultiBlobCodec::compress_file(const std::string &src, const std::string &dst) {
+    if (src == dst && src != INTERLACED_ANS_STDIO_PATH) {
+        throw BaseErrors::InvalidOperationException("Source and destination cannot be the same");
+    }
 
-        writer.write(ftable);
-        writer.write(output);
+    if (std::filesystem::exists(dst)) {
+        throw BaseErrors::InvalidOperationException("Destination is not empty");
     }
 
+    if (src == INTERLACED_ANS_STDIO_PATH) {
+        Reader reader(src);
+
+        // The input size is unknown, so blobs are read until stdin ends.
+        compress_views(
+                [&](uint64_t size) {
+                    auto data = reader.read_available(size);
+                    return blob_view{.data = data.pointer(), .size = data.size(), .offset = 0, .owner = data};
+                },
+                std::nullopt,
+                dst,
+                {}
+        );
+
+        return;
+    }
+
+    if (!std::filesystem::exists(src) || (std::filesystem::exists(src) && std::filesystem::is_directory(src))) {
+        throw BaseErrors::InvalidOperationException("Source file not found");
+    }
+
+    uint64_t file_size = std::filesystem::file_size(src);
+    Reader reader(src, true);
+
+    if (!reader.mapped()) {
+        compress([&](uint64_t size) { return reader.read_data(size); }, file_size, dst);
+        return;
+    }
+
+    // Blobs are views into the mapping, whose pages are dropped again once a blob has been encoded.
+    compress_views(
+            [&](uint64_t size) {
+                uint64_t offset = reader.tell();
+                return blob_view{.data = reader.view(size), .size = size, .offset = offset};
+            },
+            file_size,
+            dst,
+            [&](const blob_view &view) { reader.release(view.offset, view.size); }
+    );
+}
+
+uint64_t MultiBlobCodec::decompress_blobs(Reader &reader, MappedFile *dst, const blob_writer_t &write) {
+    auto clock = std::chrono::high_resolution_clock();
+    auto start = clock.now();
+
+    auto header = reader.read_header();
+    uint64_t blob_count = header.blob_count;
+    uint64_t counter = 0;
+    uint64_t decoded_offset = 0;
+    double total_time = 0.0;
+
+    uint64_t n_workers = compute_workers();
+    auto pipeline = Pipeline<compressed_blob, rainman::ptr<uint8_t>>(blobs_in_flight(n_workers), n_workers);
+
+    uint64_t blobs_written = pipeline.run(
+            [&]() -> std::optional<compressed_blob> {
+                uint64_t blob_start = reader.tell();
+
+                if (!header.streamed()) {
+                    if (blob_count == 0) {
+                        return std::nullopt;
+                    }
+
+                    blob_count--;
+                }
+
+                uint64_t first = reader.read_u64();
+
+                // Streamed files end their blobs with a marker instead of a count.
+                if (header.streamed() && first == INTERLACED_ANS_FORMAT_END_MARKER) {
+                    return std::nullopt;
+                }
+
+                auto blob = read_blob(reader, header, first);
+                reader.release(blob_start, reader.tell() - blob_start);
+
+                blob.offset = decoded_offset;
+                decoded_offset += blob.output.input_size;
+
+                return blob;
+            },
+            [&](compressed_blob &blob, uint64_t) {
+                uint64_t blob_index;
+                {
+                    std::unique_lock<std::mutex> lk(_log_mutex);
+                    blob_index = ++counter;
+                    if (_verbose) {
+                        std::cout << "[MULTIBLOB]\t\tDecompressing blob (" << blob_index << ")" << std::endl;
+                    }
+                }
+
+                auto start_i = clock.now();
+
+                rainman::ptr<uint8_t> tmp_data;
+                if (dst != nullptr) {
+                    decode_blob(blob, dst->data() + blob.offset);
+
+                    // Dirty pages stay in the page cache, so dropping them only bounds the resident set.
+                    dst->release(blob.offset, blob.output.input_size);
+                } else {
+                    tmp_data = rainman::ptr<uint8_t>(blob.output.input_size);
+                    decode_blob(blob, tmp_data.pointer());
+                }
+
+                auto diff = ((double) (clock.now() - start_i).count()) / 1000000000.0;
+                if (_verbose) {
+                    std::unique_lock<std::mutex> lk(_log_mutex);
+                    std::cout << "[MULTIBLOB]\t\tFinished decompressing blob (" << blob_index << ") in " <<
+                              diff << "s" << std::endl;
+
+                    total_time += diff;
+                }
+
+                return tmp_data;
+            },
+            write
+    );
+
     if (_verbose) {
-        std::cout << "[MULTIBLOB]\t\tFinished compressing " << blob_count << " blob(s) in " <<
+        std::cout << "[MULTIBLOB]\t\tFinished decompressing " << counter << " blob(s) in " <<
                   total_time << "s" << std::endl;
 
         std::cout << "[MULTIBLOB]\t\tOperation finished in " <<
                   ((double) (clock.now() - start).count()) / 1000000000.0 << "s" << std::endl;
     }
+
+    return blobs_written;
+}
+
+std::vector<blob_index_entry> MultiBlobCodec::blob_index(Reader &reader) {
+    reader.seek(0);
+    auto header = reader.read_header();
+
+    if (header.version != INTERLACED_ANS_FORMAT_LEGACY) {
+        return reader.read_index(header);
+    }
+
+    // Legacy files have no index, but blob headers are enough to rebuild it without decoding anything.
+    std::vector<blob_index_entry> index;
+    uint64_t offset = 0;
+
+    for (uint64_t i = 0; i < header.blob_count; i++) {
+        uint64_t compressed_offset = reader.tell();
+
+        reader.skip(256 * sizeof(uint64_t));
+        uint64_t size = reader.skip_encoder_output(header);
+
+        index.push_back(blob_index_entry{.compressed_offset = compressed_offset, .offset = offset, .size = size});
+        offset += size;
+    }
+
+    return index;
+}
+
+uint64_t MultiBlobCodec::decoded_size(Reader &reader) {
+    auto index = blob_index(reader);
+    reader.seek(0);
+
+    return index.empty() ? 0 : index.back().offset + index.back().size;
+}
+
+uint64_t MultiBlobCodec::decompress(const std::string &src, const blob_writer_t &write) {
+    if (src != INTERLACED_ANS_STDIO_PATH &&
+        (!std::filesystem::exists(src) || (std::filesystem::exists(src) && std::filesystem::is_directory(src)))) {
+        throw BaseErrors::InvalidOperationException("Source file not found");
+    }
+
+    Reader reader(src, true);
+    return decompress_blobs(reader, nullptr, write);
 }
 
 void MultiBlobCodec::decompress_file(const std::string &src, const std::string &dst) {
-    if (src == dst) {
+    if (src == dst && src != INTERLACED_ANS_STDIO_PATH) {
         throw BaseErrors::InvalidOperationException("Source and destination cannot be the same");
     }
 
@@ -94,51 +479,98 @@ void MultiBlobCodec::decompress_file(const std::string &src, const std::string &
         throw BaseErrors::InvalidOperationException("Destination is not empty");
     }
 
+    if (src != INTERLACED_ANS_STDIO_PATH &&
+        (!std::filesystem::exists(src) || (std::filesystem::exists(src) && std::filesystem::is_directory(src)))) {
+        throw BaseErrors::InvalidOperationException("Source file not found");
+    }
+
+    Reader reader(src, true);
+
+    // Pipes can be neither sized up front nor mapped, so blobs are written out in order as they finish.
+    if (!reader.mapped() || dst == INTERLACED_ANS_STDIO_PATH) {
+        Writer writer(dst);
+        decompress_blobs(reader, nullptr, [&](rainman::ptr<uint8_t> &tmp_data) { writer.write(tmp_data); });
+        return;
+    }
+
+    // The destination is sized up front so that workers can decode straight into its mapping.
+    MappedFile output(dst, decoded_size(reader));
+
+    decompress_blobs(reader, &output, [&](rainman::ptr<uint8_t> &) {});
+}
+
+rainman::ptr<uint8_t> MultiBlobCodec::decompress_blob(const std::string &src, uint64_t offset) {
     if (!std::filesystem::exists(src) || (std::filesystem::exists(src) && std::filesystem::is_directory(src))) {
         throw BaseErrors::InvalidOperationException("Source file not found");
     }
 
-    auto clock = std::chrono::high_resolution_clock();
-    auto start = clock.now();
+    Reader reader(src, true);
+    auto header = reader.read_header();
+    reader.seek(offset);
 
-    Writer writer(dst);
-    Reader reader(src);
+    auto blob = read_blob(reader, header, reader.read_u64());
 
-    uint64_t blob_count = reader.read_u64();
-    uint64_t counter = 0;
-    double total_time = 0.0;
+    auto data = rainman::ptr<uint8_t>(blob.output.input_size);
+    decode_blob(blob, data.pointer());
 
-    while (blob_count--) {
-        if (_verbose) {
-            std::cout << "[MULTIBLOB]\t\tDecompressing blob (" << ++counter << ")" << std::endl;
-        }
+    return data;
+}
+
+rainman::ptr<uint8_t> MultiBlobCodec::decompress_range(const std::string &src, uint64_t offset, uint64_t length) {
+    if (!std::filesystem::exists(src) || (std::filesystem::exists(src) && std::filesystem::is_directory(src))) {
+        throw BaseErrors::InvalidOperationException("Source file not found");
+    }
 
-        auto ftable = reader.read_ftable();
-        auto output = reader.read_encoder_output();
+    Reader reader(src, true);
 
-        auto start_i = clock.now();
+    auto header = reader.read_header();
+    auto index = blob_index(reader);
+    uint64_t size = index.empty() ? 0 : index.back().offset + index.back().size;
 
-        auto codec = Rans64Codec(ftable, _verbose);
-        codec.create_ctable();
+    if (offset > size) {
+        throw BaseErrors::InvalidOperationException("Offset is past the end of the decompressed data");
+    }
 
-        auto tmp_data = codec.opencl_decode(output);
+    uint64_t end = offset + std::min(length, size - offset);
+    auto data = rainman::ptr<uint8_t>(end - offset);
 
-        auto diff = ((double) (clock.now() - start_i).count()) / 1000000000.0;
-        if (_verbose) {
-            std::cout << "[MULTIBLOB]\t\tFinished decompressing blob (" << counter << ") in " <<
-                      diff << "s" << std::endl;
+    for (const auto &entry: index) {
+        if (offset == end || entry.offset + entry.size <= offset || entry.offset >= end) {
+            continue;
+        }
 
-            total_time += diff;
+        uint64_t begin_i = std::max(offset, entry.offset) - entry.offset;
+        uint64_t end_i = std::min(end, entry.offset + entry.size) - entry.offset;
+        uint8_t *dst = data.pointer() + (entry.offset + begin_i - offset);
+
+        reader.seek(entry.compressed_offset);
+        uint64_t first = reader.read_u64();
+
+        if (_verbose) {
+            std::cout << "[MULTIBLOB]\t\tDecompressing bytes [" << begin_i << ", " << end_i << ") of blob at offset "
+                      << entry.offset << std::endl;
         }
 
-        writer.write(tmp_data);
-    }
+        // Only the covered bytes of a stored blob are read.
+        if (first == INTERLACED_ANS_FORMAT_STORED_MARKER) {
+            reader.skip(sizeof(uint64_t) + begin_i);
 
-    if (_verbose) {
-        std::cout << "[MULTIBLOB]\t\tFinished decompressing " << counter << " blob(s) in " <<
-                  total_time << "s" << std::endl;
+            auto bytes = reader.read_data(end_i - begin_i);
+            std::memcpy(dst, bytes.pointer(), bytes.size());
+            continue;
+        }
 
-        std::cout << "[MULTIBLOB]\t\tOperation finished in " <<
-                  ((double) (clock.now() - start).count()) / 1000000000.0 << "s" << std::endl;
+        auto blob = read_blob(reader, header, first);
+
+        if (begin_i == 0 && end_i == entry.size) {
+            decode_blob(blob, dst);
+        } else {
+            // Partially covered blobs only decode the strides overlapping the range.
+            auto codec = InterlacedRansCodec(blob.ftable, _verbose, 1, blob.output.engine);
+            codec.create_ctable();
+            codec.cpu_decode_range(blob.output, begin_i, end_i, dst);
+        }
     }
+
+    return data;
 }
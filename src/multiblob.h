@@ -7,25 +7,139 @@
 // Default kernels: 64
 #define INTERLACED_ANS_DEFAULT_N_KERNELS 64
 
+// Default host memory budget: 1GB
+#define INTERLACED_ANS_DEFAULT_MAX_MEMORY 1073741824
+
+// Default blobs in flight: 3 (one being read, one being coded and one being written)
+#define INTERLACED_ANS_DEFAULT_BLOBS_IN_FLIGHT 3
+
+// Default interleaved rANS states per stride: 1
+#define INTERLACED_ANS_DEFAULT_STATES 1
+
+// Default rANS engine: Rans64
+#define INTERLACED_ANS_DEFAULT_ENGINE interlaced_ans::Engine::RANS64
+
 #include <cstdint>
 #include <string>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <optional>
+#include <rainman/rainman.h>
+#include <opencl/interlaced_rans64.h>
+#include <io/format.h>
 
 namespace interlaced_ans {
+    class Reader;
+
+    class MappedFile;
+
     class MultiBlobCodec {
+    public:
+        // Supplies the next 'size' bytes of the input.
+        typedef std::function<rainman::ptr<uint8_t>(uint64_t size)> blob_reader_t;
+
+        // Consumes decoded blobs in their original order.
+        typedef std::function<void(rainman::ptr<uint8_t> &)> blob_writer_t;
+
     private:
+        struct compressed_blob {
+            rainman::ptr<uint64_t> ftable{};
+
+            // Symbol counts the ftable was normalized from, which is what gets written. Not kept when decoding.
+            rainman::ptr<uint64_t> histogram{};
+
+            encoder_output output{};
+
+            // Position of the decoded blob in the destination.
+            uint64_t offset = 0;
+
+            // Bytes of a blob that is stored as it is instead of coded. Only output.input_size is set then.
+            std::optional<rainman::ptr<uint8_t>> stored{};
+        };
+
+        // Symbols of one blob, either owned or viewed in a memory-mapped source.
+        struct blob_view {
+            const uint8_t *data = nullptr;
+            uint64_t size = 0;
+            uint64_t offset = 0;
+            rainman::ptr<uint8_t> owner{};
+        };
+
+        // Returns the next blob of at most 'size' symbols, which is empty at the end of the input.
+        typedef std::function<blob_view(uint64_t size)> view_reader_t;
+
         uint64_t _blob_size;
         uint64_t _n_kernels;
         bool _verbose;
+        uint64_t _max_memory;
+        uint64_t _max_blobs_in_flight;
+        uint64_t _states;
+        Engine _engine;
+        std::mutex _log_mutex;
+
+        static uint64_t compute_workers();
+
+        [[nodiscard]] uint64_t blobs_in_flight(uint64_t n_workers) const;
+
+        compressed_blob encode_blob(const blob_view &data, uint64_t stride_size);
+
+        static compressed_blob store_blob(const blob_view &data);
+
+        // Reads the rest of a blob whose first u64 has already been read.
+        static compressed_blob read_blob(Reader &reader, const file_header &header, uint64_t first);
+
+        void decode_blob(const compressed_blob &blob, uint8_t *dst);
+
+        // Runs the compression pipeline. Without a size the input is read until it ends and the blob count
+        // is left out of the header. 'consumed' is called once a blob's symbols are no longer needed.
+        std::vector<uint64_t> compress_views(
+                const view_reader_t &read,
+                std::optional<uint64_t> size,
+                const std::string &dst,
+                const std::function<void(const blob_view &)> &consumed
+        );
+
+        // Runs the decompression pipeline. Blobs are decoded into 'dst' at their offset if it is set,
+        // otherwise they are handed to 'write' in order.
+        uint64_t decompress_blobs(Reader &reader, MappedFile *dst, const blob_writer_t &write);
+
+        // Reads the blob index, or rebuilds it from the blob headers of a legacy file.
+        static std::vector<blob_index_entry> blob_index(Reader &reader);
+
+        // Sums the decoded sizes of all blobs and rewinds the reader.
+        static uint64_t decoded_size(Reader &reader);
+
     public:
         MultiBlobCodec(
                 uint64_t n_kernels = INTERLACED_ANS_DEFAULT_N_KERNELS,
                 uint64_t blob_size = INTERLACED_ANS_DEFAULT_BLOB_SIZE,
-                bool verbose = false
-        ) : _n_kernels(n_kernels), _blob_size(blob_size), _verbose(verbose) {}
+                bool verbose = false,
+                uint64_t max_memory = INTERLACED_ANS_DEFAULT_MAX_MEMORY,
+                uint64_t max_blobs_in_flight = INTERLACED_ANS_DEFAULT_BLOBS_IN_FLIGHT,
+                uint64_t states = INTERLACED_ANS_DEFAULT_STATES,
+                Engine engine = INTERLACED_ANS_DEFAULT_ENGINE
+        ) : _n_kernels(n_kernels), _blob_size(blob_size), _verbose(verbose), _max_memory(max_memory),
+            _max_blobs_in_flight(max_blobs_in_flight), _states(states), _engine(engine) {}
+
+        // Compresses 'size' bytes obtained from 'read' into dst and returns the byte offset of each blob in dst.
+        std::vector<uint64_t> compress(const blob_reader_t &read, uint64_t size, const std::string &dst);
 
+        // src and dst may be INTERLACED_ANS_STDIO_PATH to stream from stdin or to stdout.
         void compress_file(const std::string &src, const std::string &dst);
 
+        // Decompresses src blob by blob and returns the number of blobs decoded.
+        uint64_t decompress(const std::string &src, const blob_writer_t &write);
+
+        // src and dst may be INTERLACED_ANS_STDIO_PATH to stream from stdin or to stdout.
         void decompress_file(const std::string &src, const std::string &dst);
+
+        // Decodes only the blob starting at 'offset' in src, as returned by compress.
+        rainman::ptr<uint8_t> decompress_blob(const std::string &src, uint64_t offset);
+
+        // Decodes 'length' bytes starting at 'offset' of the original data, touching only the blobs and
+        // strides that cover them. The range is clamped to the end of the data.
+        rainman::ptr<uint8_t> decompress_range(const std::string &src, uint64_t offset, uint64_t length);
     };
 }
 
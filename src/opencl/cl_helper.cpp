@@ -1,14 +1,29 @@
 #include "cl_helper.h"
+#include "session.h"
 #include <errors/opencl.h>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <filesystem>
+#include <system_error>
+#include <cerrno>
+#include <unistd.h>
+#include <openssl/sha.h>
 
 #define INTERLACED_ANS_OPENCL_BUILD_OPTIONS "-cl-std=CL2.0"
 
+// Bump to invalidate every cached program binary after changing how programs are built.
+#define INTERLACED_ANS_OPENCL_CACHE_VERSION "1"
+
 using namespace interlaced_ans::opencl;
 
-std::unordered_map<std::string, cl::Program> ProgramProvider::_program_map;
+std::map<std::pair<std::string, cl_device_id>, cl::Program> ProgramProvider::_program_map;
 std::unordered_map<std::string, std::string> ProgramProvider::_src_map;
 std::mutex ProgramProvider::_mutex;
+bool ProgramProvider::_verbose = false;
+bool ProgramProvider::_cache_enabled = true;
 
 std::vector<cl::Device> DeviceProvider::_devices;
 std::mutex DeviceProvider::_mutex;
@@ -17,13 +32,30 @@ std::string DeviceProvider::_preferred_device_name;
 
 
 cl::Program ProgramProvider::get(const std::string &kernel) {
+    return get(kernel, DeviceProvider::get());
+}
+
+cl::Program ProgramProvider::get(const std::string &kernel, const cl::Device &device) {
     _mutex.lock();
-    if (!_program_map.contains(kernel)) {
+    if (!_src_map.contains(kernel)) {
         _mutex.unlock();
         throw OpenCLErrors::InvalidOperationException("Failed to load unregistered OpenCL kernel");
     }
+
+    // Programs are built lazily, once per device they are used on.
+    auto key = std::make_pair(kernel, device());
+    if (!_program_map.contains(key)) {
+        try {
+            _program_map[key] = build(kernel, _src_map[kernel], device);
+        } catch (...) {
+            _mutex.unlock();
+            throw;
+        }
+    }
+
+    auto program = _program_map[key];
     _mutex.unlock();
-    return _program_map[kernel];
+    return program;
 }
 
 void ProgramProvider::clear() {
@@ -34,47 +66,199 @@ void ProgramProvider::clear() {
 
 void ProgramProvider::register_program(const std::string &name, const std::string &src) {
     _mutex.lock();
-    if (!_program_map.contains(name)) {
+    if (!_src_map.contains(name)) {
+        _src_map[name] = src;
+    }
+    _mutex.unlock();
+}
 
-        auto device = DeviceProvider::get();
-        cl::Context context(device);
-        auto program = cl::Program(context, src);
-        try {
-            program.build(INTERLACED_ANS_OPENCL_BUILD_OPTIONS);
-        } catch (cl::Error &e) {
-            if (e.err() == CL_BUILD_PROGRAM_FAILURE) {
-                // Check the build status
-                cl_build_status status = program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device);
-                if (status != CL_BUILD_ERROR) {
-                    throw e;
-                }
-
-                // Get the build log
-                std::string buildlog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
-                std::cerr << "Build log " << ":" << std::endl
-                          << buildlog << std::endl;
-            } else {
+void ProgramProvider::compile(const std::string &kernel, const cl::Device &device) {
+    get(kernel, device);
+}
+
+cl::Program ProgramProvider::build(const std::string &name, const std::string &src, const cl::Device &device) {
+    auto clock = std::chrono::high_resolution_clock();
+    auto start = clock.now();
+
+    std::string path = _cache_enabled ? cache_path(src, device) : "";
+
+    cl::Program program;
+    if (!path.empty() && load_binary(program, path, device)) {
+        if (_verbose) {
+            std::cout << "[OPENCL]\t\tLoaded cached program '" << name << "' in "
+                      << ((double) (clock.now() - start).count()) / 1000000000.0 << "s" << std::endl;
+        }
+
+        return program;
+    }
+
+    auto context = SessionProvider::get(device)->context();
+    program = cl::Program(context, src);
+    try {
+        program.build(INTERLACED_ANS_OPENCL_BUILD_OPTIONS);
+    } catch (cl::Error &e) {
+        if (e.err() == CL_BUILD_PROGRAM_FAILURE) {
+            // Check the build status
+            cl_build_status status = program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device);
+            if (status != CL_BUILD_ERROR) {
                 throw e;
             }
+
+            // Get the build log
+            std::string buildlog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+            std::cerr << "Build log " << ":" << std::endl
+                      << buildlog << std::endl;
+
+            return program;
+        } else {
+            throw e;
         }
+    }
 
-        _program_map[name] = program;
-        _src_map[name] = src;
+    if (_verbose) {
+        std::cout << "[OPENCL]\t\tBuilt program '" << name << "' from source in "
+                  << ((double) (clock.now() - start).count()) / 1000000000.0 << "s" << std::endl;
     }
-    _mutex.unlock();
+
+    if (!path.empty()) {
+        store_binary(program, path);
+    }
+
+    return program;
 }
 
-void ProgramProvider::compile(const std::string &kernel, const cl::Device &device) {
-    _mutex.lock();
-    if (!_program_map.contains(kernel)) {
-        throw OpenCLErrors::InvalidOperationException("Cannot set device for unregistered OpenCL kernel");
-    } else {
-        cl::Context context(device);
-        auto program = cl::Program(context, _src_map[kernel]);
+std::string ProgramProvider::cache_dir() {
+    if (const char *dir = std::getenv("IRANS_CACHE_DIR")) {
+        return dir;
+    }
+
+    if (const char *dir = std::getenv("XDG_CACHE_HOME")) {
+        return std::string(dir) + "/irans";
+    }
+
+    if (const char *dir = std::getenv("HOME")) {
+        return std::string(dir) + "/.cache/irans";
+    }
+
+    return "";
+}
+
+std::string ProgramProvider::cache_path(const std::string &src, const cl::Device &device) {
+    std::string dir = cache_dir();
+    if (dir.empty()) {
+        return "";
+    }
+
+    std::string key = std::string(INTERLACED_ANS_OPENCL_CACHE_VERSION) + '\0' +
+                      device.getInfo<CL_DEVICE_NAME>() + '\0' +
+                      device.getInfo<CL_DEVICE_VERSION>() + '\0' +
+                      device.getInfo<CL_DRIVER_VERSION>() + '\0' +
+                      INTERLACED_ANS_OPENCL_BUILD_OPTIONS + '\0' +
+                      src;
+
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char *) key.c_str(), key.length(), hash);
+
+    std::stringstream ss;
+    for (unsigned char i : hash) {
+        ss << std::hex << std::setw(2) << std::setfill('0') << (int) i;
+    }
+
+    return dir + "/" + ss.str() + ".bin";
+}
+
+bool ProgramProvider::load_binary(cl::Program &program, const std::string &path, const cl::Device &device) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    std::vector<unsigned char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (binary.empty()) {
+        return false;
+    }
+
+    // A stale or corrupt binary is not fatal, the program is rebuilt from source and the entry replaced.
+    try {
+        auto context = SessionProvider::get(device)->context();
+        program = cl::Program(context, {device}, cl::Program::Binaries{binary});
         program.build(INTERLACED_ANS_OPENCL_BUILD_OPTIONS);
-        _program_map[kernel] = program;
+    } catch (cl::Error &) {
+        return false;
     }
-    _mutex.unlock();
+
+    return true;
+}
+
+void ProgramProvider::store_binary(const cl::Program &program, const std::string &path) {
+    try {
+        auto binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+        if (binaries.empty() || binaries.front().empty()) {
+            return;
+        }
+
+        std::filesystem::create_directories(std::filesystem::path(path).parent_path());
+
+        // Write to a uniquely named temporary file first so concurrent irans processes never read a partial binary.
+        std::string tmp_path = path + ".XXXXXX";
+        int fd = mkstemp(tmp_path.data());
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), tmp_path);
+        }
+
+        const auto &binary = binaries.front();
+        uint64_t written = 0;
+
+        while (written < binary.size()) {
+            ssize_t n = ::write(fd, binary.data() + written, binary.size() - written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (n <= 0) {
+                int error = n < 0 ? errno : EIO;
+                close(fd);
+                unlink(tmp_path.c_str());
+                throw std::system_error(error, std::generic_category(), tmp_path);
+            }
+
+            written += n;
+        }
+
+        close(fd);
+
+        try {
+            std::filesystem::rename(tmp_path, path);
+        } catch (std::exception &) {
+            unlink(tmp_path.c_str());
+            throw;
+        }
+    } catch (std::exception &e) {
+        if (_verbose) {
+            std::cerr << "[OPENCL]\t\tCould not cache program binary: " << e.what() << std::endl;
+        }
+    }
+}
+
+void ProgramProvider::clear_cache() {
+    std::string dir = cache_dir();
+    if (dir.empty() || !std::filesystem::is_directory(dir)) {
+        return;
+    }
+
+    for (auto &p : std::filesystem::directory_iterator(dir)) {
+        if (p.path().extension() == ".bin") {
+            std::filesystem::remove(p.path());
+        }
+    }
+}
+
+void ProgramProvider::set_verbose(bool verbose) {
+    _verbose = verbose;
+}
+
+void ProgramProvider::set_cache_enabled(bool enabled) {
+    _cache_enabled = enabled;
 }
 
 cl::Kernel KernelProvider::get(const std::string &kernel) {
@@ -85,4 +269,9 @@ cl::Kernel KernelProvider::get(const std::string &kernel) {
 cl::Kernel KernelProvider::get(const std::string &kernel, const std::string &name) {
     cl::Program program = ProgramProvider::get(kernel);
     return cl::Kernel(program, name.c_str());
+}
+
+cl::Kernel KernelProvider::get(const std::string &kernel, const std::string &name, const cl::Device &device) {
+    cl::Program program = ProgramProvider::get(kernel, device);
+    return cl::Kernel(program, name.c_str());
 }
\ No newline at end of file
@@ -4,25 +4,49 @@
 #include <cstdint>
 #include <string>
 #include <unordered_map>
+#include <map>
 #include <mutex>
 #include <CL/opencl.hpp>
 #include <errors/opencl.h>
 #include <iostream>
+#include "session.h"
+#include "scheduler.h"
 
 namespace interlaced_ans::opencl {
     class ProgramProvider {
     private:
-        static std::unordered_map<std::string, cl::Program> _program_map;
+        static std::map<std::pair<std::string, cl_device_id>, cl::Program> _program_map;
         static std::unordered_map<std::string, std::string> _src_map;
         static std::mutex _mutex;
+        static bool _verbose;
+        static bool _cache_enabled;
+
+        static cl::Program build(const std::string &name, const std::string &src, const cl::Device &device);
+
+        static std::string cache_path(const std::string &src, const cl::Device &device);
+
+        static bool load_binary(cl::Program &program, const std::string &path, const cl::Device &device);
+
+        static void store_binary(const cl::Program &program, const std::string &path);
     public:
         static cl::Program get(const std::string &kernel);
 
+        static cl::Program get(const std::string &kernel, const cl::Device &device);
+
         static void register_program(const std::string &name, const std::string &src);
 
         static void compile(const std::string &kernel, const cl::Device &device);
 
         static void clear();
+
+        static void set_verbose(bool verbose);
+
+        // Program binaries are cached on disk, keyed by device, driver, build options and source.
+        static void set_cache_enabled(bool enabled);
+
+        static std::string cache_dir();
+
+        static void clear_cache();
     };
 
     class DeviceProvider {
@@ -47,7 +71,10 @@ namespace interlaced_ans::opencl {
             }
 
             ProgramProvider::clear();
+            SessionProvider::clear();
             _mutex.unlock();
+
+            DeviceScheduler::clear();
         }
 
         static void list_available_devices() {
@@ -88,6 +115,22 @@ namespace interlaced_ans::opencl {
             return device;
         }
 
+        // Devices to schedule work on: only the preferred device if one was selected, otherwise all of them.
+        static std::vector<cl::Device> devices() {
+            _mutex.lock();
+            if (_devices.empty()) {
+                _mutex.unlock();
+                throw OpenCLErrors::InvalidOperationException("No devices were loaded");
+            }
+
+            std::vector<cl::Device> devices = _devices;
+            if (!_preferred_device_name.empty()) {
+                devices = {_devices[_device_index]};
+            }
+            _mutex.unlock();
+            return devices;
+        }
+
         static bool empty() {
             _mutex.lock();
             bool v = _devices.empty();
@@ -119,6 +162,8 @@ namespace interlaced_ans::opencl {
             }
 
             _mutex.unlock();
+
+            DeviceScheduler::clear();
         }
     };
 
@@ -127,6 +172,8 @@ namespace interlaced_ans::opencl {
         static cl::Kernel get(const std::string &kernel);
 
         static cl::Kernel get(const std::string &kernel, const std::string &name);
+
+        static cl::Kernel get(const std::string &kernel, const std::string &name, const cl::Device &device);
     };
 }
 
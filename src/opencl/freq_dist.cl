@@ -1,25 +1,74 @@
 R"(
-  
-  
-  __kernel void run(
-	  __global unsigned char *arr,
-	  __global unsigned long int *out,
-	  const unsigned long int n,
-	  const unsigned long int s,
-	  const unsigned long int arr_size
+
+#define u64 unsigned long int
+#define u32 unsigned int
+#define u8 unsigned char
+
+// Sub-histograms per work group. Spreading lanes over copies reduces atomic contention on skewed data.
+#define N_COPIES 4
+
+/*
+ * Every work group counts the symbols of its 'local_size' strides into local memory and writes
+ * one 256-entry partial histogram. Lanes walk the group's range interleaved so loads coalesce.
+ */
+__kernel void run(
+	__global u8 *arr,
+	__global u64 *partials,
+	const u64 n,
+	const u64 s,
+	const u64 arr_size
 ) {
-	unsigned long int tid = get_global_id(0);
-	if (tid >= n) {
-		return;
+	__local u32 hist[N_COPIES * 256];
+	
+	u64 lid = get_local_id(0);
+	u64 local_size = get_local_size(0);
+	u64 group_id = get_group_id(0);
+	
+	for (u64 i = lid; i < N_COPIES * 256; i += local_size) {
+		hist[i] = 0;
+	}
+	
+	barrier(CLK_LOCAL_MEM_FENCE);
+	
+	u64 start_index = group_id * local_size * s;
+	u64 end_index = start_index + local_size * s;
+	if (end_index > arr_size) {
+		end_index = arr_size;
+	}
+	
+	__local u32 *sub_hist = hist + (lid % N_COPIES) * 256;
+	for (u64 i = start_index + lid; i < end_index; i += local_size) {
+		atomic_inc(&sub_hist[arr[i]]);
 	}
 	
-	unsigned long int out_offset = 256 * tid;
-	unsigned long int start_index = s * tid;
-	unsigned long int end_index = start_index + s - 1;
+	barrier(CLK_LOCAL_MEM_FENCE);
 	
-	for (unsigned long int i = start_index; (i <= end_index) && (i < arr_size); i++) {
-		out[out_offset + arr[i]]++;
+	for (u64 i = lid; i < 256; i += local_size) {
+		u64 count = 0;
+		for (u32 j = 0; j < N_COPIES; j++) {
+			count += hist[j * 256 + i];
+		}
+		
+		partials[group_id * 256 + i] = count;
+	}
+}
+
+__kernel void reduce(
+	__global u64 *partials,
+	__global u64 *out,
+	const u64 n_groups
+) {
+	u64 symbol = get_global_id(0);
+	if (symbol >= 256) {
+		return;
 	}
-} 
-  
-)"
\ No newline at end of file
+	
+	u64 count = 0;
+	for (u64 i = 0; i < n_groups; i++) {
+		count += partials[i * 256 + symbol];
+	}
+	
+	out[symbol] = count;
+}
+
+)"
@@ -1,58 +1,78 @@
 #include "freq_dist.h"
 #include <iostream>
+#include <cstring>
+#include <utils/thread_pool.h>
 
+// Smallest amount of input worth handing to another thread.
+#define FREQ_DIST_MIN_CHUNK_SIZE 0x100000
 
-using namespace interlaced_ans;
-
-void FrequencyDistribution::register_kernel() {
-    opencl::ProgramProvider::register_program("freq_dist",
+// Input counted into 32-bit sub-histograms before they are flushed.
+#define FREQ_DIST_BLOCK_SIZE 0x40000000
 
-#include "freq_dist.cl"
+using namespace interlaced_ans;
 
-    );
+rainman::ptr<uint64_t> FrequencyDistribution::cpu_freq_dist(const rainman::ptr<uint8_t> &input) {
+    return cpu_freq_dist(input.pointer(), input.size());
 }
 
-rainman::ptr<uint64_t> FrequencyDistribution::opencl_freq_dist(const rainman::ptr<uint8_t> &input, uint64_t stride_size) {
-    register_kernel();
-
-    auto kernel = opencl::KernelProvider::get("freq_dist");
-    auto context = kernel.getInfo<CL_KERNEL_CONTEXT>();
-    auto device = context.getInfo<CL_CONTEXT_DEVICES>().front();
+rainman::ptr<uint64_t> FrequencyDistribution::cpu_freq_dist(const uint8_t *input, uint64_t n) {
+    auto &pool = ThreadPool::global();
 
     if (_verbose) {
-        std::cout << "[OPENCL]\t\tRunning 'freq_dist.run' kernels on device: "
-                  << device.getInfo<CL_DEVICE_NAME>() << std::endl;
+        std::cout << "[NATIVE]\t\tRunning 'freq_dist.run' on " << pool.threads() << " thread(s)" << std::endl;
     }
 
-    uint64_t local_size = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
-
-    uint64_t n = input.size();
-    uint64_t true_size = (n / stride_size) + (n % stride_size != 0);
-    uint64_t global_size = (true_size / local_size + (true_size % local_size != 0)) * local_size;
-
-    auto queue = cl::CommandQueue(context, device, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
-
-    cl::Buffer buf_a(context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR, input.size() * sizeof(uint8_t), input.pointer());
-    cl::Buffer buf_b(context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, true_size * 256 * sizeof(uint64_t));
-    auto host_ptr = rainman::ptr<uint64_t>(true_size << 8);
-
-    kernel.setArg(0, buf_a);
-    kernel.setArg(1, buf_b);
-    kernel.setArg(2, true_size);
-    kernel.setArg(3, stride_size);
-    kernel.setArg(4, input.size());
-
-    queue.enqueueNDRangeKernel(kernel, cl::NDRange(0), cl::NDRange(global_size), cl::NDRange(local_size));
-    queue.enqueueBarrierWithWaitList();
-
-    queue.enqueueReadBuffer(buf_b, CL_FALSE, 0, true_size * 256 * sizeof(uint64_t), host_ptr.pointer());
-    queue.finish();
+    // Counting is order independent, so the blob is split evenly between threads.
+    uint64_t n_chunks = std::max(std::min(pool.threads(), n / FREQ_DIST_MIN_CHUNK_SIZE), uint64_t(1));
+    auto partials = rainman::ptr<uint64_t>(n_chunks << 8);
+
+    pool.parallel_for(n_chunks, [&](uint64_t chunk) {
+        const uint8_t *arr = input;
+        uint64_t *out = partials.pointer() + (chunk << 8);
+
+        uint64_t start_index = n * chunk / n_chunks;
+        uint64_t end_index = n * (chunk + 1) / n_chunks;
+
+        // Four sub-histograms break the store-to-load dependency between equal neighbouring symbols.
+        // Counts are flushed before the 32-bit counters can overflow.
+        uint32_t hist[4][256];
+
+        while (start_index < end_index) {
+            uint64_t block_end = std::min(end_index, start_index + FREQ_DIST_BLOCK_SIZE);
+            std::memset(hist, 0, sizeof(hist));
+
+            uint64_t i = start_index;
+            for (; i + 8 <= block_end; i += 8) {
+                uint64_t word;
+                std::memcpy(&word, arr + i, sizeof(word));
+
+                hist[0][word & 0xff]++;
+                hist[1][(word >> 8) & 0xff]++;
+                hist[2][(word >> 16) & 0xff]++;
+                hist[3][(word >> 24) & 0xff]++;
+                hist[0][(word >> 32) & 0xff]++;
+                hist[1][(word >> 40) & 0xff]++;
+                hist[2][(word >> 48) & 0xff]++;
+                hist[3][word >> 56]++;
+            }
+
+            for (; i < block_end; i++) {
+                hist[0][arr[i]]++;
+            }
+
+            for (uint16_t j = 0; j < 256; j++) {
+                out[j] += (uint64_t) hist[0][j] + hist[1][j] + hist[2][j] + hist[3][j];
+            }
+
+            start_index = block_end;
+        }
+    });
 
     auto result = rainman::ptr<uint64_t>(256);
 
-    for (uint64_t i = 0; i < true_size; i++) {
+    for (uint64_t i = 0; i < n_chunks; i++) {
         for (uint16_t j = 0; j < 256; j++) {
-            result[j] += host_ptr[(i << 8) + j];
+            result[j] += partials[(i << 8) + j];
         }
     }
 
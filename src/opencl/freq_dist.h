@@ -2,18 +2,65 @@
 #define INTERLACED_ANS_FREQ_DIST_H
 
 #include <rainman/rainman.h>
+
+#ifdef INTERLACED_ANS_OPENCL
 #include "cl_helper.h"
+#include "session.h"
+#endif
 
 namespace interlaced_ans {
     class FrequencyDistribution {
     private:
         bool _verbose;
+
+#ifdef INTERLACED_ANS_OPENCL
         static void register_kernel();
 
+        // Runs the histogram kernels on an uploaded blob. The session must be locked.
+        rainman::ptr<uint64_t> run_kernels(
+                opencl::Session &session,
+                const cl::Buffer &buf_input,
+                uint64_t n,
+                uint64_t stride_size
+        );
+#endif
+
     public:
         FrequencyDistribution(bool verbose = false) : _verbose(verbose) {};
 
+#ifdef INTERLACED_ANS_OPENCL
+        // Enqueues the histogram kernels on an uploaded blob and returns the buffer that receives the 256 counts,
+        // without waiting for them. The session must be locked.
+        cl::Buffer enqueue_kernels(
+                opencl::Session &session,
+                const cl::Buffer &buf_input,
+                uint64_t n,
+                uint64_t stride_size
+        );
+
+        // The blob stays on the device for an opencl_encode() of the same memory, which drops it. Callers that free
+        // it without encoding invalidate INTERLACED_ANS_OPENCL_BLOB_BUFFER in the device's session first.
         rainman::ptr<uint64_t> opencl_freq_dist(const rainman::ptr<uint8_t> &input, uint64_t stride_size = 64);
+
+        rainman::ptr<uint64_t> opencl_freq_dist(
+                const rainman::ptr<uint8_t> &input,
+                uint64_t stride_size,
+                const cl::Device &device
+        );
+
+        // Counts 'n' symbols in place, e.g. from a memory-mapped view.
+        rainman::ptr<uint64_t> opencl_freq_dist(
+                const uint8_t *input,
+                uint64_t n,
+                uint64_t stride_size,
+                const cl::Device &device
+        );
+#endif
+
+        // Strides do not matter on the host, which splits the blob evenly between threads.
+        rainman::ptr<uint64_t> cpu_freq_dist(const rainman::ptr<uint8_t> &input);
+
+        rainman::ptr<uint64_t> cpu_freq_dist(const uint8_t *input, uint64_t n);
     };
 }
 
@@ -0,0 +1,116 @@
+#include "freq_dist.h"
+#include <iostream>
+
+using namespace interlaced_ans;
+
+void FrequencyDistribution::register_kernel() {
+    opencl::ProgramProvider::register_program("freq_dist",
+
+#include "freq_dist.cl"
+
+    );
+}
+
+rainman::ptr<uint64_t> FrequencyDistribution::opencl_freq_dist(const rainman::ptr<uint8_t> &input, uint64_t stride_size) {
+    return opencl_freq_dist(input, stride_size, opencl::DeviceProvider::get());
+}
+
+rainman::ptr<uint64_t> FrequencyDistribution::opencl_freq_dist(
+        const rainman::ptr<uint8_t> &input,
+        uint64_t stride_size,
+        const cl::Device &device
+) {
+    register_kernel();
+
+    auto session = opencl::SessionProvider::get(device);
+    std::unique_lock<std::mutex> lk(session->mutex());
+    auto guard = opencl::ResidencyGuard(*session, lk, {INTERLACED_ANS_OPENCL_BLOB_BUFFER});
+
+    auto buf_input = session->upload(INTERLACED_ANS_OPENCL_BLOB_BUFFER, input);
+    auto histogram = run_kernels(*session, buf_input, input.size(), stride_size);
+
+    // Left resident for opencl_encode().
+    guard.dismiss();
+    return histogram;
+}
+
+rainman::ptr<uint64_t> FrequencyDistribution::opencl_freq_dist(
+        const uint8_t *input,
+        uint64_t n,
+        uint64_t stride_size,
+        const cl::Device &device
+) {
+    register_kernel();
+
+    auto session = opencl::SessionProvider::get(device);
+    std::unique_lock<std::mutex> lk(session->mutex());
+    auto guard = opencl::ResidencyGuard(*session, lk, {INTERLACED_ANS_OPENCL_BLOB_BUFFER});
+
+    auto buf_input = session->upload(INTERLACED_ANS_OPENCL_BLOB_BUFFER, input, n);
+    auto histogram = run_kernels(*session, buf_input, n, stride_size);
+
+    // Left resident for opencl_encode().
+    guard.dismiss();
+    return histogram;
+}
+
+rainman::ptr<uint64_t> FrequencyDistribution::run_kernels(
+        opencl::Session &session,
+        const cl::Buffer &buf_input,
+        uint64_t n,
+        uint64_t stride_size
+) {
+    auto buf_output = enqueue_kernels(session, buf_input, n, stride_size);
+    auto result = rainman::ptr<uint64_t>(256);
+
+    session.queue().enqueueReadBuffer(buf_output, CL_TRUE, 0, 256 * sizeof(uint64_t), result.pointer());
+    return result;
+}
+
+cl::Buffer FrequencyDistribution::enqueue_kernels(
+        opencl::Session &session,
+        const cl::Buffer &buf_input,
+        uint64_t n,
+        uint64_t stride_size
+) {
+    register_kernel();
+
+    auto &device = session.device();
+    auto kernel = session.kernel("freq_dist", "run");
+    auto &queue = session.queue();
+
+    if (_verbose) {
+        std::cout << "[OPENCL]\t\tRunning 'freq_dist.run' kernels on device: "
+                  << device.getInfo<CL_DEVICE_NAME>() << std::endl;
+    }
+
+    uint64_t local_size = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+
+    // Work groups count into 32-bit local counters.
+    while (local_size > 1 && local_size * stride_size > UINT32_MAX) {
+        local_size >>= 1;
+    }
+
+    uint64_t true_size = (n / stride_size) + (n % stride_size != 0);
+    uint64_t global_size = (true_size / local_size + (true_size % local_size != 0)) * local_size;
+    uint64_t n_groups = global_size / local_size;
+
+    auto buf_partials = session.buffer("freq_dist.partials", n_groups * 256 * sizeof(uint64_t));
+    auto buf_output = session.buffer("freq_dist.output", 256 * sizeof(uint64_t));
+
+    kernel.setArg(0, buf_input);
+    kernel.setArg(1, buf_partials);
+    kernel.setArg(2, true_size);
+    kernel.setArg(3, stride_size);
+    kernel.setArg(4, n);
+
+    auto reduce_kernel = session.kernel("freq_dist", "reduce");
+    reduce_kernel.setArg(0, buf_partials);
+    reduce_kernel.setArg(1, buf_output);
+    reduce_kernel.setArg(2, n_groups);
+
+    queue.enqueueNDRangeKernel(kernel, cl::NDRange(0), cl::NDRange(global_size), cl::NDRange(local_size));
+    queue.enqueueNDRangeKernel(reduce_kernel, cl::NDRange(0), cl::NDRange(256));
+
+    return buf_output;
+}
@@ -0,0 +1,208 @@
+R"(
+/* Rans32 OpenCL implementation, appended to interlaced_rans64.cl with RANS32 defined.
+ * SCALE: 16
+ *
+ * The state stays in [2^16, 2^32) and is renormalized 16 bits at a time, so coding needs no 64-bit multiply
+ * or divide. A stride's 16-bit units fill its words from the low half up. The final states follow as two units
+ * each, low half first, and a zero unit pads an odd count. The high unit of a state is never zero, which is how
+ * the decoder tells a padded last word from a full one.
+ */
+
+#ifdef STATES
+#define LANES STATES
+#else
+#define LANES 1
+#endif
+
+#define RANS32_LOWER_BOUND (1u << 16)
+
+/* Appends a unit to the stride's words. A word is written once both of its halves are known. */
+void put_unit(__global u32 *output_ptr, u64 tile, u64 *units, u32 *pending, u32 unit) {
+	if (*units & 1) {
+		output_ptr[(*units >> 1) * tile] = *pending | (unit << 16);
+	} else {
+		*pending = unit;
+	}
+
+	(*units)++;
+}
+
+u32 get_unit(__global u32 *output_ptr, u64 tile, u64 unit) {
+	return (output_ptr[(unit >> 1) * tile] >> ((unit & 1) << 4)) & 0xffff;
+}
+
+/* Renormalizes x if needed and returns ((x / freq) << SCALE) + start + (x % freq). */
+u32 encode_symbol(u32 x, rans32_enc_symbol symbol, __global u32 *output_ptr, u64 tile, u64 *units, u32 *pending) {
+	if ((x >> (32 - SCALE)) >= symbol.freq) {
+		put_unit(output_ptr, tile, units, pending, x & 0xffff);
+		x >>= 16;
+	}
+
+	return ((x / symbol.freq) << SCALE) + symbol.start + (x % symbol.freq);
+}
+
+/* Writes the symbol that x decodes to and returns the state before it was coded. */
+u32 decode_symbol(
+	u32 x,
+	__global u8 *symbol_ptr,
+	TABLE table_t *freqs,
+	TABLE table_t *starts,
+	TABLE u8 *lookup,
+	__global u32 *output_ptr,
+	u64 tile,
+	u64 *units
+) {
+	const u32 mask = (1u << SCALE) - 1;
+
+	u8 symbol = inv_bs(starts, lookup, x & mask);
+	*symbol_ptr = symbol;
+
+	x = (u32) (freqs[symbol] * (x >> SCALE) + (x & mask) - starts[symbol]);
+
+	if (x < RANS32_LOWER_BOUND) {
+		x = (x << 16) | get_unit(output_ptr, tile, --(*units));
+	}
+
+	return x;
+}
+
+/* Symbol i of a stride is coded by state i % LANES, with the same grouping as the interleaved Rans64 kernels. */
+__kernel void encode(
+	__global u8 *input,
+	const u64 input_n,
+	__global rans32_enc_symbol *etable,
+	__global u32 *output,
+	__global u64 *output_ns,
+	__global u64 *input_residues,
+	const u64 output_size,
+	const u64 n,
+	const u64 stride_size,
+	const u64 tile
+) {
+	u64 tid = get_global_id(0);
+	if (tid >= n) {
+		return;
+	}
+
+	u64 input_start_index = tid * stride_size;
+	u64 input_end_index = input_start_index + stride_size - 1;
+
+	if (input_end_index >= input_n) {
+		input_end_index = input_n - 1;
+	}
+
+	u64 input_size = input_end_index - input_start_index + 1;
+	__global u8 *stride = input + tile_base(tid, stride_size, tile);
+
+	u64 output_unit_size = stride_size >> 2;
+	__global u32 *output_ptr = output + tile_base(tid, output_unit_size, tile);
+
+	/* Every symbol emits at most one unit, the final states take two units each and one more may pad them. */
+	const u64 limit = 2 * output_unit_size - 2 * LANES - 1;
+
+	u32 state[LANES];
+
+	#pragma unroll
+	for (u32 j = 0; j < LANES; j++) {
+		state[j] = RANS32_LOWER_BOUND;
+	}
+
+	u64 units = 0;
+	u32 pending = 0;
+	u64 tail = input_size % LANES;
+	u64 input_index = input_size;
+
+	if (tail <= limit) {
+		for (; input_index > input_size - tail; input_index--) {
+			u64 j = (input_index - 1) % LANES;
+			state[j] = encode_symbol(state[j], etable[stride[(input_index - 1) * tile]], output_ptr, tile, &units,
+			                         &pending);
+		}
+
+		for (; input_index != 0 && units + LANES <= limit; input_index -= LANES) {
+			#pragma unroll
+			for (int j = LANES - 1; j >= 0; j--) {
+				state[j] = encode_symbol(state[j], etable[stride[(input_index - LANES + j) * tile]], output_ptr,
+				                         tile, &units, &pending);
+			}
+		}
+	}
+
+	input_residues[tid] = input_index;
+
+	#pragma unroll
+	for (u32 j = 0; j < LANES; j++) {
+		put_unit(output_ptr, tile, &units, &pending, state[j] & 0xffff);
+		put_unit(output_ptr, tile, &units, &pending, state[j] >> 16);
+	}
+
+	if (units & 1) {
+		put_unit(output_ptr, tile, &units, &pending, 0);
+	}
+
+	output_ns[tid] = units >> 1;
+}
+
+__kernel void decode(
+	__global u8 *input,
+	const u64 input_n,
+	__global u64 *ftable,
+	__global u64 *ctable,
+	__global u32 *output,
+	__global u64 *output_ns,
+	__global u64 *input_residues,
+	const u64 output_size,
+	const u64 n,
+	const u64 stride_size,
+	__global u8 *dtable,
+	const u64 tile
+) {
+	DECODE_TABLES
+
+	u64 tid = get_global_id(0);
+	if (tid >= n || output_ns[tid] == 0) {
+		return;
+	}
+
+	u64 input_start_index = tid * stride_size;
+	u64 input_end_index = input_start_index + stride_size - 1;
+
+	if (input_end_index >= input_n) {
+		input_end_index = input_n - 1;
+	}
+
+	u64 input_size = input_end_index - input_start_index + 1;
+	__global u8 *stride = input + tile_base(tid, stride_size, tile);
+	__global u32 *output_ptr = output + tile_base(tid, stride_size >> 2, tile);
+
+	u64 units = 2 * output_ns[tid];
+	if ((output_ptr[(output_ns[tid] - 1) * tile] >> 16) == 0) {
+		units--;
+	}
+
+	u32 state[LANES];
+
+	#pragma unroll
+	for (int j = LANES - 1; j >= 0; j--) {
+		u32 x = get_unit(output_ptr, tile, --units) << 16;
+		state[j] = x | get_unit(output_ptr, tile, --units);
+	}
+
+	u64 input_index = input_residues[tid];
+	u64 groups_end = input_size - input_size % LANES;
+
+	for (; input_index < groups_end; input_index += LANES) {
+		#pragma unroll
+		for (u32 j = 0; j < LANES; j++) {
+			state[j] = decode_symbol(state[j], stride + (input_index + j) * tile, freqs, starts, lookup, output_ptr,
+			                         tile, &units);
+		}
+	}
+
+	for (; input_index < input_size; input_index++) {
+		u64 j = input_index % LANES;
+		state[j] = decode_symbol(state[j], stride + input_index * tile, freqs, starts, lookup, output_ptr, tile,
+		                         &units);
+	}
+}
+)"
@@ -0,0 +1,282 @@
+#include "interlaced_rans64.h"
+#include <errors/base.h>
+#include <algorithm>
+
+using namespace interlaced_ans;
+
+/*
+ * Host implementation of the Rans32 engine. States stay in [2^16, 2^32) and renormalize 16 bits at a time.
+ * The 16-bit units of a stream fill its words from the low half up, followed by the final states as two
+ * units each, low half first. A zero unit pads an odd count; since the high unit of a state is never zero,
+ * a last word with a zero high half is known to be padded.
+ */
+
+namespace {
+    const uint32_t lower_bound = 1u << 16;
+    const uint32_t slot_mask = (1u << RANS32_SCALE) - 1;
+
+    class unit_writer {
+    public:
+        explicit unit_writer(uint32_t *words) : _words(words) {}
+
+        void put(uint32_t unit) {
+            if (_units & 1) {
+                _words[_units >> 1] |= unit << 16;
+            } else {
+                _words[_units >> 1] = unit;
+            }
+
+            _units++;
+        }
+
+        void put_state(uint32_t x) {
+            put(x & 0xffff);
+            put(x >> 16);
+        }
+
+        // Pads the units to whole words and returns the number of words.
+        uint64_t finish() {
+            if (_units & 1) {
+                put(0);
+            }
+
+            return _units >> 1;
+        }
+
+        [[nodiscard]] uint64_t units() const {
+            return _units;
+        }
+
+    private:
+        uint32_t *_words;
+        uint64_t _units = 0;
+    };
+
+    class unit_reader {
+    public:
+        unit_reader(const uint32_t *words, uint64_t n_words) : _words(words), _units(2 * n_words) {
+            if ((words[n_words - 1] >> 16) == 0) {
+                _units--;
+            }
+        }
+
+        uint32_t get() {
+            _units--;
+            return (_words[_units >> 1] >> ((_units & 1) << 4)) & 0xffff;
+        }
+
+        uint32_t get_state() {
+            uint32_t x = get() << 16;
+            return x | get();
+        }
+
+        [[nodiscard]] uint64_t units() const {
+            return _units;
+        }
+
+    private:
+        const uint32_t *_words;
+        uint64_t _units;
+    };
+
+    inline uint32_t encode_step(uint32_t x, const rans32_enc_symbol &symbol, unit_writer &writer) {
+        if ((x >> (32 - RANS32_SCALE)) >= symbol.freq) {
+            writer.put(x & 0xffff);
+            x >>= 16;
+        }
+
+        return ((x / symbol.freq) << RANS32_SCALE) + symbol.start + (x % symbol.freq);
+    }
+}
+
+template<uint64_t K>
+void InterlacedRansCodec::encode_stride32(
+        const uint8_t *input,
+        uint64_t input_n,
+        uint32_t *output,
+        uint64_t *output_ns,
+        uint64_t *input_residues,
+        uint64_t stride_size,
+        uint64_t tid
+) {
+    uint64_t input_start_index = tid * stride_size;
+    uint64_t input_size = std::min(input_start_index + stride_size, input_n) - input_start_index;
+    const uint8_t *stride = input + input_start_index;
+
+    uint64_t output_unit_size = stride_size >> 2;
+    unit_writer writer(output + tid * output_unit_size);
+
+    const rans32_enc_symbol *etable = _etable32.pointer();
+
+    // Every symbol emits at most one unit, the final states take two units each and one more may pad them.
+    const uint64_t limit = 2 * output_unit_size - 2 * K - 1;
+
+    uint32_t state[K];
+    for (uint64_t j = 0; j < K; j++) {
+        state[j] = lower_bound;
+    }
+
+    // Same grouping as encode_stride_interleaved(), so the residue stays a multiple of K.
+    uint64_t tail = input_size % K;
+    uint64_t index = input_size;
+
+    if (tail <= limit) {
+        for (; index > input_size - tail; index--) {
+            uint64_t j = (index - 1) % K;
+            state[j] = encode_step(state[j], etable[stride[index - 1]], writer);
+        }
+
+        for (; index != 0 && writer.units() + K <= limit; index -= K) {
+            for (uint64_t j = K; j-- > 0;) {
+                state[j] = encode_step(state[j], etable[stride[index - K + j]], writer);
+            }
+        }
+    }
+
+    input_residues[tid] = index;
+
+    for (uint64_t j = 0; j < K; j++) {
+        writer.put_state(state[j]);
+    }
+
+    output_ns[tid] = writer.finish();
+}
+
+template<uint64_t K>
+void InterlacedRansCodec::decode_stride32(
+        uint8_t *input,
+        uint64_t input_n,
+        const uint32_t *output,
+        const uint64_t *output_offsets,
+        const uint64_t *output_ns,
+        const uint64_t *input_residues,
+        uint64_t stride_size,
+        uint64_t tid,
+        uint64_t window_start
+) {
+    if (output_ns[tid] == 0) {
+        return;
+    }
+
+    uint64_t input_start_index = tid * stride_size;
+    uint64_t input_size = std::min(input_start_index + stride_size, input_n) - input_start_index;
+    uint8_t *stride = input + (input_start_index - window_start);
+
+    unit_reader reader(output + output_offsets[tid], output_ns[tid]);
+
+    const uint64_t *ftable = _ftable.pointer();
+    const uint64_t *ctable = _ctable.pointer();
+
+    uint32_t state[K];
+    for (uint64_t j = K; j-- > 0;) {
+        state[j] = reader.get_state();
+    }
+
+    auto get = [&](uint32_t &x) -> uint8_t {
+        uint8_t symbol = inv_bs32(x & slot_mask);
+        x = (uint32_t) ftable[symbol] * (x >> RANS32_SCALE) + (x & slot_mask) - (uint32_t) ctable[symbol];
+
+        if (x < lower_bound) {
+            x = (x << 16) | reader.get();
+        }
+
+        return symbol;
+    };
+
+    uint64_t index = input_residues[tid];
+    uint64_t groups_end = input_size - input_size % K;
+
+    for (; index < groups_end; index += K) {
+        for (uint64_t j = 0; j < K; j++) {
+            stride[index + j] = get(state[j]);
+        }
+    }
+
+    for (; index < input_size; index++) {
+        stride[index] = get(state[index % K]);
+    }
+}
+
+std::vector<uint32_t> InterlacedRansCodec::encode_residue32(const uint8_t *input, uint64_t residue) {
+    const rans32_enc_symbol *etable = _etable32.pointer();
+
+    // A symbol never costs more than one unit, and the state and padding take two words at most.
+    std::vector<uint32_t> out(residue / 2 + 2);
+    unit_writer writer(out.data());
+
+    uint32_t state = lower_bound;
+
+    for (uint64_t j = residue; j-- > 0;) {
+        state = encode_step(state, etable[input[j]], writer);
+    }
+
+    writer.put_state(state);
+    out.resize(writer.finish());
+
+    return out;
+}
+
+void InterlacedRansCodec::decode_residue32(
+        uint8_t *output,
+        uint64_t residue,
+        const uint32_t *words,
+        uint64_t n_words
+) {
+    if (n_words < 1) {
+        throw BaseErrors::InvalidOperationException("Residue stream is truncated");
+    }
+
+    unit_reader reader(words, n_words);
+    if (reader.units() < 2) {
+        throw BaseErrors::InvalidOperationException("Residue stream is truncated");
+    }
+
+    const uint64_t *ftable = _ftable.pointer();
+    const uint64_t *ctable = _ctable.pointer();
+
+    uint32_t state = reader.get_state();
+
+    for (uint64_t j = 0; j < residue; j++) {
+        uint8_t symbol = inv_bs32(state & slot_mask);
+        output[j] = symbol;
+
+        state = (uint32_t) ftable[symbol] * (state >> RANS32_SCALE) + (state & slot_mask) - (uint32_t) ctable[symbol];
+
+        if (state < lower_bound && reader.units() != 0) {
+            state = (state << 16) | reader.get();
+        }
+    }
+}
+
+uint8_t InterlacedRansCodec::inv_bs32(uint32_t bs) {
+    const uint64_t *ctable = _ctable.pointer();
+    uint64_t symbol = _dtable.pointer()[bs >> RANS32_LOOKUP_SHIFT];
+
+    while (symbol < 255 && ctable[symbol + 1] <= bs) {
+        symbol++;
+    }
+
+    return symbol;
+}
+
+template void InterlacedRansCodec::encode_stride32<1>(const uint8_t *, uint64_t, uint32_t *, uint64_t *, uint64_t *,
+                                                       uint64_t, uint64_t);
+template void InterlacedRansCodec::encode_stride32<2>(const uint8_t *, uint64_t, uint32_t *, uint64_t *, uint64_t *,
+                                                       uint64_t, uint64_t);
+template void InterlacedRansCodec::encode_stride32<4>(const uint8_t *, uint64_t, uint32_t *, uint64_t *, uint64_t *,
+                                                       uint64_t, uint64_t);
+template void InterlacedRansCodec::encode_stride32<8>(const uint8_t *, uint64_t, uint32_t *, uint64_t *, uint64_t *,
+                                                       uint64_t, uint64_t);
+
+template void InterlacedRansCodec::decode_stride32<1>(uint8_t *, uint64_t, const uint32_t *, const uint64_t *,
+                                                       const uint64_t *, const uint64_t *, uint64_t, uint64_t,
+                                                       uint64_t);
+template void InterlacedRansCodec::decode_stride32<2>(uint8_t *, uint64_t, const uint32_t *, const uint64_t *,
+                                                       const uint64_t *, const uint64_t *, uint64_t, uint64_t,
+                                                       uint64_t);
+template void InterlacedRansCodec::decode_stride32<4>(uint8_t *, uint64_t, const uint32_t *, const uint64_t *,
+                                                       const uint64_t *, const uint64_t *, uint64_t, uint64_t,
+                                                       uint64_t);
+template void InterlacedRansCodec::decode_stride32<8>(uint8_t *, uint64_t, const uint32_t *, const uint64_t *,
+                                                       const uint64_t *, const uint64_t *, uint64_t, uint64_t,
+                                                       uint64_t);
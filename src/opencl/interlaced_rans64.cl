@@ -1,25 +1,74 @@
 R"(
 /* Rans64 OpenCL implementation by Vishaal Selvaraj
- * SCALE: 24
+ * SCALE: 24, or 16 with RANS32
  * MODEL SUPPORT: Zero-order only
+ *
+ * With RANS32 defined, the encode and decode kernels come from interlaced_rans32.cl, which is appended.
  */
 
+#ifdef RANS32
+#define SCALE 16
+#else
 #define SCALE 24
+#endif
+#define LOOKUP_SHIFT (SCALE - 12)
+#define LOOKUP_SIZE (1 << 12)
 #define u64 unsigned long int
 #define u8 unsigned char
 #define u32 unsigned int
+
+/* Reciprocal form of a symbol's encode step, laid out like rans64_enc_symbol on the host. */
+typedef struct {
+	u64 rcp_freq;
+	u64 x_max;
+	u32 bias;
+	u32 cmpl_freq;
+	u32 rcp_shift;
+	u32 padding;
+} rans64_enc_symbol;
+
+/* Encode step of a symbol for the 32-bit engine, laid out like rans32_enc_symbol on the host. */
+typedef struct {
+	u32 freq;
+	u32 start;
+} rans32_enc_symbol;
+
+#ifdef RANS32
+typedef rans32_enc_symbol enc_symbol;
+#else
+typedef rans64_enc_symbol enc_symbol;
+#endif
+
+/* ((x / freq) << SCALE) + start + (x % freq) without a 64-bit divide. */
+u64 encode_step(u64 x, __global rans64_enc_symbol *symbol) {
+	u64 q = mul_hi(x, symbol->rcp_freq) >> symbol->rcp_shift;
+	return x + symbol->bias + q * symbol->cmpl_freq;
+}
+
+/* Strides are laid out in tiles of 'tile' strides, with element j of every stride of a tile next to each other,
+ * so that neighbouring work items touch neighbouring addresses. A tile of 1 is the plain layout with one stride
+ * after the other. Element j of stride tid, in regions of 'size' elements per stride, is at
+ * tile_base(tid, size, tile) + j * tile.
+ */
+u64 tile_base(u64 tid, u64 size, u64 tile) {
+	return (tid / tile) * tile * size + tid % tile;
+}
 	
+#ifndef RANS32
+
+#ifndef STATES
+
 __kernel void encode(
 	__global u8 *input,
 	const u64 input_n,
-	__global u64 *ftable,
-	__global u64 *ctable,
+	__global rans64_enc_symbol *etable,
 	__global u32 *output,
 	__global u64 *output_ns,
 	__global u64 *input_residues,
 	const u64 output_size,
 	const u64 n,
-	const u64 stride_size
+	const u64 stride_size,
+	const u64 tile
 ) {
 	u64 tid = get_global_id(0);
 	if (tid >= n) {
@@ -34,21 +83,18 @@ __kernel void encode(
 	}
 	
 	u64 input_size = input_end_index - input_start_index + 1;
+	__global u8 *stride = input + tile_base(tid, stride_size, tile);
 	
 	u64 output_unit_size = stride_size >> 2;
-	u64 output_start_index = tid * output_unit_size;
-	u64 output_end_index = output_start_index + output_unit_size - 1;
-
-	u32 *output_ptr = output + output_start_index;
-	u64 *output_ns_ptr = output_ns + tid;
-	u64 *input_residue_ptr = input_residues + tid;
+	__global u32 *output_ptr = output + tile_base(tid, output_unit_size, tile);
+	__global u64 *output_ns_ptr = output_ns + tid;
+	__global u64 *input_residue_ptr = input_residues + tid;
 	
-	u64 input_index = input_end_index;
+	u64 input_index = input_size - 1;
 	u64 counter = 0;
 	
 	
 	const u64 lower_bound = 1ul << 31;
-	const u64 up_prefix = (lower_bound >> SCALE) << 32;
 	
 	u64 state = lower_bound;
 	u64 state_counter = 0;
@@ -58,18 +104,15 @@ __kernel void encode(
 			break;
 		}
 		
-		u8 symbol = input[input_index];
-		u64 ls = ftable[symbol];
-		u64 bs = ctable[symbol];
-		u64 upper_bound = ls * up_prefix;
+		__global rans64_enc_symbol *symbol = etable + stride[input_index * tile];
 		
-		if (state >= upper_bound) {
-			output_ptr[state_counter] = state;
+		if (state >= symbol->x_max) {
+			output_ptr[state_counter * tile] = state;
 			state >>= 32;
 			state_counter++;
 		}
 		
-		state = ((state / ls) << SCALE) + bs + (state % ls);
+		state = encode_step(state, symbol);
 		counter++;
 		input_index--;
 		
@@ -80,27 +123,172 @@ __kernel void encode(
 	
 	*input_residue_ptr = input_size - counter;
 	
-	output_ptr[state_counter] = state;
-	output_ptr[state_counter + 1] = state >> 32;
+	output_ptr[state_counter * tile] = state;
+	output_ptr[(state_counter + 1) * tile] = state >> 32;
 	*output_ns_ptr = state_counter + 2;
 }
 
+#else
 
+/* Interleaved variant: symbol i of a stride is coded by state i % STATES and all states share the
+ * stride's output words. Whole groups of STATES symbols are only started while their words fit,
+ * so the residue stays a multiple of STATES.
+ */
+__kernel void encode(
+	__global u8 *input,
+	const u64 input_n,
+	__global rans64_enc_symbol *etable,
+	__global u32 *output,
+	__global u64 *output_ns,
+	__global u64 *input_residues,
+	const u64 output_size,
+	const u64 n,
+	const u64 stride_size,
+	const u64 tile
+) {
+	u64 tid = get_global_id(0);
+	if (tid >= n) {
+		return;
+	}
 
-u8 inv_bs(u64 *ctable, u64 bs) {
-	u8 symbol = 0xff;
+	u64 input_start_index = tid * stride_size;
+	u64 input_end_index = input_start_index + stride_size - 1;
 	
-	for (int i = 0; i < 0x100; i++) {
-		if (ctable[i] > bs) {
-			symbol = i - 1;
-			break;
+	if (input_end_index >= input_n) {
+		input_end_index = input_n - 1;
+	}
+	
+	u64 input_size = input_end_index - input_start_index + 1;
+	__global u8 *stride = input + tile_base(tid, stride_size, tile);
+	
+	u64 output_unit_size = stride_size >> 2;
+	__global u32 *output_ptr = output + tile_base(tid, output_unit_size, tile);
+	
+	const u64 lower_bound = 1ul << 31;
+	const u64 limit = output_unit_size - 2 * STATES;
+	
+	u64 state[STATES];
+	
+	#pragma unroll
+	for (u32 j = 0; j < STATES; j++) {
+		state[j] = lower_bound;
+	}
+	
+	u64 state_counter = 0;
+	u64 tail = input_size % STATES;
+	u64 input_index = input_size;
+	
+	if (tail <= limit) {
+		for (; input_index > input_size - tail; input_index--) {
+			__global rans64_enc_symbol *symbol = etable + stride[(input_index - 1) * tile];
+			u64 x = state[(input_index - 1) % STATES];
+			
+			if (x >= symbol->x_max) {
+				output_ptr[state_counter * tile] = x;
+				x >>= 32;
+				state_counter++;
+			}
+			
+			state[(input_index - 1) % STATES] = encode_step(x, symbol);
 		}
+		
+		for (; input_index != 0 && state_counter + STATES <= limit; input_index -= STATES) {
+			#pragma unroll
+			for (int j = STATES - 1; j >= 0; j--) {
+				__global rans64_enc_symbol *symbol = etable + stride[(input_index - STATES + j) * tile];
+				
+				if (state[j] >= symbol->x_max) {
+					output_ptr[state_counter * tile] = state[j];
+					state[j] >>= 32;
+					state_counter++;
+				}
+				
+				state[j] = encode_step(state[j], symbol);
+			}
+		}
+	}
+	
+	input_residues[tid] = input_index;
+	
+	#pragma unroll
+	for (u32 j = 0; j < STATES; j++) {
+		output_ptr[state_counter * tile] = state[j];
+		output_ptr[(state_counter + 1) * tile] = state[j] >> 32;
+		state_counter += 2;
+	}
+	
+	output_ns[tid] = state_counter;
+}
+
+#endif
+
+#endif
+
+
+
+/* Copies the decode tables into local memory once per work group, with frequencies and starts as 32-bit values
+ * since they fit in SCALE bits. Every work item of the group has to call it.
+ */
+void stage_tables(
+	__global u64 *ftable,
+	__global u64 *ctable,
+	__global u8 *dtable,
+	__local u32 *freqs,
+	__local u32 *starts,
+	__local u8 *lookup
+) {
+	u64 lid = get_local_id(0);
+	u64 local_size = get_local_size(0);
+	
+	for (u64 i = lid; i < 256; i += local_size) {
+		freqs[i] = ftable[i];
+		starts[i] = ctable[i];
+	}
+	
+	for (u64 i = lid; i < LOOKUP_SIZE; i += local_size) {
+		lookup[i] = dtable[i];
+	}
+	
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+/* With GLOBAL_TABLES defined, the decode kernels read the tables straight from global memory instead of staging
+ * them. The host times both variants on a small fixed probe once per device and keeps the faster one.
+ */
+#ifdef GLOBAL_TABLES
+#define TABLE __global
+typedef u64 table_t;
+
+#define DECODE_TABLES \
+	__global u64 *freqs = ftable; \
+	__global u64 *starts = ctable; \
+	__global u8 *lookup = dtable;
+#else
+#define TABLE __local
+typedef u32 table_t;
+
+#define DECODE_TABLES \
+	__local u32 freqs[256]; \
+	__local u32 starts[256]; \
+	__local u8 lookup[LOOKUP_SIZE]; \
+	stage_tables(ftable, ctable, dtable, freqs, starts, lookup);
+#endif
+
+u8 inv_bs(TABLE table_t *starts, TABLE u8 *lookup, u64 bs) {
+	u32 symbol = lookup[bs >> LOOKUP_SHIFT];
+	
+	while (symbol < 255 && starts[symbol + 1] <= bs) {
+		symbol++;
 	}
 	
 	return symbol;
 }
 
 
+#ifndef RANS32
+
+#ifndef STATES
+
 __kernel void decode(
 	__global u8 *input,
 	const u64 input_n,
@@ -111,10 +299,14 @@ __kernel void decode(
 	__global u64 *input_residues,
 	const u64 output_size,
 	const u64 n,
-	const u64 stride_size
+	const u64 stride_size,
+	__global u8 *dtable,
+	const u64 tile
 ) {
+	DECODE_TABLES
+	
 	u64 tid = get_global_id(0);
-	if (tid >= n) {
+	if (tid >= n || output_ns[tid] == 0) {
 		return;
 	}
 
@@ -126,14 +318,14 @@ __kernel void decode(
 	}
 	
 	u64 input_size = input_end_index - input_start_index + 1;
+	__global u8 *stride = input + tile_base(tid, stride_size, tile);
+	__global u32 *output_ptr = output + tile_base(tid, stride_size >> 2, tile);
 	
-	u64 output_unit_size = stride_size >> 2;
-	u64 output_start_index = tid * output_unit_size;
-	u64 output_end_index = output_start_index + output_ns[tid] - 1;
+	u64 output_end_index = output_ns[tid] - 1;
 
 	u64 input_residue = input_residues[tid];
 	
-	u64 input_index = input_start_index + input_residue;
+	u64 input_index = input_residue;
 	input_size = input_size - input_residue;
 	
 	u64 counter = 0;
@@ -141,8 +333,8 @@ __kernel void decode(
 	const u64 lower_bound = 1ul << 31;
 	const u64 mask = (1ul << SCALE) - 1;
 	
-	u64 state = output[output_end_index];
-	state = (state << 32) | output[output_end_index - 1];
+	u64 state = output_ptr[output_end_index * tile];
+	state = (state << 32) | output_ptr[(output_end_index - 1) * tile];
 	u64 state_counter = output_end_index - 2;
 	
 	while (true) {
@@ -151,16 +343,16 @@ __kernel void decode(
 		}
 		
 		u64 bs = state & mask;
-		u8 symbol = inv_bs(ctable, bs);
+		u8 symbol = inv_bs(starts, lookup, bs);
 		
-		input[input_index] = symbol;
-		u64 ls = ftable[symbol];
-		bs = ctable[symbol];
+		stride[input_index * tile] = symbol;
+		u64 ls = freqs[symbol];
+		bs = starts[symbol];
 		
 		state = (ls * (state >> SCALE)) + (state & mask) - bs;
 		
 		if (state < lower_bound) {
-			state = (state << 32) | output[state_counter];
+			state = (state << 32) | output_ptr[state_counter * tile];
 			state_counter--;
 		}
 		
@@ -169,4 +361,349 @@ __kernel void decode(
 	}
 }
 
+#else
+
+__kernel void decode(
+	__global u8 *input,
+	const u64 input_n,
+	__global u64 *ftable,
+	__global u64 *ctable,
+	__global u32 *output,
+	__global u64 *output_ns,
+	__global u64 *input_residues,
+	const u64 output_size,
+	const u64 n,
+	const u64 stride_size,
+	__global u8 *dtable,
+	const u64 tile
+) {
+	DECODE_TABLES
+	
+	u64 tid = get_global_id(0);
+	if (tid >= n || output_ns[tid] == 0) {
+		return;
+	}
+
+	u64 input_start_index = tid * stride_size;
+	u64 input_end_index = input_start_index + stride_size - 1;
+	
+	if (input_end_index >= input_n) {
+		input_end_index = input_n - 1;
+	}
+	
+	u64 input_size = input_end_index - input_start_index + 1;
+	__global u8 *stride = input + tile_base(tid, stride_size, tile);
+	__global u32 *output_ptr = output + tile_base(tid, stride_size >> 2, tile);
+	
+	const u64 lower_bound = 1ul << 31;
+	const u64 mask = (1ul << SCALE) - 1;
+	
+	u64 state_counter = output_ns[tid];
+	u64 state[STATES];
+	
+	#pragma unroll
+	for (int j = STATES - 1; j >= 0; j--) {
+		u64 x = output_ptr[(state_counter - 1) * tile];
+		state[j] = (x << 32) | output_ptr[(state_counter - 2) * tile];
+		state_counter -= 2;
+	}
+	
+	u64 input_index = input_residues[tid];
+	u64 groups_end = input_size - input_size % STATES;
+	
+	for (; input_index < groups_end; input_index += STATES) {
+		#pragma unroll
+		for (u32 j = 0; j < STATES; j++) {
+			u8 symbol = inv_bs(starts, lookup, state[j] & mask);
+			stride[(input_index + j) * tile] = symbol;
+			
+			state[j] = ((u64) freqs[symbol] * (state[j] >> SCALE)) + (state[j] & mask) - starts[symbol];
+			
+			if (state[j] < lower_bound) {
+				state_counter--;
+				state[j] = (state[j] << 32) | output_ptr[state_counter * tile];
+			}
+		}
+	}
+	
+	for (; input_index < input_size; input_index++) {
+		u64 x = state[input_index % STATES];
+		u8 symbol = inv_bs(starts, lookup, x & mask);
+		stride[input_index * tile] = symbol;
+		
+		x = ((u64) freqs[symbol] * (x >> SCALE)) + (x & mask) - starts[symbol];
+		
+		if (x < lower_bound) {
+			state_counter--;
+			x = (x << 32) | output_ptr[state_counter * tile];
+		}
+		
+		state[input_index % STATES] = x;
+	}
+}
+
+#endif
+
+#endif
+
+/* Builds the tables of InterlacedRansCodec::normalize(), create_ctable() and create_etable() from the symbol counts
+ * of a blob, bit for bit, so that encode can follow freq_dist without a trip to the host. Runs as a single work group.
+ */
+__kernel void tables(
+	__global u64 *histogram,
+	__global u64 *ftable,
+	__global u64 *ctable,
+	__global enc_symbol *etable
+) {
+	__local u64 freqs[256];
+	__local u64 starts[256];
+	
+	u64 lid = get_local_id(0);
+	u64 local_size = get_local_size(0);
+	
+	if (lid == 0) {
+		u64 sum = 256;
+		for (u32 i = 0; i < 256; i++) {
+			sum += histogram[i];
+		}
+		
+		u64 ssum = 0;
+		const u64 mul_factor = (1ul << SCALE) - 256;
+		
+		for (u32 i = 0; i < 256; i++) {
+			u64 value = 1 + (histogram[i] + 1) * mul_factor / sum;
+			ssum += value - 1;
+			freqs[i] = value;
+		}
+		
+		/* The host hands out the remaining slots one at a time, starting at symbol 0. */
+		ssum = mul_factor - ssum;
+		
+		u64 bs = 0;
+		for (u32 i = 0; i < 256; i++) {
+			freqs[i] += ssum / 256 + (i < ssum % 256);
+			starts[i] = bs;
+			bs += freqs[i];
+		}
+	}
+	
+	barrier(CLK_LOCAL_MEM_FENCE);
+	
+	const u64 lower_bound = 1ul << 31;
+	
+	for (u64 i = lid; i < 256; i += local_size) {
+		u64 freq = freqs[i];
+		
+#ifdef RANS32
+		rans32_enc_symbol symbol;
+		
+		symbol.freq = freq;
+		symbol.start = starts[i];
+#else
+		rans64_enc_symbol symbol;
+		
+		symbol.x_max = ((lower_bound >> SCALE) << 32) * freq;
+		symbol.cmpl_freq = (1ul << SCALE) - freq;
+		symbol.padding = 0;
+		
+		if (freq < 2) {
+			symbol.rcp_freq = ~0ul;
+			symbol.rcp_shift = 0;
+			symbol.bias = starts[i] + (1ul << SCALE) - 1;
+		} else {
+			u32 shift = 0;
+			while (freq > (1ul << shift)) {
+				shift++;
+			}
+			
+			u64 x0 = freq - 1;
+			u64 x1 = 1ul << (shift + 31);
+			
+			u64 t1 = x1 / freq;
+			x0 += (x1 % freq) << 32;
+			u64 t0 = x0 / freq;
+			
+			symbol.rcp_freq = t0 + (t1 << 32);
+			symbol.rcp_shift = shift - 1;
+			symbol.bias = starts[i];
+		}
+#endif
+		
+		ftable[i] = freq;
+		ctable[i] = starts[i];
+		etable[i] = symbol;
+	}
+}
+
+/* Work items of the single work group that runs 'scan'. */
+#define SCAN_SIZE 256
+
+/* Offsets of the words of strides [first, first + n) in the packed words: base plus the exclusive prefix sum of
+ * their word counts. Every lane sums a contiguous run of counts, the run totals are scanned in local memory and
+ * each lane then writes the offsets of its run.
+ */
+__kernel void scan(
+	__global u64 *output_ns,
+	__global u64 *offsets,
+	const u64 first,
+	const u64 n,
+	const u64 base
+) {
+	__local u64 sums[SCAN_SIZE];
+	
+	u64 lid = get_local_id(0);
+	u64 local_size = get_local_size(0);
+	
+	output_ns += first;
+	offsets += first;
+	
+	u64 run = (n + local_size - 1) / local_size;
+	u64 start = lid * run < n ? lid * run : n;
+	u64 end = start + run < n ? start + run : n;
+	
+	u64 sum = 0;
+	for (u64 i = start; i < end; i++) {
+		sum += output_ns[i];
+	}
+	
+	sums[lid] = sum;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	
+	for (u64 d = 1; d < local_size; d <<= 1) {
+		u64 x = lid >= d ? sums[lid - d] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		
+		sums[lid] += x;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	
+	u64 offset = base + sums[lid] - sum;
+	for (u64 i = start; i < end; i++) {
+		offsets[i] = offset;
+		offset += output_ns[i];
+	}
+}
+
+/* Moves the words of every stride from its fixed-size slot in output to offsets[stride] in packed.
+ * Each work group copies one stride, so neighbouring lanes write neighbouring words. The stride is taken
+ * from the global id, so that a range of strides can be moved with a global offset.
+ */
+__kernel void compact(
+	__global u32 *output,
+	__global u64 *output_ns,
+	__global u64 *offsets,
+	__global u32 *packed,
+	const u64 stride_size,
+	const u64 tile
+) {
+	u64 tid = get_global_id(0) / get_local_size(0);
+	u64 lid = get_local_id(0);
+	u64 local_size = get_local_size(0);
+	
+	__global u32 *src = output + tile_base(tid, stride_size >> 2, tile);
+	__global u32 *dst = packed + offsets[tid];
+	
+	for (u64 i = lid; i < output_ns[tid]; i += local_size) {
+		dst[i] = src[i * tile];
+	}
+}
+
+/* Inverse of compact: moves the packed words of every stride into its fixed-size slot in output. */
+__kernel void expand(
+	__global u32 *packed,
+	__global u64 *output_ns,
+	__global u64 *offsets,
+	__global u32 *output,
+	const u64 stride_size,
+	const u64 tile
+) {
+	u64 tid = get_global_id(0) / get_local_size(0);
+	u64 lid = get_local_id(0);
+	u64 local_size = get_local_size(0);
+	
+	__global u32 *src = packed + offsets[tid];
+	__global u32 *dst = output + tile_base(tid, stride_size >> 2, tile);
+	
+	for (u64 i = lid; i < output_ns[tid]; i += local_size) {
+		dst[i * tile] = src[i];
+	}
+}
+
+/* Largest tile the symbol transposes support. */
+#define MAX_TILE 64
+
+/* Copies the n symbols of a blob from the plain layout into tiles of get_local_size(0) strides. Each work group
+ * moves a block of 'tile' strides by 'tile' symbols through local memory, reading along the strides and writing
+ * across them, so that both sides coalesce. Group g handles tile g / blocks, from symbol (g % blocks) * tile,
+ * where blocks is the number of such columns per stride. Like compact, g is taken from the global id.
+ */
+__kernel void tile_symbols(
+	__global u8 *src,
+	__global u8 *dst,
+	const u64 n,
+	const u64 stride_size
+) {
+	__local u8 block[MAX_TILE * MAX_TILE];
+	
+	u64 lid = get_local_id(0);
+	u64 tile = get_local_size(0);
+	u64 blocks = (stride_size + tile - 1) / tile;
+	
+	u64 group = get_global_id(0) / tile;
+	u64 first_stride = (group / blocks) * tile;
+	u64 first_symbol = (group % blocks) * tile;
+	
+	for (u64 r = 0; r < tile; r++) {
+		u64 j = first_symbol + lid;
+		u64 index = (first_stride + r) * stride_size + j;
+		
+		if (j < stride_size && index < n) {
+			block[r * tile + lid] = src[index];
+		}
+	}
+	
+	barrier(CLK_LOCAL_MEM_FENCE);
+	
+	__global u8 *tile_ptr = dst + first_stride * stride_size + lid;
+	
+	for (u64 c = 0; c < tile && first_symbol + c < stride_size; c++) {
+		tile_ptr[(first_symbol + c) * tile] = block[lid * tile + c];
+	}
+}
+
+/* Inverse of tile_symbols. */
+__kernel void untile_symbols(
+	__global u8 *src,
+	__global u8 *dst,
+	const u64 n,
+	const u64 stride_size
+) {
+	__local u8 block[MAX_TILE * MAX_TILE];
+	
+	u64 lid = get_local_id(0);
+	u64 tile = get_local_size(0);
+	u64 blocks = (stride_size + tile - 1) / tile;
+	
+	u64 group = get_global_id(0) / tile;
+	u64 first_stride = (group / blocks) * tile;
+	u64 first_symbol = (group % blocks) * tile;
+	
+	__global u8 *tile_ptr = src + first_stride * stride_size + lid;
+	
+	for (u64 r = 0; r < tile && first_symbol + r < stride_size; r++) {
+		block[r * tile + lid] = tile_ptr[(first_symbol + r) * tile];
+	}
+	
+	barrier(CLK_LOCAL_MEM_FENCE);
+	
+	for (u64 c = 0; c < tile; c++) {
+		u64 j = first_symbol + lid;
+		u64 index = (first_stride + c) * stride_size + j;
+		
+		if (j < stride_size && index < n) {
+			dst[index] = block[lid * tile + c];
+		}
+	}
+}
+
 )"
\ No newline at end of file
@@ -1,103 +1,88 @@
 #include "interlaced_rans64.h"
 #include <vector>
 #include <iostream>
-#include "cl_helper.h"
+#include <utils/thread_pool.h>
+#include <utils/simd.h>
+#include <utils/varint.h>
+#include <errors/base.h>
+#include <cstring>
+#include <cmath>
 
 using namespace interlaced_ans;
 
-#define RANS64_SCALE 24
+// Same as ((x / freq) << RANS64_SCALE) + start + (x % freq), without a 64-bit divide.
+static inline uint64_t encode_step(uint64_t x, const interlaced_ans::rans64_enc_symbol &symbol) {
+    uint64_t q = (uint64_t) (((unsigned __int128) x * symbol.rcp_freq) >> 64) >> symbol.rcp_shift;
+    return x + symbol.bias + q * symbol.cmpl_freq;
+}
 
-void Rans64Codec::register_kernel() {
-    opencl::ProgramProvider::register_program("interlaced_rans64",
+std::string InterlacedRansCodec::program_name(uint64_t states, Engine engine, bool global_tables) {
+    std::string name = engine == Engine::RANS32 ? "interlaced_rans32" : "interlaced_rans64";
+    if (states != 1) {
+        name += "_x" + std::to_string(states);
+    }
 
-#include "interlaced_rans64.cl"
+    return global_tables ? name + "_global" : name;
+}
 
-    );
+uint64_t InterlacedRansCodec::scale(Engine engine) {
+    return engine == Engine::RANS32 ? RANS32_SCALE : RANS64_SCALE;
 }
 
-encoder_output Rans64Codec::opencl_encode(const rainman::ptr<uint8_t> &input, uint64_t stride_size) {
-    register_kernel();
+void InterlacedRansCodec::check_engine(const encoder_output &output) const {
+    if (output.engine != _engine) {
+        throw BaseErrors::InvalidOperationException("Encoder output was coded with another rANS engine");
+    }
+}
 
-    auto kernel = opencl::KernelProvider::get("interlaced_rans64", "encode");
-    auto context = kernel.getInfo<CL_KERNEL_CONTEXT>();
-    auto device = context.getInfo<CL_CONTEXT_DEVICES>().front();
+bool InterlacedRansCodec::valid_states(uint64_t states) {
+    return states != 0 && states <= INTERLACED_ANS_MAX_STATES && (states & (states - 1)) == 0;
+}
 
-    if (_verbose) {
-        std::cout << "[OPENCL]\t\tRunning 'interlaced_rans64.encode' kernels on device: "
-                  << device.getInfo<CL_DEVICE_NAME>() << std::endl;
+uint64_t InterlacedRansCodec::estimate_size(
+        const rainman::ptr<uint64_t> &histogram,
+        uint64_t stride_size,
+        uint64_t states
+) {
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < histogram.size(); i++) {
+        n += histogram[i];
     }
 
-    uint64_t local_size = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+    double bits = 0.0;
+    for (uint64_t i = 0; i < histogram.size(); i++) {
+        if (histogram[i] != 0) {
+            bits += (double) histogram[i] * std::log2((double) n / (double) histogram[i]);
+        }
+    }
 
-    uint64_t n = input.size();
+    // Each stride carries varints for output_ns, input_residues and residual_ns, and flushes its states.
     uint64_t true_size = (n / stride_size) + (n % stride_size != 0);
-    uint64_t global_size = (true_size / local_size + (true_size % local_size != 0)) * local_size;
-    uint64_t output_size = (true_size * (stride_size >> 2));
-
-    cl::Buffer buf_input(context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
-                         input.size() * sizeof(uint8_t), input.pointer());
-
-    cl::Buffer buf_ftable(context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
-                          _ftable.size() * sizeof(uint64_t), _ftable.pointer());
-
-    cl::Buffer buf_ctable(context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
-                          _ctable.size() * sizeof(uint64_t), _ctable.pointer());
-
-    cl::Buffer buf_output(context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY,
-                          output_size * sizeof(uint32_t));
-
-    cl::Buffer buf_output_ns(context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY,
-                             true_size * sizeof(uint64_t));
-
-    cl::Buffer buf_input_residues(context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY,
-                                  true_size * sizeof(uint64_t));
-
+    uint64_t stride_overhead = Varint::size(stride_size >> 2) + 2 + 2 * states * sizeof(uint32_t);
 
-    kernel.setArg(0, buf_input);
-    kernel.setArg(1, input.size());
-    kernel.setArg(2, buf_ftable);
-    kernel.setArg(3, buf_ctable);
-    kernel.setArg(4, buf_output);
-    kernel.setArg(5, buf_output_ns);
-    kernel.setArg(6, buf_input_residues);
-    kernel.setArg(7, output_size);
-    kernel.setArg(8, true_size);
-    kernel.setArg(9, stride_size);
-
-    auto output = rainman::ptr<uint32_t>(output_size);
-    auto output_ns = rainman::ptr<uint64_t>(true_size);
-    auto input_residues = rainman::ptr<uint64_t>(true_size);
-
-    auto queue = cl::CommandQueue(context, device, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
-    queue.enqueueNDRangeKernel(kernel, cl::NDRange(0), cl::NDRange(global_size), cl::NDRange(local_size));
-    queue.enqueueBarrierWithWaitList();
-
-    queue.enqueueReadBuffer(buf_output, CL_FALSE, 0, output_size * sizeof(uint32_t), output.pointer());
-    queue.enqueueReadBuffer(buf_output_ns, CL_FALSE, 0, true_size * sizeof(uint64_t), output_ns.pointer());
-    queue.enqueueReadBuffer(buf_input_residues, CL_FALSE, 0, true_size * sizeof(uint64_t), input_residues.pointer());
-
-    queue.finish();
+    return (uint64_t) (bits / 8) + true_size * stride_overhead + 5 * sizeof(uint64_t);
+}
 
-    auto residual_output = encode_residues(input, input_residues, stride_size);
-    return encoder_output{
-            .cl_outputs = output,
-            .output_ns = output_ns,
-            .residual_output = residual_output,
-            .input_residues = input_residues,
-            .stride_size = stride_size,
-            .input_size = input.size()
-    };
+void InterlacedRansCodec::check_stride(uint64_t stride_size) const {
+    if (!valid_states(_states)) {
+        throw BaseErrors::InvalidOperationException("Unsupported number of states: " + std::to_string(_states));
+    }
 
+    // Each stride must at least hold the final words of its states.
+    if ((stride_size >> 2) < 2 * _states) {
+        throw BaseErrors::InvalidOperationException("Stride size is too small for " + std::to_string(_states) +
+                                                    " state(s)");
+    }
 }
 
-void Rans64Codec::normalize() {
+void InterlacedRansCodec::normalize() {
     uint64_t sum = 256;
     for (int i = 0; i < 256; i++) {
         sum += _ftable[i];
     }
 
     uint64_t ssum = 0;
-    uint64_t mul_factor = (1ull << RANS64_SCALE) - 256;
+    uint64_t mul_factor = (1ull << scale(_engine)) - 256;
 
     for (int i = 0; i < 256; i++) {
         uint64_t value = 1 + (_ftable[i] + 1) * mul_factor / sum;
@@ -112,7 +97,15 @@ void Rans64Codec::normalize() {
     }
 }
 
-void Rans64Codec::create_ctable() {
+rainman::ptr<uint64_t> InterlacedRansCodec::normalized(const rainman::ptr<uint64_t> &histogram, Engine engine) {
+    auto ftable = rainman::ptr<uint64_t>(256);
+    std::copy(histogram.pointer(), histogram.pointer() + ftable.size(), ftable.pointer());
+
+    InterlacedRansCodec(ftable, false, 1, engine).normalize();
+    return ftable;
+}
+
+void InterlacedRansCodec::create_ctable() {
     uint64_t bs = 0;
     _ctable = rainman::ptr<uint64_t>(256);
     _ctable[0] = 0;
@@ -121,128 +114,248 @@ void Rans64Codec::create_ctable() {
         bs += _ftable[i];
         _ctable[i + 1] = bs;
     }
+
+    create_dtable();
+    create_etable();
 }
 
-rainman::ptr<uint32_t> Rans64Codec::encode_residues(
-        const rainman::ptr<uint8_t> &input,
-        const rainman::ptr<uint64_t> &input_residues,
-        uint64_t stride_size
-) {
-    const uint64_t lower_bound = 1ull << 31;
-    const uint64_t up_prefix = (lower_bound >> RANS64_SCALE) << 32;
+void InterlacedRansCodec::create_dtable() {
+    // Each entry holds the symbol owning the first slot of its bucket. inv_bs() then only has to
+    // step over symbols that start inside the bucket, which is rarely more than one.
+    _dtable = rainman::ptr<uint8_t>(1ull << RANS64_LOOKUP_BITS);
 
-    uint64_t state = lower_bound;
-    std::vector<uint32_t> out;
+    uint64_t shift = scale(_engine) - RANS64_LOOKUP_BITS;
+    uint64_t symbol = 0;
 
-    for (uint64_t i = 0; i < input_residues.size(); i++) {
-        uint64_t residue = input_residues[i];
-        if (residue == 0) {
-            continue;
+    for (uint64_t i = 0; i < _dtable.size(); i++) {
+        uint64_t slot = i << shift;
+        while (symbol < 255 && _ctable[symbol + 1] <= slot) {
+            symbol++;
         }
 
-        int64_t start_index = stride_size * i;
-        int64_t end_index = start_index + residue - 1;
+        _dtable[i] = symbol;
+    }
 
-        for (int64_t j = end_index; j >= start_index; j--) {
-            auto symbol = input[j];
-            uint64_t ls = _ftable[symbol];
-            uint64_t bs = _ctable[symbol];
+    create_btable();
+}
 
-            if (i == input_residues.size() - 1) {
-                printf("");
-            }
+void InterlacedRansCodec::create_btable() {
+    // Widens each dtable entry to symbol | start << 8 | next << 32, so that the SIMD decoders get
+    // a symbol and both of its bounds from a single gather.
+    _btable = rainman::ptr<uint64_t>(1ull << RANS64_LOOKUP_BITS);
+
+    for (uint64_t i = 0; i < _btable.size(); i++) {
+        uint64_t symbol = _dtable[i];
+        uint64_t next = symbol < 255 ? _ctable[symbol + 1] : 1ull << scale(_engine);
 
-            uint64_t upper_bound = up_prefix * ls;
+        _btable[i] = symbol | (_ctable[symbol] << 8) | (next << 32);
+    }
+}
 
-            if (state >= upper_bound) {
-                out.push_back(state);
-                state >>= 32;
+void InterlacedRansCodec::create_etable() {
+    if (_engine == Engine::RANS32) {
+        _etable32 = rainman::ptr<rans32_enc_symbol>(256);
+
+        for (int i = 0; i < 256; i++) {
+            _etable32[i] = rans32_enc_symbol{.freq = (uint32_t) _ftable[i], .start = (uint32_t) _ctable[i]};
+        }
+
+        return;
+    }
+
+    const uint64_t lower_bound = 1ull << 31;
+    _etable = rainman::ptr<rans64_enc_symbol>(256);
+
+    for (int i = 0; i < 256; i++) {
+        uint64_t freq = _ftable[i];
+        auto &symbol = _etable[i];
+
+        symbol.x_max = ((lower_bound >> RANS64_SCALE) << 32) * freq;
+        symbol.cmpl_freq = (1ull << RANS64_SCALE) - freq;
+
+        if (freq < 2) {
+            // x / 1 has no usable 64-bit reciprocal. mul_hi(x, ~0) is x - 1 for x > 0,
+            // which the bias makes up for.
+            symbol.rcp_freq = ~0ull;
+            symbol.rcp_shift = 0;
+            symbol.bias = _ctable[i] + (1ull << RANS64_SCALE) - 1;
+        } else {
+            // Alverson's round-up reciprocal ceil(2^(63 + shift) / freq) with shift = ceil(log2(freq)),
+            // computed as two 64-bit divides.
+            uint32_t shift = 0;
+            while (freq > (1ull << shift)) {
+                shift++;
             }
 
-            state = ((state / ls) << RANS64_SCALE) + bs + (state % ls);
+            uint64_t x0 = freq - 1;
+            uint64_t x1 = 1ull << (shift + 31);
+
+            uint64_t t1 = x1 / freq;
+            x0 += (x1 % freq) << 32;
+            uint64_t t0 = x0 / freq;
+
+            symbol.rcp_freq = t0 + (t1 << 32);
+            symbol.rcp_shift = shift - 1;
+            symbol.bias = _ctable[i];
         }
     }
+}
 
-    out.push_back(state);
-    out.push_back(state >> 32);
+void InterlacedRansCodec::encode_residues(const uint8_t *input, encoder_output &output) {
+    uint64_t n = output.input_size;
+    uint64_t stride_size = output.stride_size;
+    uint64_t true_size = output.output_ns.size();
+
+    std::vector<std::vector<uint32_t>> streams(true_size);
 
-    auto output = rainman::ptr<uint32_t>(out.size());
-    for (uint64_t i = 0; i < out.size(); i++) {
-        output[i] = out[i];
+    ThreadPool::global().parallel_for(true_size, [&](uint64_t tid) {
+        uint64_t input_start_index = tid * stride_size;
+        uint64_t input_size = std::min(input_start_index + stride_size, n) - input_start_index;
+        uint64_t raw_size = input_size / sizeof(uint32_t) + (input_size % sizeof(uint32_t) != 0);
+
+        auto &stream = streams[tid];
+        if (output.input_residues[tid] != 0) {
+            stream = _engine == Engine::RANS32 ? encode_residue32(input + input_start_index, output.input_residues[tid])
+                                               : encode_residue(input + input_start_index, output.input_residues[tid]);
+        }
+
+        // Incompressible strides are stored, so that they cost a copy instead of a slow residue.
+        if (output.output_ns[tid] + stream.size() >= raw_size) {
+            stream.assign(raw_size, 0);
+            std::memcpy(stream.data(), input + input_start_index, input_size);
+
+            output.output_ns[tid] = 0;
+            output.input_residues[tid] = input_size;
+        }
+    });
+
+    uint64_t residual_size = 0;
+    output.residual_ns = rainman::ptr<uint64_t>(true_size);
+
+    for (uint64_t i = 0; i < true_size; i++) {
+        output.residual_ns[i] = streams[i].size();
+        residual_size += streams[i].size();
     }
 
-    return output;
+    output.residual_output = rainman::ptr<uint32_t>(residual_size);
+
+    uint32_t *residual_output = output.residual_output.pointer();
+    for (const auto &stream: streams) {
+        residual_output = std::copy(stream.begin(), stream.end(), residual_output);
+    }
 }
 
-rainman::ptr<uint8_t> Rans64Codec::opencl_decode(const encoder_output &output) {
-    register_kernel();
+std::vector<uint32_t> InterlacedRansCodec::encode_residue(const uint8_t *input, uint64_t residue) {
+    const rans64_enc_symbol *etable = _etable.pointer();
+    const uint64_t lower_bound = 1ull << 31;
 
-    auto kernel = opencl::KernelProvider::get("interlaced_rans64", "decode");
-    auto context = kernel.getInfo<CL_KERNEL_CONTEXT>();
-    auto device = context.getInfo<CL_CONTEXT_DEVICES>().front();
+    // A symbol never costs more than RANS64_SCALE bits.
+    std::vector<uint32_t> out;
+    out.reserve(residue * RANS64_SCALE / 32 + 3);
 
-    if (_verbose) {
-        std::cout << "[OPENCL]\t\tRunning 'interlaced_rans64.decode' kernels on device: "
-                  << device.getInfo<CL_DEVICE_NAME>() << std::endl;
-    }
+    uint64_t state = lower_bound;
 
-    uint64_t local_size = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+    for (uint64_t j = residue; j-- > 0;) {
+        const auto &symbol = etable[input[j]];
 
-    uint64_t n = output.input_size;
-    uint64_t stride_size = output.stride_size;
-    uint64_t true_size = (n / stride_size) + (n % stride_size != 0);
-    uint64_t global_size = (true_size / local_size + (true_size % local_size != 0)) * local_size;
-    uint64_t output_size = (true_size * (stride_size >> 2));
+        if (state >= symbol.x_max) {
+            out.push_back(state);
+            state >>= 32;
+        }
 
-    cl::Buffer buf_input(context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, n * sizeof(uint8_t));
+        state = encode_step(state, symbol);
+    }
 
-    cl::Buffer buf_ftable(context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
-                          _ftable.size() * sizeof(uint64_t), _ftable.pointer());
+    out.push_back(state);
+    out.push_back(state >> 32);
 
-    cl::Buffer buf_ctable(context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
-                          _ctable.size() * sizeof(uint64_t), _ctable.pointer());
+    return out;
+}
 
-    cl::Buffer buf_output(context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
-                          output_size * sizeof(uint32_t), output.cl_outputs.pointer());
+void InterlacedRansCodec::decode_residues(
+        uint8_t *input,
+        const encoder_output &output,
+        uint64_t window_start,
+        uint64_t window_end
+) {
+    if (output.shared_residues) {
+        decode_shared_residues(input, output.input_residues, output.residual_output, output.stride_size, window_start,
+                               window_end);
+        return;
+    }
 
-    cl::Buffer buf_output_ns(context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
-                             true_size * sizeof(uint64_t), output.output_ns.pointer());
+    uint64_t n = output.input_size;
+    uint64_t stride_size = output.stride_size;
+    uint64_t true_size = output.output_ns.size();
+    if (output.residual_ns.size() != true_size) {
+        throw BaseErrors::InvalidOperationException("Every stride needs a residue stream");
+    }
 
-    cl::Buffer buf_input_residues(context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
-                                  true_size * sizeof(uint64_t), output.input_residues.pointer());
+    std::vector<uint64_t> offsets(true_size + 1);
+    for (uint64_t i = 0; i < true_size; i++) {
+        offsets[i + 1] = offsets[i] + output.residual_ns[i];
+    }
 
+    if (offsets[true_size] > output.residual_output.size()) {
+        throw BaseErrors::InvalidOperationException("Residue streams are larger than the residual output");
+    }
 
-    kernel.setArg(0, buf_input);
-    kernel.setArg(1, n);
-    kernel.setArg(2, buf_ftable);
-    kernel.setArg(3, buf_ctable);
-    kernel.setArg(4, buf_output);
-    kernel.setArg(5, buf_output_ns);
-    kernel.setArg(6, buf_input_residues);
-    kernel.setArg(7, output_size);
-    kernel.setArg(8, true_size);
-    kernel.setArg(9, stride_size);
+    uint64_t window_last = std::min(window_end, n);
+    uint64_t first_stride = window_start / stride_size;
+    uint64_t last_stride = window_last / stride_size + (window_last % stride_size != 0);
+
+    ThreadPool::global().parallel_for(last_stride - first_stride, [&](uint64_t i) {
+        uint64_t tid = first_stride + i;
+        uint64_t input_start_index = tid * stride_size;
+        uint64_t input_size = std::min(input_start_index + stride_size, n) - input_start_index;
+
+        uint8_t *stride = input + (input_start_index - window_start);
+        const uint32_t *words = output.residual_output.pointer() + offsets[tid];
+
+        if (output.output_ns[tid] == 0) {
+            std::memcpy(stride, words, input_size);
+        } else if (output.input_residues[tid] == 0) {
+            return;
+        } else if (output.engine == Engine::RANS32) {
+            decode_residue32(stride, output.input_residues[tid], words, output.residual_ns[tid]);
+        } else {
+            decode_residue(stride, output.input_residues[tid], words, output.residual_ns[tid]);
+        }
+    });
+}
 
-    auto input = rainman::ptr<uint8_t>(n);
+void InterlacedRansCodec::decode_residue(uint8_t *output, uint64_t residue, const uint32_t *words, uint64_t n_words) {
+    if (n_words < 2) {
+        throw BaseErrors::InvalidOperationException("Residue stream is truncated");
+    }
 
-    auto queue = cl::CommandQueue(context, device, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
-    queue.enqueueNDRangeKernel(kernel, cl::NDRange(0), cl::NDRange(global_size), cl::NDRange(local_size));
-    queue.enqueueBarrierWithWaitList();
+    const uint64_t lower_bound = 1ull << 31;
+    const uint64_t mask = (1ull << RANS64_SCALE) - 1;
 
-    queue.enqueueReadBuffer(buf_input, CL_FALSE, 0, n * sizeof(uint8_t), input.pointer());
+    uint64_t state = words[n_words - 1];
+    state = (state << 32) | words[n_words - 2];
 
-    queue.finish();
+    uint64_t state_counter = n_words - 2;
 
-    decode_residues(input, output.input_residues, output.residual_output, stride_size);
+    for (uint64_t j = 0; j < residue; j++) {
+        uint8_t symbol = inv_bs(state & mask);
+        output[j] = symbol;
 
-    return input;
+        state = (_ftable[symbol] * (state >> RANS64_SCALE)) + (state & mask) - _ctable[symbol];
+
+        if (state < lower_bound && state_counter != 0) {
+            state = (state << 32) | words[--state_counter];
+        }
+    }
 }
 
-void Rans64Codec::decode_residues(
-        const rainman::ptr<uint8_t> &input,
+void InterlacedRansCodec::decode_shared_residues(
+        uint8_t *input,
         const rainman::ptr<uint64_t> &input_residues,
         const rainman::ptr<uint32_t> &encoded_residues,
-        uint64_t stride_size
+        uint64_t stride_size,
+        uint64_t window_start,
+        uint64_t window_end
 ) {
     if (encoded_residues.size() < 2) {
         return;
@@ -266,11 +379,18 @@ void Rans64Codec::decode_residues(
         int64_t start_index = stride_size * i;
         int64_t end_index = start_index + residue - 1;
 
+        // Residues are decoded from the last stride backwards, so nothing before the window is needed.
+        if (end_index < (int64_t) window_start) {
+            break;
+        }
+
         for (int64_t j = start_index; j <= end_index; j++) {
             uint64_t bs = state & mask;
             uint8_t symbol = inv_bs(bs);
 
-            input[j] = symbol;
+            if ((uint64_t) j >= window_start && (uint64_t) j < window_end) {
+                input[j - window_start] = symbol;
+            }
 
             uint64_t ls = _ftable[symbol];
             bs = _ctable[symbol];
@@ -285,15 +405,452 @@ void Rans64Codec::decode_residues(
     }
 }
 
-uint8_t Rans64Codec::inv_bs(uint64_t bs) {
-    uint8_t symbol = 0xff;
+uint8_t InterlacedRansCodec::inv_bs(uint64_t bs) {
+    const uint64_t *ctable = _ctable.pointer();
+    uint64_t symbol = _dtable.pointer()[bs >> RANS64_LOOKUP_SHIFT];
+
+    while (symbol < 255 && ctable[symbol + 1] <= bs) {
+        symbol++;
+    }
+
+    return symbol;
+}
+
+
+/*
+ * Native implementation of the interlaced encode/decode kernels. Every stride is coded exactly like
+ * the corresponding OpenCL work item, so the output is interchangeable with opencl_encode/opencl_decode.
+ */
+
+encoder_output InterlacedRansCodec::cpu_encode(const rainman::ptr<uint8_t> &input, uint64_t stride_size) {
+    return cpu_encode(input.pointer(), input.size(), stride_size);
+}
+
+encoder_output InterlacedRansCodec::cpu_encode(const uint8_t *input, uint64_t n, uint64_t stride_size) {
+    check_stride(stride_size);
 
-    for (int i = 0; i < 0x100; i++) {
-        if (_ctable[i] > bs) {
-            symbol = i - 1;
+    if (_verbose) {
+        std::cout << "[NATIVE]\t\tRunning '" << program_name(_states, _engine) << ".encode' on "
+                  << ThreadPool::global().threads() << " thread(s)" << std::endl;
+    }
+
+    auto encode = stride_encoder(_states, _engine);
+
+    uint64_t true_size = (n / stride_size) + (n % stride_size != 0);
+    uint64_t output_size = (true_size * (stride_size >> 2));
+
+    auto output = rainman::ptr<uint32_t>(output_size);
+    auto output_offsets = rainman::ptr<uint64_t>(true_size);
+    auto output_ns = rainman::ptr<uint64_t>(true_size);
+    auto input_residues = rainman::ptr<uint64_t>(true_size);
+
+    ThreadPool::global().parallel_for(true_size, [&](uint64_t tid) {
+        (this->*encode)(input, n, output.pointer(), output_ns.pointer(), input_residues.pointer(), stride_size, tid);
+        output_offsets[tid] = tid * (stride_size >> 2);
+    });
+
+    auto result = encoder_output{
+            .cl_outputs = output,
+            .output_ns = output_ns,
+            .output_offsets = output_offsets,
+            .input_residues = input_residues,
+            .stride_size = stride_size,
+            .input_size = n,
+            .states = _states,
+            .engine = _engine
+    };
+
+    encode_residues(input, result);
+    return result;
+}
+
+rainman::ptr<uint8_t> InterlacedRansCodec::cpu_decode(const encoder_output &output) {
+    auto input = rainman::ptr<uint8_t>(output.input_size);
+    cpu_decode(output, input.pointer());
+
+    return input;
+}
+
+void InterlacedRansCodec::cpu_decode(const encoder_output &output, uint8_t *input) {
+    check_engine(output);
+
+    if (_verbose) {
+        std::cout << "[NATIVE]\t\tRunning '" << program_name(output.states, output.engine) << ".decode' on "
+                  << ThreadPool::global().threads() << " thread(s) (" << Simd::name(Simd::get()) << ")"
+                  << std::endl;
+    }
+
+    uint64_t n = output.input_size;
+    uint64_t stride_size = output.stride_size;
+    uint64_t true_size = (n / stride_size) + (n % stride_size != 0);
+
+    decode_strides(output, input, 0, true_size, 0);
+    decode_residues(input, output);
+}
+
+void InterlacedRansCodec::cpu_decode_range(const encoder_output &output, uint64_t begin, uint64_t end, uint8_t *dst) {
+    uint64_t n = output.input_size;
+    uint64_t stride_size = output.stride_size;
+
+    if (begin >= end || end > n) {
+        throw BaseErrors::InvalidOperationException("Decode range is outside the blob");
+    }
+
+    check_engine(output);
+
+    // Strides decode independently, so only the ones overlapping [begin, end) are run.
+    uint64_t first_stride = begin / stride_size;
+    uint64_t last_stride = (end - 1) / stride_size;
+    uint64_t window_start = first_stride * stride_size;
+    uint64_t window_end = std::min((last_stride + 1) * stride_size, n);
+
+    auto window = rainman::ptr<uint8_t>(window_end - window_start);
+    decode_strides(output, window.pointer(), first_stride, last_stride + 1, window_start);
+
+    decode_residues(window.pointer(), output, window_start, window_end);
+
+    std::memcpy(dst, window.pointer() + (begin - window_start), end - begin);
+}
+
+void InterlacedRansCodec::decode_strides(
+        const encoder_output &output,
+        uint8_t *input,
+        uint64_t first_stride,
+        uint64_t last_stride,
+        uint64_t window_start
+) {
+    uint64_t n_strides = last_stride - first_stride;
+
+#ifdef INTERLACED_ANS_SIMD_X86
+    uint64_t lanes = 0;
+
+    switch (Simd::get()) {
+        case SimdLevel::AVX512:
+            lanes = 8;
+            break;
+        case SimdLevel::AVX2:
+            lanes = 4;
+            break;
+        default:
+            break;
+    }
+
+    // A stride's states must fit in one vector. The SIMD decoders only run the 64-bit engine.
+    if (output.engine == Engine::RANS64 && lanes >= output.states) {
+        uint64_t batch = RANS64_SIMD_VECTORS * lanes / output.states;
+        uint64_t n_batches = n_strides / batch + (n_strides % batch != 0);
+
+        ThreadPool::global().parallel_for(n_batches, [&](uint64_t i) {
+            uint64_t first = first_stride + i * batch;
+            uint64_t count = std::min(batch, last_stride - first);
+
+            if (lanes == 8) {
+                decode_strides_avx512(output, input, first, count, window_start);
+            } else {
+                decode_strides_avx2(output, input, first, count, window_start);
+            }
+        });
+
+        return;
+    }
+#endif
+
+    auto decode = stride_decoder(output.states, output.engine);
+
+    ThreadPool::global().parallel_for(n_strides, [&](uint64_t i) {
+        (this->*decode)(input, output.input_size, output.cl_outputs.pointer(), output.output_offsets.pointer(),
+                        output.output_ns.pointer(), output.input_residues.pointer(), output.stride_size, first_stride + i,
+                        window_start);
+    });
+}
+
+void InterlacedRansCodec::encode_stride(
+        const uint8_t *input,
+        uint64_t input_n,
+        uint32_t *output,
+        uint64_t *output_ns,
+        uint64_t *input_residues,
+        uint64_t stride_size,
+        uint64_t tid
+) {
+    uint64_t input_start_index = tid * stride_size;
+    uint64_t input_end_index = std::min(input_start_index + stride_size, input_n) - 1;
+    uint64_t input_size = input_end_index - input_start_index + 1;
+
+    uint64_t output_unit_size = stride_size >> 2;
+    uint32_t *output_ptr = output + tid * output_unit_size;
+
+    const rans64_enc_symbol *etable = _etable.pointer();
+    const uint64_t lower_bound = 1ull << 31;
+
+    uint64_t input_index = input_end_index;
+    uint64_t counter = 0;
+    uint64_t state = lower_bound;
+    uint64_t state_counter = 0;
+
+    while (counter != input_size) {
+        const auto &symbol = etable[input[input_index]];
+
+        if (state >= symbol.x_max) {
+            output_ptr[state_counter] = state;
+            state >>= 32;
+            state_counter++;
+        }
+
+        state = encode_step(state, symbol);
+        counter++;
+        input_index--;
+
+        // Leave the remaining symbols to the residue coder once the stride's output is full.
+        if (state_counter == output_unit_size - 2) {
             break;
         }
     }
 
-    return symbol;
+    input_residues[tid] = input_size - counter;
+
+    output_ptr[state_counter] = state;
+    output_ptr[state_counter + 1] = state >> 32;
+    output_ns[tid] = state_counter + 2;
+}
+
+void InterlacedRansCodec::decode_stride(
+        uint8_t *input,
+        uint64_t input_n,
+        const uint32_t *output,
+        const uint64_t *output_offsets,
+        const uint64_t *output_ns,
+        const uint64_t *input_residues,
+        uint64_t stride_size,
+        uint64_t tid,
+        uint64_t window_start
+) {
+    // Stored strides have no rANS words and are copied by decode_residues().
+    if (output_ns[tid] == 0) {
+        return;
+    }
+
+    uint64_t input_start_index = tid * stride_size;
+    uint64_t input_end_index = std::min(input_start_index + stride_size, input_n) - 1;
+    uint64_t input_residue = input_residues[tid];
+    uint64_t input_size = input_end_index - input_start_index + 1 - input_residue;
+
+    uint64_t output_end_index = output_offsets[tid] + output_ns[tid] - 1;
+
+    const uint64_t *ftable = _ftable.pointer();
+    const uint64_t *ctable = _ctable.pointer();
+
+    const uint64_t lower_bound = 1ull << 31;
+    const uint64_t mask = (1ull << RANS64_SCALE) - 1;
+
+    uint64_t input_index = input_start_index + input_residue - window_start;
+    uint64_t state = output[output_end_index];
+    state = (state << 32) | output[output_end_index - 1];
+    uint64_t state_counter = output_end_index - 2;
+
+    for (uint64_t counter = 0; counter < input_size; counter++) {
+        uint64_t bs = state & mask;
+        uint8_t symbol = inv_bs(bs);
+
+        input[input_index++] = symbol;
+        uint64_t ls = ftable[symbol];
+        bs = ctable[symbol];
+
+        state = (ls * (state >> RANS64_SCALE)) + (state & mask) - bs;
+
+        if (state < lower_bound) {
+            state = (state << 32) | output[state_counter];
+            state_counter--;
+        }
+    }
+}
+
+InterlacedRansCodec::stride_encoder_t InterlacedRansCodec::stride_encoder(uint64_t states, Engine engine) {
+    if (engine == Engine::RANS32) {
+        switch (states) {
+            case 1:
+                return &InterlacedRansCodec::encode_stride32<1>;
+            case 2:
+                return &InterlacedRansCodec::encode_stride32<2>;
+            case 4:
+                return &InterlacedRansCodec::encode_stride32<4>;
+            case 8:
+                return &InterlacedRansCodec::encode_stride32<8>;
+            default:
+                throw BaseErrors::InvalidOperationException("Unsupported number of states: " + std::to_string(states));
+        }
+    }
+
+    switch (states) {
+        case 1:
+            return &InterlacedRansCodec::encode_stride;
+        case 2:
+            return &InterlacedRansCodec::encode_stride_interleaved<2>;
+        case 4:
+            return &InterlacedRansCodec::encode_stride_interleaved<4>;
+        case 8:
+            return &InterlacedRansCodec::encode_stride_interleaved<8>;
+        default:
+            throw BaseErrors::InvalidOperationException("Unsupported number of states: " + std::to_string(states));
+    }
+}
+
+InterlacedRansCodec::stride_decoder_t InterlacedRansCodec::stride_decoder(uint64_t states, Engine engine) {
+    if (engine == Engine::RANS32) {
+        switch (states) {
+            case 1:
+                return &InterlacedRansCodec::decode_stride32<1>;
+            case 2:
+                return &InterlacedRansCodec::decode_stride32<2>;
+            case 4:
+                return &InterlacedRansCodec::decode_stride32<4>;
+            case 8:
+                return &InterlacedRansCodec::decode_stride32<8>;
+            default:
+                throw BaseErrors::InvalidOperationException("Unsupported number of states: " + std::to_string(states));
+        }
+    }
+
+    switch (states) {
+        case 1:
+            return &InterlacedRansCodec::decode_stride;
+        case 2:
+            return &InterlacedRansCodec::decode_stride_interleaved<2>;
+        case 4:
+            return &InterlacedRansCodec::decode_stride_interleaved<4>;
+        case 8:
+            return &InterlacedRansCodec::decode_stride_interleaved<8>;
+        default:
+            throw BaseErrors::InvalidOperationException("Unsupported number of states: " + std::to_string(states));
+    }
+}
+
+template<uint64_t K>
+void InterlacedRansCodec::encode_stride_interleaved(
+        const uint8_t *input,
+        uint64_t input_n,
+        uint32_t *output,
+        uint64_t *output_ns,
+        uint64_t *input_residues,
+        uint64_t stride_size,
+        uint64_t tid
+) {
+    uint64_t input_start_index = tid * stride_size;
+    uint64_t input_size = std::min(input_start_index + stride_size, input_n) - input_start_index;
+    const uint8_t *stride = input + input_start_index;
+
+    uint64_t output_unit_size = stride_size >> 2;
+    uint32_t *output_ptr = output + tid * output_unit_size;
+
+    const rans64_enc_symbol *etable = _etable.pointer();
+    const uint64_t lower_bound = 1ull << 31;
+
+    // Every symbol emits at most one word and the final states take two words each.
+    const uint64_t limit = output_unit_size - 2 * K;
+
+    uint64_t state[K];
+    for (uint64_t j = 0; j < K; j++) {
+        state[j] = lower_bound;
+    }
+
+    uint64_t state_counter = 0;
+
+    auto put = [&](uint64_t &x, uint8_t s) {
+        const auto &symbol = etable[s];
+
+        if (x >= symbol.x_max) {
+            output_ptr[state_counter++] = x;
+            x >>= 32;
+        }
+
+        x = encode_step(x, symbol);
+    };
+
+    // Coding runs backwards, so the incomplete group at the end of the stride goes first. Whole groups
+    // are only started while all of their words fit, which keeps the residue a multiple of K.
+    uint64_t tail = input_size % K;
+    uint64_t index = input_size;
+
+    if (tail <= limit) {
+        for (; index > input_size - tail; index--) {
+            put(state[(index - 1) % K], stride[index - 1]);
+        }
+
+        for (; index != 0 && state_counter + K <= limit; index -= K) {
+            for (uint64_t j = K; j-- > 0;) {
+                put(state[j], stride[index - K + j]);
+            }
+        }
+    }
+
+    input_residues[tid] = index;
+
+    for (uint64_t j = 0; j < K; j++) {
+        output_ptr[state_counter++] = state[j];
+        output_ptr[state_counter++] = state[j] >> 32;
+    }
+
+    output_ns[tid] = state_counter;
+}
+
+template<uint64_t K>
+void InterlacedRansCodec::decode_stride_interleaved(
+        uint8_t *input,
+        uint64_t input_n,
+        const uint32_t *output,
+        const uint64_t *output_offsets,
+        const uint64_t *output_ns,
+        const uint64_t *input_residues,
+        uint64_t stride_size,
+        uint64_t tid,
+        uint64_t window_start
+) {
+    if (output_ns[tid] == 0) {
+        return;
+    }
+
+    uint64_t input_start_index = tid * stride_size;
+    uint64_t input_size = std::min(input_start_index + stride_size, input_n) - input_start_index;
+    uint8_t *stride = input + (input_start_index - window_start);
+
+    const uint32_t *output_ptr = output + output_offsets[tid];
+
+    const uint64_t *ftable = _ftable.pointer();
+    const uint64_t *ctable = _ctable.pointer();
+
+    const uint64_t lower_bound = 1ull << 31;
+    const uint64_t mask = (1ull << RANS64_SCALE) - 1;
+
+    uint64_t state_counter = output_ns[tid];
+    uint64_t state[K];
+
+    for (uint64_t j = K; j-- > 0;) {
+        uint64_t x = output_ptr[--state_counter];
+        state[j] = (x << 32) | output_ptr[--state_counter];
+    }
+
+    auto get = [&](uint64_t &x) -> uint8_t {
+        uint8_t symbol = inv_bs(x & mask);
+        x = (ftable[symbol] * (x >> RANS64_SCALE)) + (x & mask) - ctable[symbol];
+
+        if (x < lower_bound) {
+            x = (x << 32) | output_ptr[--state_counter];
+        }
+
+        return symbol;
+    };
+
+    // Mirror of the encoder: whole groups from the residue onwards, then the incomplete group.
+    uint64_t index = input_residues[tid];
+    uint64_t groups_end = input_size - input_size % K;
+
+    for (; index < groups_end; index += K) {
+        for (uint64_t j = 0; j < K; j++) {
+            stride[index + j] = get(state[j]);
+        }
+    }
+
+    for (; index < input_size; index++) {
+        stride[index] = get(state[index % K]);
+    }
 }
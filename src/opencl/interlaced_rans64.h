@@ -2,55 +2,457 @@
 #define INTERLACED_ANS_INTERLACED_RANS64_H
 
 #include <rainman/rainman.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <engine.h>
+
+// INTERLACED_ANS_OPENCL is defined by builds with the OpenCL executors; without it only the host codec is compiled.
+#ifdef INTERLACED_ANS_OPENCL
+#include <CL/opencl.hpp>
+#endif
+
+// Largest number of interleaved rANS states per stride.
+#define INTERLACED_ANS_MAX_STATES 8
+
+#define RANS64_SCALE 24
+
+// The decode lookup table maps the top RANS64_LOOKUP_BITS of a slot to a symbol (4KB).
+#define RANS64_LOOKUP_BITS 12
+#define RANS64_LOOKUP_SHIFT (RANS64_SCALE - RANS64_LOOKUP_BITS)
+
+// Scale of the 32-bit engine, whose states renormalize 16 bits at a time. It shares the decode lookup table size.
+#define RANS32_SCALE 16
+#define RANS32_LOOKUP_SHIFT (RANS32_SCALE - RANS64_LOOKUP_BITS)
+
+// Largest work group of the 'scan' kernel, which runs as a single group (SCAN_SIZE in interlaced_rans64.cl).
+#define INTERLACED_ANS_SCAN_SIZE 256
+
+// Largest number of strides whose symbols and words the OpenCL kernels interleave (MAX_TILE in interlaced_rans64.cl).
+#define INTERLACED_ANS_MAX_TILE 64
+
+// Approximate number of symbols per chunk of a blob that the OpenCL codec transfers and codes while the previous
+// chunk's transfers are in flight.
+#define INTERLACED_ANS_OPENCL_CHUNK_SIZE 0x800000
+
+// Symbols and stride size of the text-like probe that picks the faster decode kernel of every device.
+#define INTERLACED_ANS_DECODE_PROBE_SIZE 0x100000
+#define INTERLACED_ANS_DECODE_PROBE_STRIDE 4096
+
+// Vectors the SIMD decoders step together, so that the gathers of one overlap with the arithmetic of the others.
+#define RANS64_SIMD_VECTORS 4
 
 namespace interlaced_ans {
+    namespace opencl {
+        class Session;
+
+        class ResidencyGuard;
+    }
 
     struct encoder_output {
-        rainman::ptr<uint32_t> cl_outputs;
-        rainman::ptr<uint64_t> output_ns;
-        rainman::ptr<uint32_t> residual_output;
-        rainman::ptr<uint64_t> input_residues;
+        rainman::ptr<uint32_t> cl_outputs{};
+        rainman::ptr<uint64_t> output_ns{};
+
+        // Index of the first word of each stride in cl_outputs. Host encoders leave every stride in a slot of
+        // stride_size / 4 words, while strides read from a file or a device are packed one after the other.
+        rainman::ptr<uint64_t> output_offsets{};
+        rainman::ptr<uint32_t> residual_output{};
+        rainman::ptr<uint64_t> input_residues{};
+
+        // Words of each stride's residue stream in residual_output. A stride with no rANS words (output_ns
+        // of 0) is stored as it is, and its stream holds the raw bytes.
+        rainman::ptr<uint64_t> residual_ns{};
 
-        uint64_t stride_size;
-        uint64_t input_size;
+        uint64_t stride_size = 0;
+        uint64_t input_size = 0;
+
+        // Number of interleaved states each stride was coded with (1, 2, 4 or 8).
+        uint64_t states = 1;
+
+        // Engine the strides and residues were coded with. Rans32 packs two 16-bit units into each word.
+        Engine engine = Engine::RANS64;
+
+        // Set for files older than version 4, whose residues share a single stream and have no residual_ns.
+        bool shared_residues = false;
+    };
+
+    // Encode step of one symbol in reciprocal form, as in ryg_rans' Rans64EncSymbol. The layout matches
+    // the struct of the same name in interlaced_rans64.cl.
+    struct rans64_enc_symbol {
+        uint64_t rcp_freq;
+
+        // Renormalize before coding the symbol if the state is at least this.
+        uint64_t x_max;
+
+        uint32_t bias;
+        uint32_t cmpl_freq;
+        uint32_t rcp_shift;
+        uint32_t padding;
     };
 
-    class Rans64Codec {
+    // Encode step of one symbol for the 32-bit engine, laid out like the struct of the same name that the kernels of
+    // both engines share.
+    struct rans32_enc_symbol {
+        uint32_t freq;
+        uint32_t start;
+    };
+
+    // Milliseconds the decode kernels with tables in local and in global memory took on the probe of
+    // InterlacedRansCodec::probe_decode_tables().
+    struct decode_tables_probe {
+        double local_ms = 0;
+        double global_ms = 0;
+    };
+
+    /*
+     * Interlaced rANS codec. Rans64 is the default engine; with Engine::RANS32 the same pipeline runs the 32-bit
+     * stride and residue coders of interlaced_rans32.cpp and interlaced_rans32.cl, and the tables are built at
+     * RANS32_SCALE.
+     */
+    class InterlacedRansCodec {
     private:
         rainman::ptr<uint64_t> _ftable;
         rainman::ptr<uint64_t> _ctable;
+        rainman::ptr<uint8_t> _dtable;
+        rainman::ptr<uint64_t> _btable;
+        rainman::ptr<rans64_enc_symbol> _etable;
+        rainman::ptr<rans32_enc_symbol> _etable32;
         bool _verbose;
+        uint64_t _states;
+        Engine _engine;
 
-        void register_kernel();
+#ifdef INTERLACED_ANS_OPENCL
+        static void register_kernel();
+#endif
 
-        rainman::ptr<uint32_t> encode_residues(
-                const rainman::ptr<uint8_t> &input,
-                const rainman::ptr<uint64_t> &input_residues,
-                uint64_t stride_size
-        );
+        // 'global_tables' names the variant whose decode kernel reads its tables from global memory instead of
+        // staging them in local memory (GLOBAL_TABLES in interlaced_rans64.cl).
+        static std::string program_name(uint64_t states, Engine engine, bool global_tables = false);
+
+        // Frequency scale in bits of an engine's tables.
+        static uint64_t scale(Engine engine);
+
+        // Throws unless 'output' was coded with this codec's engine, whose tables it holds.
+        void check_engine(const encoder_output &output) const;
+
+        void check_stride(uint64_t stride_size) const;
+
+        // Codes the symbols each stride left over into a stream of its own, and stores strides that
+        // would not shrink. Fills residual_output and residual_ns.
+        void encode_residues(const uint8_t *input, encoder_output &output);
+
+        std::vector<uint32_t> encode_residue(const uint8_t *input, uint64_t residue);
 
+        // Decodes the residues of the strides in [window_start, window_end), which must cover whole strides
+        // unless the output is older than version 4.
         void decode_residues(
-                const rainman::ptr<uint8_t> &input,
+                uint8_t *input,
+                const encoder_output &output,
+                uint64_t window_start = 0,
+                uint64_t window_end = UINT64_MAX
+        );
+
+        void decode_residue(uint8_t *output, uint64_t residue, const uint32_t *words, uint64_t n_words);
+
+        // Decodes the single residue stream shared by all strides of files older than version 4.
+        void decode_shared_residues(
+                uint8_t *input,
                 const rainman::ptr<uint64_t> &input_residues,
                 const rainman::ptr<uint32_t> &encoded_residues,
-                uint64_t stride_size
+                uint64_t stride_size,
+                uint64_t window_start,
+                uint64_t window_end
         );
 
         uint8_t inv_bs(uint64_t bs);
 
+        void encode_stride(
+                const uint8_t *input,
+                uint64_t input_n,
+                uint32_t *output,
+                uint64_t *output_ns,
+                uint64_t *input_residues,
+                uint64_t stride_size,
+                uint64_t tid
+        );
+
+        void decode_stride(
+                uint8_t *input,
+                uint64_t input_n,
+                const uint32_t *output,
+                const uint64_t *output_offsets,
+                const uint64_t *output_ns,
+                const uint64_t *input_residues,
+                uint64_t stride_size,
+                uint64_t tid,
+                uint64_t window_start = 0
+        );
+
+        // Stride coders with K interleaved states: symbol i of a stride is coded by state i % K, so the
+        // K dependency chains can run in parallel. The states share the stride's output words.
+        template<uint64_t K>
+        void encode_stride_interleaved(
+                const uint8_t *input,
+                uint64_t input_n,
+                uint32_t *output,
+                uint64_t *output_ns,
+                uint64_t *input_residues,
+                uint64_t stride_size,
+                uint64_t tid
+        );
+
+        template<uint64_t K>
+        void decode_stride_interleaved(
+                uint8_t *input,
+                uint64_t input_n,
+                const uint32_t *output,
+                const uint64_t *output_offsets,
+                const uint64_t *output_ns,
+                const uint64_t *input_residues,
+                uint64_t stride_size,
+                uint64_t tid,
+                uint64_t window_start = 0
+        );
+
+        // Decodes strides [first_stride, last_stride) into 'input', which starts at symbol 'window_start'.
+        // Uses the widest SIMD decoder the CPU supports and the scalar stride decoders otherwise.
+        void decode_strides(
+                const encoder_output &output,
+                uint8_t *input,
+                uint64_t first_stride,
+                uint64_t last_stride,
+                uint64_t window_start
+        );
+
+        // Lockstep decoders from interlaced_rans64_simd.cpp. Each decodes 'count' strides, at most
+        // RANS64_SIMD_VECTORS vectors of 64-bit lanes with one state per lane.
+        void decode_strides_avx2(
+                const encoder_output &output,
+                uint8_t *input,
+                uint64_t first_stride,
+                uint64_t count,
+                uint64_t window_start
+        );
+
+        void decode_strides_avx512(
+                const encoder_output &output,
+                uint8_t *input,
+                uint64_t first_stride,
+                uint64_t count,
+                uint64_t window_start
+        );
+
+        typedef void (InterlacedRansCodec::*stride_encoder_t)(
+                const uint8_t *, uint64_t, uint32_t *, uint64_t *, uint64_t *, uint64_t, uint64_t
+        );
+
+        typedef void (InterlacedRansCodec::*stride_decoder_t)(
+                uint8_t *, uint64_t, const uint32_t *, const uint64_t *, const uint64_t *, const uint64_t *, uint64_t, uint64_t,
+                uint64_t
+        );
+
+        static stride_encoder_t stride_encoder(uint64_t states, Engine engine);
+
+        static stride_decoder_t stride_decoder(uint64_t states, Engine engine);
+
+        // Rans32 counterparts of the stride and residue coders, in interlaced_rans32.cpp. Strides are coded like the
+        // 'encode' and 'decode' kernels of interlaced_rans32.cl, with any number of states.
+        template<uint64_t K>
+        void encode_stride32(
+                const uint8_t *input,
+                uint64_t input_n,
+                uint32_t *output,
+                uint64_t *output_ns,
+                uint64_t *input_residues,
+                uint64_t stride_size,
+                uint64_t tid
+        );
+
+        template<uint64_t K>
+        void decode_stride32(
+                uint8_t *input,
+                uint64_t input_n,
+                const uint32_t *output,
+                const uint64_t *output_offsets,
+                const uint64_t *output_ns,
+                const uint64_t *input_residues,
+                uint64_t stride_size,
+                uint64_t tid,
+                uint64_t window_start = 0
+        );
+
+        std::vector<uint32_t> encode_residue32(const uint8_t *input, uint64_t residue);
+
+        void decode_residue32(uint8_t *output, uint64_t residue, const uint32_t *words, uint64_t n_words);
+
+        uint8_t inv_bs32(uint32_t bs);
+
+        void create_dtable();
+
+        void create_btable();
+
+        void create_etable();
+
+#ifdef INTERLACED_ANS_OPENCL
+        // Enqueues the 'scan' kernel, which writes the offsets of the words of 'count' strides from 'first' in
+        // the packed words to buf_offsets, starting at 'base'.
+        static void enqueue_scan(
+                opencl::Session &session,
+                const std::string &program,
+                const cl::Buffer &buf_output_ns,
+                const cl::Buffer &buf_offsets,
+                uint64_t first,
+                uint64_t count,
+                uint64_t base
+        );
+
+        // Number of strides per tile in the device layout, see tile_base() in interlaced_rans64.cl. GPUs get tiles
+        // as wide as a warp so that its loads and stores coalesce, CPU devices keep one stride after the other.
+        static uint64_t tile_size(const cl::Device &device, uint64_t local_size);
+
+        // Number of strides per chunk of a blob of 'true_size' strides, a whole number of work groups and tiles.
+        // The whole blob is one chunk unless opencl::SessionProvider::chunked() is set.
+        static uint64_t chunk_strides(uint64_t true_size, uint64_t stride_size, uint64_t local_size, uint64_t tile);
+
+        // Enqueues 'tile_symbols' or 'untile_symbols' to move the symbols of strides [first, last) of a blob of
+        // 'n' symbols between the plain layout and tiles of 'tile' strides. 'first' is a multiple of 'tile'.
+        static void enqueue_tiling(
+                opencl::Session &session,
+                const std::string &program,
+                const std::string &name,
+                const cl::Buffer &src,
+                const cl::Buffer &dst,
+                uint64_t n,
+                uint64_t stride_size,
+                uint64_t tile,
+                uint64_t first,
+                uint64_t last
+        );
+
+        // Enqueues 'compact' or 'expand' to move the words of strides [first, last) between their slots in the
+        // device layout and the packed words at the scanned offsets.
+        static void enqueue_packing(
+                opencl::Session &session,
+                const std::string &program,
+                const std::string &name,
+                const cl::Buffer &src,
+                const cl::Buffer &buf_output_ns,
+                const cl::Buffer &buf_offsets,
+                const cl::Buffer &dst,
+                uint64_t first,
+                uint64_t last,
+                uint64_t stride_size,
+                uint64_t tile
+        );
+
+        // Uploads a blob in chunks unless it is resident, runs the encode kernels on every chunk once it has arrived
+        // and packs its words on the device, so only the coded words are read back while later chunks are coded.
+        // Unlocks the session through 'guard' before coding the residues.
+        encoder_output run_encode(
+                opencl::Session &session,
+                opencl::ResidencyGuard &guard,
+                const cl::Buffer &buf_etable,
+                const uint8_t *input,
+                uint64_t n,
+                uint64_t stride_size
+        );
+
+        // Decodes every stride of 'output' on a locked session with the decode kernel that stages its tables in
+        // local memory, or reads them from global memory with 'global_tables'. 'offsets' holds the offsets of
+        // each stride's words in the packed words, as in opencl_decode().
+        void run_decode(
+                opencl::Session &session,
+                const encoder_output &output,
+                uint8_t *input,
+                const std::vector<uint64_t> &offsets,
+                bool global_tables
+        );
+
+        // Times both decode kernels of a program on a fixed probe of INTERLACED_ANS_DECODE_PROBE_SIZE symbols on a
+        // locked session and keeps the faster one as the session's variant for every later decode.
+        static decode_tables_probe run_decode_probe(
+                opencl::Session &session,
+                uint64_t states,
+                Engine engine,
+                bool verbose
+        );
+#endif
+
     public:
-        explicit Rans64Codec(
+        explicit InterlacedRansCodec(
                 const rainman::ptr<uint64_t> &ftable,
-                bool verbose = false
-        ) : _ftable(ftable), _verbose(verbose) {}
+                bool verbose = false,
+                uint64_t states = 1,
+                Engine engine = Engine::RANS64
+        ) : _ftable(ftable), _verbose(verbose), _states(states), _engine(engine) {}
+
+        // Returns true if strides can be coded with 'states' interleaved states.
+        static bool valid_states(uint64_t states);
+
+        // Estimates the size in bytes of the encoder output of a blob from its symbol counts, using their
+        // order-0 entropy plus the per-stride headers and final states.
+        static uint64_t estimate_size(const rainman::ptr<uint64_t> &histogram, uint64_t stride_size, uint64_t states);
 
         void normalize();
 
+        // Returns a copy of a histogram normalized to the scale of 'engine', leaving the histogram as it is.
+        static rainman::ptr<uint64_t> normalized(
+                const rainman::ptr<uint64_t> &histogram,
+                Engine engine = Engine::RANS64
+        );
+
         void create_ctable();
 
+        [[nodiscard]] const rainman::ptr<uint64_t> &ftable() const {
+            return _ftable;
+        }
+
+#ifdef INTERLACED_ANS_OPENCL
         encoder_output opencl_encode(const rainman::ptr<uint8_t> &input, uint64_t stride_size);
 
+        encoder_output opencl_encode(const rainman::ptr<uint8_t> &input, uint64_t stride_size, const cl::Device &device);
+
+        // Encodes 'n' symbols in place, e.g. from a memory-mapped view.
+        encoder_output opencl_encode(const uint8_t *input, uint64_t n, uint64_t stride_size, const cl::Device &device);
+
+        // Counts, normalizes and encodes 'n' symbols on the device in one pass: the blob is uploaded once and the
+        // tables never round-trip through the host between stages. Replaces this codec's tables with the ones
+        // built on the device and fills 'histogram' with the symbol counts.
+        encoder_output opencl_encode(
+                const uint8_t *input,
+                uint64_t n,
+                uint64_t stride_size,
+                const cl::Device &device,
+                rainman::ptr<uint64_t> &histogram
+        );
+
         rainman::ptr<uint8_t> opencl_decode(const encoder_output &output);
+
+        rainman::ptr<uint8_t> opencl_decode(const encoder_output &output, const cl::Device &device);
+
+        // Decodes into 'input', which must hold output.input_size bytes.
+        void opencl_decode(const encoder_output &output, uint8_t *input, const cl::Device &device);
+
+        // Probes which decode kernel is faster on 'device', as the first decode on every device does, and returns
+        // the timings. Runs the probe again even if the device has been probed before.
+        static decode_tables_probe probe_decode_tables(
+                const cl::Device &device,
+                uint64_t states = 1,
+                Engine engine = Engine::RANS64,
+                bool verbose = false
+        );
+#endif
+
+        encoder_output cpu_encode(const rainman::ptr<uint8_t> &input, uint64_t stride_size);
+
+        encoder_output cpu_encode(const uint8_t *input, uint64_t n, uint64_t stride_size);
+
+        rainman::ptr<uint8_t> cpu_decode(const encoder_output &output);
+
+        void cpu_decode(const encoder_output &output, uint8_t *input);
+
+        // Decodes symbols [begin, end) of the blob into 'dst', running only the strides that cover them.
+        void cpu_decode_range(const encoder_output &output, uint64_t begin, uint64_t end, uint8_t *dst);
     };
 
 }
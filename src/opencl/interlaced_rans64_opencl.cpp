@@ -0,0 +1,738 @@
+#include "interlaced_rans64.h"
+#include <vector>
+#include <iostream>
+#include "cl_helper.h"
+#include "session.h"
+#include "freq_dist.h"
+#include <errors/base.h>
+#include <cstring>
+#include <numeric>
+#include <chrono>
+#include <limits>
+
+using namespace interlaced_ans;
+
+/*
+ * OpenCL side of InterlacedRansCodec, only built with INTERLACED_ANS_OPENCL. Tables and residues come from the host
+ * code in interlaced_rans64.cpp.
+ */
+
+namespace {
+    // Host memory that opencl_decode() uploads and that the caller may release once it returns.
+    const std::vector<std::string> decode_uploads = {
+            INTERLACED_ANS_OPENCL_BLOB_BUFFER,
+            "interlaced_rans.ftable",
+            "interlaced_rans.ctable",
+            "interlaced_rans.dtable",
+            "interlaced_rans.output_ns",
+            "interlaced_rans.input_residues"
+    };
+
+    // Text-like symbols for the decode probe, the same on every run.
+    rainman::ptr<uint8_t> probe_symbols() {
+        const std::string alphabet = "eeeeeeeetttttaaaooiinnsshhrdlu  \n";
+        auto symbols = rainman::ptr<uint8_t>(INTERLACED_ANS_DECODE_PROBE_SIZE);
+        uint64_t seed = 1;
+
+        for (uint64_t i = 0; i < symbols.size(); i++) {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            symbols[i] = alphabet[(seed >> 56) % alphabet.size()];
+        }
+
+        return symbols;
+    }
+}
+
+void InterlacedRansCodec::register_kernel() {
+    const std::string source =
+
+#include "interlaced_rans64.cl"
+
+    ;
+
+    const std::string rans32_source =
+
+#include "interlaced_rans32.cl"
+
+    ;
+
+    // Interleaved variants are the same program built with a fixed number of states. The 32-bit engine replaces
+    // the encode and decode kernels and keeps the rest. Every program also comes with global decode tables.
+    for (uint64_t states = 1; states <= INTERLACED_ANS_MAX_STATES; states <<= 1) {
+        for (bool global_tables : {false, true}) {
+            std::string prefix = states == 1 ? "" : "#define STATES " + std::to_string(states) + "\n";
+            if (global_tables) {
+                prefix += "#define GLOBAL_TABLES\n";
+            }
+
+            opencl::ProgramProvider::register_program(program_name(states, Engine::RANS64, global_tables),
+                                                      prefix + source);
+            opencl::ProgramProvider::register_program(program_name(states, Engine::RANS32, global_tables),
+                                                      prefix + "#define RANS32\n" + source + rans32_source);
+        }
+    }
+}
+
+encoder_output InterlacedRansCodec::opencl_encode(const rainman::ptr<uint8_t> &input, uint64_t stride_size) {
+    return opencl_encode(input, stride_size, opencl::DeviceProvider::get());
+}
+
+encoder_output InterlacedRansCodec::opencl_encode(
+        const rainman::ptr<uint8_t> &input,
+        uint64_t stride_size,
+        const cl::Device &device
+) {
+    return opencl_encode(input.pointer(), input.size(), stride_size, device);
+}
+
+encoder_output InterlacedRansCodec::opencl_encode(
+        const uint8_t *input,
+        uint64_t n,
+        uint64_t stride_size,
+        const cl::Device &device
+) {
+    register_kernel();
+
+    auto session = opencl::SessionProvider::get(device);
+    std::unique_lock<std::mutex> lk(session->mutex());
+    auto guard = opencl::ResidencyGuard(*session, lk, {
+            INTERLACED_ANS_OPENCL_BLOB_BUFFER, "interlaced_rans.rans64_etable", "interlaced_rans.rans32_etable"
+    });
+
+    // The blob is usually still resident from freq_dist, in which case run_encode does not upload it again.
+    auto buf_etable = _engine == Engine::RANS32 ? session->upload("interlaced_rans.rans32_etable", _etable32)
+                                                : session->upload("interlaced_rans.rans64_etable", _etable);
+    return run_encode(*session, guard, buf_etable, input, n, stride_size);
+}
+
+encoder_output InterlacedRansCodec::opencl_encode(
+        const uint8_t *input,
+        uint64_t n,
+        uint64_t stride_size,
+        const cl::Device &device,
+        rainman::ptr<uint64_t> &histogram
+) {
+    register_kernel();
+
+    auto session = opencl::SessionProvider::get(device);
+    std::unique_lock<std::mutex> lk(session->mutex());
+    auto guard = opencl::ResidencyGuard(*session, lk, {
+            INTERLACED_ANS_OPENCL_BLOB_BUFFER, "interlaced_rans.rans64_etable", "interlaced_rans.rans32_etable"
+    });
+
+    auto &queue = session->queue();
+
+    // The histogram needs the whole blob, so only the staging of its chunks overlaps their transfers here.
+    std::vector<cl::Event> uploads;
+    auto buf_input = session->upload_chunks(
+            INTERLACED_ANS_OPENCL_BLOB_BUFFER, input, n, INTERLACED_ANS_OPENCL_CHUNK_SIZE,
+            [&](const cl::Buffer &, uint64_t, const cl::Event &event) {
+                if (event()) {
+                    uploads.push_back(event);
+                }
+            }
+    );
+
+    if (!uploads.empty()) {
+        queue.enqueueBarrierWithWaitList(&uploads);
+    }
+
+    auto buf_histogram = FrequencyDistribution(_verbose).enqueue_kernels(*session, buf_input, n, stride_size);
+
+    auto kernel = session->kernel(program_name(_states, _engine), "tables");
+
+    uint64_t local_size = std::min(kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device), (size_t) 256);
+
+    auto buf_ftable = session->buffer("interlaced_rans.ftable", 256 * sizeof(uint64_t));
+    auto buf_ctable = session->buffer("interlaced_rans.ctable", 256 * sizeof(uint64_t));
+    auto buf_etable = session->buffer("interlaced_rans.rans64_etable", 256 * sizeof(rans64_enc_symbol));
+
+    session->invalidate("interlaced_rans.ftable");
+    session->invalidate("interlaced_rans.ctable");
+    session->invalidate("interlaced_rans.rans64_etable");
+
+    kernel.setArg(0, buf_histogram);
+    kernel.setArg(1, buf_ftable);
+    kernel.setArg(2, buf_ctable);
+    kernel.setArg(3, buf_etable);
+
+    queue.enqueueNDRangeKernel(kernel, cl::NDRange(0), cl::NDRange(local_size), cl::NDRange(local_size));
+
+    // The host codes the residues with the same tables. The reads complete before run_encode returns.
+    histogram = rainman::ptr<uint64_t>(256);
+    _ftable = rainman::ptr<uint64_t>(256);
+    _ctable = rainman::ptr<uint64_t>(256);
+
+    queue.enqueueReadBuffer(buf_histogram, CL_FALSE, 0, 256 * sizeof(uint64_t), histogram.pointer());
+    queue.enqueueReadBuffer(buf_ftable, CL_FALSE, 0, 256 * sizeof(uint64_t), _ftable.pointer());
+    queue.enqueueReadBuffer(buf_ctable, CL_FALSE, 0, 256 * sizeof(uint64_t), _ctable.pointer());
+
+    // Residues are coded on the host with the same encode table.
+    if (_engine == Engine::RANS32) {
+        _etable32 = rainman::ptr<rans32_enc_symbol>(256);
+        queue.enqueueReadBuffer(buf_etable, CL_FALSE, 0, 256 * sizeof(rans32_enc_symbol), _etable32.pointer());
+    } else {
+        _etable = rainman::ptr<rans64_enc_symbol>(256);
+        queue.enqueueReadBuffer(buf_etable, CL_FALSE, 0, 256 * sizeof(rans64_enc_symbol), _etable.pointer());
+    }
+
+    return run_encode(*session, guard, buf_etable, input, n, stride_size);
+}
+
+encoder_output InterlacedRansCodec::run_encode(
+        opencl::Session &session,
+        opencl::ResidencyGuard &guard,
+        const cl::Buffer &buf_etable,
+        const uint8_t *input,
+        uint64_t n,
+        uint64_t stride_size
+) {
+    check_stride(stride_size);
+
+    auto &device = session.device();
+    auto program = program_name(_states, _engine);
+    auto kernel = session.kernel(program, "encode");
+    auto &queue = session.queue();
+    auto &transfer_queue = session.transfer_queue();
+
+    if (_verbose) {
+        std::cout << "[OPENCL]\t\tRunning '" << program << ".encode' kernels on device: "
+                  << device.getInfo<CL_DEVICE_NAME>() << std::endl;
+    }
+
+    uint64_t local_size = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+    uint64_t tile = tile_size(device, local_size);
+
+    uint64_t true_size = (n / stride_size) + (n % stride_size != 0);
+    uint64_t u32_size = stride_size >> 2;
+    uint64_t output_size = true_size * u32_size;
+
+    // The device layout rounds the strides up to whole tiles.
+    uint64_t tiled_size = (true_size / tile + (true_size % tile != 0)) * tile;
+
+    uint64_t chunk = chunk_strides(true_size, stride_size, local_size, tile);
+    uint64_t n_chunks = true_size / chunk + (true_size % chunk != 0);
+
+    auto buf_symbols = session.buffer("interlaced_rans.symbols", tile > 1 ? tiled_size * stride_size : 1);
+    auto buf_output = session.buffer("interlaced_rans.output", tiled_size * u32_size * sizeof(uint32_t));
+    auto buf_output_ns = session.buffer("interlaced_rans.output_ns", true_size * sizeof(uint64_t));
+    auto buf_input_residues = session.buffer("interlaced_rans.input_residues", true_size * sizeof(uint64_t));
+    auto buf_offsets = session.buffer("interlaced_rans.offsets", true_size * sizeof(uint64_t));
+    auto buf_packed = session.buffer("interlaced_rans.packed", output_size * sizeof(uint32_t));
+
+    session.invalidate("interlaced_rans.symbols");
+    session.invalidate("interlaced_rans.output");
+    session.invalidate("interlaced_rans.output_ns");
+    session.invalidate("interlaced_rans.input_residues");
+    session.invalidate("interlaced_rans.offsets");
+    session.invalidate("interlaced_rans.packed");
+
+    auto output = rainman::ptr<uint32_t>(output_size);
+    auto output_offsets = rainman::ptr<uint64_t>(true_size);
+    auto output_ns = rainman::ptr<uint64_t>(true_size);
+    auto input_residues = rainman::ptr<uint64_t>(true_size);
+
+    std::vector<cl::Event> counted(n_chunks);
+
+    // Every chunk's words are packed from chunk * u32_size and read back in place while the next chunk is coded,
+    // so the output keeps the device's packing and the writer stores it as it is.
+    auto download = [&](uint64_t c) {
+        uint64_t first = c * chunk;
+        uint64_t last = std::min(first + chunk, true_size);
+
+        counted[c].wait();
+
+        uint64_t words = 0;
+        for (uint64_t i = first; i < last; i++) {
+            output_offsets[i] = first * u32_size + words;
+            words += output_ns[i];
+        }
+
+        if (words != 0) {
+            transfer_queue.enqueueReadBuffer(buf_packed, CL_FALSE, first * u32_size * sizeof(uint32_t),
+                                             words * sizeof(uint32_t), output.pointer() + first * u32_size);
+            transfer_queue.flush();
+        }
+    };
+
+    session.upload_chunks(
+            INTERLACED_ANS_OPENCL_BLOB_BUFFER, input, n, chunk * stride_size,
+            [&](const cl::Buffer &buf_input, uint64_t c, const cl::Event &event) {
+                uint64_t first = c * chunk;
+                uint64_t last = std::min(first + chunk, true_size);
+                uint64_t global_size = ((last - first) / local_size + ((last - first) % local_size != 0)) * local_size;
+
+                if (event()) {
+                    std::vector<cl::Event> wait{event};
+                    queue.enqueueBarrierWithWaitList(&wait);
+                }
+
+                if (tile > 1) {
+                    enqueue_tiling(session, program, "tile_symbols", buf_input, buf_symbols, n,
+                                   stride_size, tile, first, last);
+                }
+
+                kernel.setArg(0, tile > 1 ? buf_symbols : buf_input);
+                kernel.setArg(1, n);
+                kernel.setArg(2, buf_etable);
+                kernel.setArg(3, buf_output);
+                kernel.setArg(4, buf_output_ns);
+                kernel.setArg(5, buf_input_residues);
+                kernel.setArg(6, output_size);
+                kernel.setArg(7, true_size);
+                kernel.setArg(8, stride_size);
+                kernel.setArg(9, tile);
+
+                queue.enqueueNDRangeKernel(kernel, cl::NDRange(first), cl::NDRange(global_size),
+                                           cl::NDRange(local_size));
+
+                // Pack the strides' words behind each other, so only the coded words cross the bus.
+                enqueue_scan(session, program, buf_output_ns, buf_offsets, first, last - first,
+                             first * u32_size);
+                enqueue_packing(session, program, "compact", buf_output, buf_output_ns, buf_offsets,
+                                buf_packed, first, last, stride_size, tile);
+
+                queue.enqueueReadBuffer(buf_output_ns, CL_FALSE, first * sizeof(uint64_t),
+                                        (last - first) * sizeof(uint64_t), output_ns.pointer() + first);
+                queue.enqueueReadBuffer(buf_input_residues, CL_FALSE, first * sizeof(uint64_t),
+                                        (last - first) * sizeof(uint64_t), input_residues.pointer() + first, nullptr,
+                                        &counted[c]);
+                queue.flush();
+
+                if (c >= 1) {
+                    download(c - 1);
+                }
+            }
+    );
+
+    if (n_chunks != 0) {
+        download(n_chunks - 1);
+    }
+
+    // The caller may release the symbols and the codec its tables once encoding returns.
+    transfer_queue.finish();
+    queue.finish();
+    guard.unlock();
+
+    auto result = encoder_output{
+            .cl_outputs = output,
+            .output_ns = output_ns,
+            .output_offsets = output_offsets,
+            .input_residues = input_residues,
+            .stride_size = stride_size,
+            .input_size = n,
+            .states = _states,
+            .engine = _engine
+    };
+
+    encode_residues(input, result);
+    return result;
+}
+
+void InterlacedRansCodec::enqueue_scan(
+        opencl::Session &session,
+        const std::string &program,
+        const cl::Buffer &buf_output_ns,
+        const cl::Buffer &buf_offsets,
+        uint64_t first,
+        uint64_t count,
+        uint64_t base
+) {
+    auto kernel = session.kernel(program, "scan");
+    uint64_t local_size = std::min(
+            kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(session.device()),
+            (size_t) INTERLACED_ANS_SCAN_SIZE
+    );
+
+    kernel.setArg(0, buf_output_ns);
+    kernel.setArg(1, buf_offsets);
+    kernel.setArg(2, first);
+    kernel.setArg(3, count);
+    kernel.setArg(4, base);
+
+    session.queue().enqueueNDRangeKernel(kernel, cl::NDRange(0), cl::NDRange(local_size), cl::NDRange(local_size));
+}
+
+uint64_t InterlacedRansCodec::tile_size(const cl::Device &device, uint64_t local_size) {
+    if (!(device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_GPU)) {
+        return 1;
+    }
+
+    return std::min(local_size, (uint64_t) INTERLACED_ANS_MAX_TILE);
+}
+
+uint64_t InterlacedRansCodec::chunk_strides(
+        uint64_t true_size,
+        uint64_t stride_size,
+        uint64_t local_size,
+        uint64_t tile
+) {
+    if (!opencl::SessionProvider::chunked()) {
+        return std::max(true_size, (uint64_t) 1);
+    }
+
+    uint64_t strides = std::max(INTERLACED_ANS_OPENCL_CHUNK_SIZE / stride_size, (uint64_t) 1);
+    uint64_t multiple = std::lcm(local_size, tile);
+
+    return (strides / multiple + (strides % multiple != 0)) * multiple;
+}
+
+void InterlacedRansCodec::enqueue_tiling(
+        opencl::Session &session,
+        const std::string &program,
+        const std::string &name,
+        const cl::Buffer &src,
+        const cl::Buffer &dst,
+        uint64_t n,
+        uint64_t stride_size,
+        uint64_t tile,
+        uint64_t first,
+        uint64_t last
+) {
+    auto kernel = session.kernel(program, name);
+
+    // One work group per block of 'tile' strides by 'tile' symbols.
+    uint64_t first_tile = first / tile;
+    uint64_t n_tiles = last / tile + (last % tile != 0) - first_tile;
+    uint64_t blocks = stride_size / tile + (stride_size % tile != 0);
+
+    kernel.setArg(0, src);
+    kernel.setArg(1, dst);
+    kernel.setArg(2, n);
+    kernel.setArg(3, stride_size);
+
+    session.queue().enqueueNDRangeKernel(kernel, cl::NDRange(first_tile * blocks * tile),
+                                         cl::NDRange(n_tiles * blocks * tile), cl::NDRange(tile));
+}
+
+void InterlacedRansCodec::enqueue_packing(
+        opencl::Session &session,
+        const std::string &program,
+        const std::string &name,
+        const cl::Buffer &src,
+        const cl::Buffer &buf_output_ns,
+        const cl::Buffer &buf_offsets,
+        const cl::Buffer &dst,
+        uint64_t first,
+        uint64_t last,
+        uint64_t stride_size,
+        uint64_t tile
+) {
+    auto kernel = session.kernel(program, name);
+    uint64_t local_size = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(session.device());
+
+    kernel.setArg(0, src);
+    kernel.setArg(1, buf_output_ns);
+    kernel.setArg(2, buf_offsets);
+    kernel.setArg(3, dst);
+    kernel.setArg(4, stride_size);
+    kernel.setArg(5, tile);
+
+    // One work group per stride.
+    session.queue().enqueueNDRangeKernel(kernel, cl::NDRange(first * local_size),
+                                         cl::NDRange((last - first) * local_size), cl::NDRange(local_size));
+}
+
+rainman::ptr<uint8_t> InterlacedRansCodec::opencl_decode(const encoder_output &output) {
+    return opencl_decode(output, opencl::DeviceProvider::get());
+}
+
+rainman::ptr<uint8_t> InterlacedRansCodec::opencl_decode(const encoder_output &output, const cl::Device &device) {
+    auto input = rainman::ptr<uint8_t>(output.input_size);
+    opencl_decode(output, input.pointer(), device);
+
+    return input;
+}
+
+void InterlacedRansCodec::opencl_decode(const encoder_output &output, uint8_t *input, const cl::Device &device) {
+    uint64_t n = output.input_size;
+    uint64_t stride_size = output.stride_size;
+    uint64_t true_size = (n / stride_size) + (n % stride_size != 0);
+
+    // Only the coded words are uploaded, packed behind each other. They are moved into the device layout
+    // through offsets computed on the device.
+    std::vector<uint64_t> offsets(true_size + 1);
+    for (uint64_t i = 0; i < true_size; i++) {
+        offsets[i + 1] = offsets[i] + output.output_ns[i];
+    }
+
+    check_engine(output);
+
+    if (offsets[true_size] == 0) {
+        // Every stride is stored.
+        decode_residues(input, output);
+        return;
+    }
+
+    register_kernel();
+
+    auto session = opencl::SessionProvider::get(device);
+    std::unique_lock<std::mutex> lk(session->mutex());
+    auto guard = opencl::ResidencyGuard(*session, lk, decode_uploads);
+
+    auto &tables = session->variant(program_name(output.states, output.engine) + ".decode");
+    if (tables.empty()) {
+        run_decode_probe(*session, output.states, output.engine, _verbose);
+    }
+
+    run_decode(*session, output, input, offsets, tables == "global");
+
+    // The encoder output and the tables may be released once decoding returns.
+    guard.unlock();
+
+    decode_residues(input, output);
+}
+
+void InterlacedRansCodec::run_decode(
+        opencl::Session &session,
+        const encoder_output &output,
+        uint8_t *input,
+        const std::vector<uint64_t> &offsets,
+        bool global_tables
+) {
+    uint64_t n = output.input_size;
+    uint64_t stride_size = output.stride_size;
+    uint64_t true_size = (n / stride_size) + (n % stride_size != 0);
+    uint64_t u32_size = stride_size >> 2;
+    uint64_t words = offsets[true_size];
+
+    auto program = program_name(output.states, output.engine);
+    auto kernel = session.kernel(program_name(output.states, output.engine, global_tables), "decode");
+    auto &device = session.device();
+    auto &queue = session.queue();
+    auto &transfer_queue = session.transfer_queue();
+
+    if (_verbose) {
+        std::cout << "[OPENCL]\t\tRunning '" << program << ".decode' kernels on device: "
+                  << device.getInfo<CL_DEVICE_NAME>() << std::endl;
+    }
+
+    uint64_t local_size = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+    uint64_t tile = tile_size(device, local_size);
+    uint64_t tiled_size = (true_size / tile + (true_size % tile != 0)) * tile;
+
+    uint64_t chunk = chunk_strides(true_size, stride_size, local_size, tile);
+    uint64_t n_chunks = true_size / chunk + (true_size % chunk != 0);
+
+    // Symbols are decoded straight into 'input', in place on unified-memory devices, unless they need untiling.
+    auto buf_input = session.output_buffer(INTERLACED_ANS_OPENCL_BLOB_BUFFER, input, n * sizeof(uint8_t));
+    auto buf_ftable = session.upload("interlaced_rans.ftable", _ftable);
+    auto buf_ctable = session.upload("interlaced_rans.ctable", _ctable);
+    auto buf_dtable = session.upload("interlaced_rans.dtable", _dtable);
+    auto buf_output_ns = session.upload("interlaced_rans.output_ns", output.output_ns);
+    auto buf_input_residues = session.upload("interlaced_rans.input_residues", output.input_residues);
+
+    auto buf_offsets = session.buffer("interlaced_rans.offsets", true_size * sizeof(uint64_t));
+    auto buf_packed = session.buffer("interlaced_rans.packed", words * sizeof(uint32_t));
+    auto buf_output = session.buffer("interlaced_rans.output", tiled_size * u32_size * sizeof(uint32_t));
+    auto buf_symbols = session.buffer("interlaced_rans.symbols", tile > 1 ? tiled_size * stride_size : 1);
+
+    session.invalidate("interlaced_rans.offsets");
+    session.invalidate("interlaced_rans.packed");
+    session.invalidate("interlaced_rans.output");
+    session.invalidate("interlaced_rans.symbols");
+
+    enqueue_scan(session, program, buf_output_ns, buf_offsets, 0, true_size, 0);
+
+    // Every chunk's words are uploaded while the previous chunk is decoded. Words that are packed already, as read
+    // from a file, go up as they are; host-coded strides sit in fixed-size slots and are gathered into two pinned
+    // buffers first.
+    std::vector<bool> packed(n_chunks, true);
+    bool gather = false;
+
+    for (uint64_t i = 1; i < true_size; i++) {
+        if (i % chunk != 0 && output.output_offsets[i] != output.output_offsets[i - 1] + output.output_ns[i - 1]) {
+            packed[i / chunk] = false;
+            gather = true;
+        }
+    }
+
+    uint64_t words_slot_size = chunk * u32_size;
+    uint64_t symbols_slot_size = chunk * stride_size;
+
+    // When chunked, every chunk's symbols are read back through two more pinned buffers while the next one is
+    // decoded. Otherwise they are decoded in place or read back at once.
+    bool staged = !session.unified_memory() && opencl::SessionProvider::chunked();
+
+    auto *words_slots = static_cast<uint32_t *>(session.pinned("interlaced_rans.packed.staging",
+                                                                gather ? 2 * words_slot_size * sizeof(uint32_t) : 1));
+    auto *symbols_slots = static_cast<uint8_t *>(session.pinned("interlaced_rans.symbols.staging",
+                                                                 staged ? 2 * symbols_slot_size : 1));
+
+    std::vector<cl::Event> writes(n_chunks), decoded(n_chunks), reads(n_chunks);
+
+    auto stage = [&](uint64_t c) {
+        uint64_t first = c * chunk;
+        uint64_t last = std::min(first + chunk, true_size);
+        uint64_t global_size = ((last - first) / local_size + ((last - first) % local_size != 0)) * local_size;
+        uint64_t chunk_words = offsets[last] - offsets[first];
+        const uint32_t *source = output.cl_outputs.pointer() + output.output_offsets[first];
+
+        if (!packed[c]) {
+            // The slot is free again once the chunk before the previous one has been transferred.
+            if (c >= 2 && writes[c - 2]()) {
+                writes[c - 2].wait();
+            }
+
+            uint32_t *slot = words_slots + (c & 1) * words_slot_size;
+            for (uint64_t i = first; i < last; i++) {
+                std::memcpy(slot + offsets[i] - offsets[first], output.cl_outputs.pointer() + output.output_offsets[i],
+                            output.output_ns[i] * sizeof(uint32_t));
+            }
+
+            source = slot;
+        }
+
+        if (chunk_words != 0) {
+            transfer_queue.enqueueWriteBuffer(buf_packed, CL_FALSE, offsets[first] * sizeof(uint32_t),
+                                              chunk_words * sizeof(uint32_t), source, nullptr, &writes[c]);
+            transfer_queue.flush();
+
+            std::vector<cl::Event> wait{writes[c]};
+            queue.enqueueBarrierWithWaitList(&wait);
+        }
+
+        enqueue_packing(session, program, "expand", buf_packed, buf_output_ns, buf_offsets,
+                        buf_output, first, last, stride_size, tile);
+
+        kernel.setArg(0, tile > 1 ? buf_symbols : buf_input);
+        kernel.setArg(1, n);
+        kernel.setArg(2, buf_ftable);
+        kernel.setArg(3, buf_ctable);
+        kernel.setArg(4, buf_output);
+        kernel.setArg(5, buf_output_ns);
+        kernel.setArg(6, buf_input_residues);
+        kernel.setArg(7, words);
+        kernel.setArg(8, true_size);
+        kernel.setArg(9, stride_size);
+        kernel.setArg(10, buf_dtable);
+        kernel.setArg(11, tile);
+
+        queue.enqueueNDRangeKernel(kernel, cl::NDRange(first), cl::NDRange(global_size),
+                                   cl::NDRange(local_size));
+
+        if (tile > 1) {
+            enqueue_tiling(session, program, "untile_symbols", buf_symbols, buf_input, n,
+                           stride_size, tile, first, last);
+        }
+
+        queue.enqueueMarkerWithWaitList(nullptr, &decoded[c]);
+        queue.flush();
+    };
+
+    auto collect = [&](uint64_t c) {
+        uint64_t first = c * symbols_slot_size;
+
+        reads[c].wait();
+        std::memcpy(input + first, symbols_slots + (c & 1) * symbols_slot_size,
+                    std::min(first + symbols_slot_size, n) - first);
+    };
+
+    // The transfer queue runs in order, so every chunk's upload is enqueued before the previous chunk's download.
+    stage(0);
+    for (uint64_t c = 0; c < n_chunks; c++) {
+        if (c + 1 < n_chunks) {
+            stage(c + 1);
+        }
+
+        if (!staged) {
+            continue;
+        }
+
+        if (c >= 2) {
+            collect(c - 2);
+        }
+
+        uint64_t first = c * symbols_slot_size;
+        std::vector<cl::Event> wait{decoded[c]};
+
+        transfer_queue.enqueueReadBuffer(buf_input, CL_FALSE, first, std::min(first + symbols_slot_size, n) - first,
+                                         symbols_slots + (c & 1) * symbols_slot_size, &wait, &reads[c]);
+        transfer_queue.flush();
+    }
+
+    if (!staged) {
+        session.download(buf_input, input, n * sizeof(uint8_t));
+    } else {
+        for (uint64_t c = n_chunks >= 2 ? n_chunks - 2 : 0; c < n_chunks; c++) {
+            collect(c);
+        }
+    }
+
+    queue.finish();
+}
+
+decode_tables_probe InterlacedRansCodec::run_decode_probe(
+        opencl::Session &session,
+        uint64_t states,
+        Engine engine,
+        bool verbose
+) {
+    auto symbols = probe_symbols();
+    auto histogram = FrequencyDistribution().cpu_freq_dist(symbols.pointer(), symbols.size());
+
+    auto codec = InterlacedRansCodec(normalized(histogram, engine), false, states, engine);
+    codec.create_ctable();
+
+    auto output = codec.cpu_encode(symbols, INTERLACED_ANS_DECODE_PROBE_STRIDE);
+    uint64_t true_size = output.output_ns.size();
+
+    std::vector<uint64_t> offsets(true_size + 1);
+    for (uint64_t i = 0; i < true_size; i++) {
+        offsets[i + 1] = offsets[i] + output.output_ns[i];
+    }
+
+    auto decoded = rainman::ptr<uint8_t>(symbols.size());
+
+    // Best of two runs each, after a first run that builds the programs and allocates the buffers. Both variants
+    // move the same words, so the difference between them is the decode kernel.
+    auto time = [&](bool global_tables) {
+        double best = std::numeric_limits<double>::max();
+
+        for (int i = 0; i < 3; i++) {
+            auto start = std::chrono::steady_clock::now();
+            codec.run_decode(session, output, decoded.pointer(), offsets, global_tables);
+
+            if (i != 0) {
+                best = std::min(best, std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start).count());
+            }
+        }
+
+        return best;
+    };
+
+    decode_tables_probe probe;
+    probe.local_ms = time(false);
+    probe.global_ms = time(true);
+
+    // The probe's symbols and tables are released on return.
+    for (const auto &name: decode_uploads) {
+        session.invalidate(name);
+    }
+
+    auto &tables = session.variant(program_name(states, engine) + ".decode");
+    tables = probe.global_ms < probe.local_ms ? "global" : "local";
+
+    if (verbose) {
+        std::cout << "[OPENCL]\t\tDecode tables in local memory: " << probe.local_ms
+                  << "ms, in global memory: " << probe.global_ms << "ms. Using " << tables
+                  << " tables on device: " << session.device().getInfo<CL_DEVICE_NAME>() << std::endl;
+    }
+
+    return probe;
+}
+
+decode_tables_probe InterlacedRansCodec::probe_decode_tables(
+        const cl::Device &device,
+        uint64_t states,
+        Engine engine,
+        bool verbose
+) {
+    register_kernel();
+
+    auto session = opencl::SessionProvider::get(device);
+    std::lock_guard<std::mutex> lk(session->mutex());
+
+    return run_decode_probe(*session, states, engine, verbose);
+}
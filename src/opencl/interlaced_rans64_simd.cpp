@@ -0,0 +1,372 @@
+#include "interlaced_rans64.h"
+#include <utils/simd.h>
+#include <array>
+#include <algorithm>
+
+#ifdef INTERLACED_ANS_SIMD_X86
+#include <immintrin.h>
+#endif
+
+using namespace interlaced_ans;
+
+/*
+ * Host decoders that run several strides in lockstep, one rANS state per 64-bit lane. Lane l of a batch
+ * holds state l % K of stride l / K, where K is the number of interleaved states. Lanes of the same
+ * stride share its words, so a lane that renormalizes reads past the words taken by the lanes of its
+ * stride that come before it. Symbols that do not fill a whole group of K are decoded on the scalar
+ * path once the vectors are done.
+ */
+
+namespace {
+    const uint64_t lower_bound = 1ull << 31;
+    const uint64_t slot_mask = (1ull << RANS64_SCALE) - 1;
+
+    // rank[mask][l] counts the lanes of l's stride below l that are set in 'mask', and total[mask][l] counts
+    // all of them, i.e. how many words the stride consumes in a step.
+    struct refill_table {
+        uint8_t rank[256][8];
+        uint8_t total[256][8];
+    };
+
+    const refill_table &refill_tables(uint64_t states) {
+        static const auto tables = []() {
+            std::array<refill_table, 4> t{};
+
+            for (uint64_t k = 0; k < t.size(); k++) {
+                uint64_t width = 1ull << k;
+
+                for (uint64_t mask = 0; mask < 256; mask++) {
+                    for (uint64_t lane = 0; lane < 8; lane++) {
+                        uint64_t stride_lanes = ((1ull << width) - 1) << (lane / width * width);
+                        uint64_t below = stride_lanes & ((1ull << lane) - 1);
+
+                        t[k].rank[mask][lane] = __builtin_popcountll(mask & below);
+                        t[k].total[mask][lane] = __builtin_popcountll(mask & stride_lanes);
+                    }
+                }
+            }
+
+            return t;
+        }();
+
+        return tables[__builtin_ctzll(states)];
+    }
+
+    // Scalar view of the lanes of a batch.
+    template<uint64_t N>
+    struct batch_lanes {
+        uint64_t state[N];
+
+        // One past the next word of the lane's stride, as an index into cl_outputs.
+        uint64_t counter[N];
+
+        // Whole groups of K symbols left to decode.
+        uint64_t groups[N];
+
+        // Where the lane's first symbol goes.
+        uint8_t *dst[N];
+    };
+
+    // Cumulative frequencies with a sentinel, so that stepping past symbol 255 never succeeds.
+    struct cum_table {
+        alignas(64) uint64_t cum[257];
+
+        explicit cum_table(const uint64_t *ctable) {
+            std::copy(ctable, ctable + 256, cum);
+            cum[256] = 1ull << RANS64_SCALE;
+        }
+    };
+
+    template<uint64_t N>
+    void load_lanes(
+            const encoder_output &output,
+            uint8_t *input,
+            uint64_t first_stride,
+            uint64_t count,
+            uint64_t window_start,
+            batch_lanes<N> &lanes
+    ) {
+        uint64_t states = output.states;
+        uint64_t stride_size = output.stride_size;
+        const uint32_t *words = output.cl_outputs.pointer();
+
+        lanes = batch_lanes<N>{};
+
+        for (uint64_t i = 0; i < count; i++) {
+            uint64_t tid = first_stride + i;
+            uint64_t input_start_index = tid * stride_size;
+            uint64_t input_size = std::min(input_start_index + stride_size, output.input_size) - input_start_index;
+            uint64_t input_residue = output.input_residues[tid];
+            uint64_t counter = output.output_offsets[tid] + output.output_ns[tid];
+
+            // Stored strides keep their lanes idle.
+            if (output.output_ns[tid] == 0) {
+                continue;
+            }
+
+            for (uint64_t j = states; j-- > 0;) {
+                uint64_t x = words[--counter];
+                lanes.state[i * states + j] = (x << 32) | words[--counter];
+            }
+
+            for (uint64_t j = 0; j < states; j++) {
+                uint64_t lane = i * states + j;
+
+                lanes.counter[lane] = counter;
+                lanes.groups[lane] = (input_size - input_residue) / states;
+                lanes.dst[lane] = input + (input_start_index - window_start) + input_residue + j;
+            }
+        }
+    }
+
+    // Decodes the symbols after the last whole group of every stride.
+    template<uint64_t N>
+    void finish_lanes(
+            const encoder_output &output,
+            const cum_table &table,
+            const uint8_t *dtable,
+            uint64_t first_stride,
+            uint64_t count,
+            batch_lanes<N> &lanes
+    ) {
+        uint64_t states = output.states;
+        uint64_t stride_size = output.stride_size;
+        const uint32_t *words = output.cl_outputs.pointer();
+
+        for (uint64_t i = 0; i < count; i++) {
+            uint64_t tid = first_stride + i;
+            uint64_t input_start_index = tid * stride_size;
+            uint64_t input_size = std::min(input_start_index + stride_size, output.input_size) - input_start_index;
+            uint64_t tail = (input_size - output.input_residues[tid]) % states;
+            uint64_t counter = lanes.counter[i * states];
+
+            for (uint64_t j = 0; j < tail; j++) {
+                uint64_t lane = i * states + j;
+                uint64_t &x = lanes.state[lane];
+                uint64_t slot = x & slot_mask;
+
+                uint64_t symbol = dtable[slot >> RANS64_LOOKUP_SHIFT];
+                while (table.cum[symbol + 1] <= slot) {
+                    symbol++;
+                }
+
+                x = (table.cum[symbol + 1] - table.cum[symbol]) * (x >> RANS64_SCALE) + slot - table.cum[symbol];
+                if (x < lower_bound) {
+                    x = (x << 32) | words[--counter];
+                }
+
+                lanes.dst[lane][lanes.groups[lane] * states] = symbol;
+            }
+        }
+    }
+
+    template<uint64_t N>
+    uint64_t max_groups(const batch_lanes<N> &lanes) {
+        return *std::max_element(lanes.groups, lanes.groups + N);
+    }
+
+    template<uint64_t N>
+    void store_symbols(const batch_lanes<N> &lanes, const uint64_t *symbols, uint64_t active, uint64_t offset) {
+        for (; active != 0; active &= active - 1) {
+            uint64_t lane = __builtin_ctzll(active);
+            lanes.dst[lane][offset] = symbols[lane];
+        }
+    }
+}
+
+#ifdef INTERLACED_ANS_SIMD_X86
+
+__attribute__((target("avx2")))
+void InterlacedRansCodec::decode_strides_avx2(
+        const encoder_output &output,
+        uint8_t *input,
+        uint64_t first_stride,
+        uint64_t count,
+        uint64_t window_start
+) {
+    constexpr uint64_t V = RANS64_SIMD_VECTORS;
+    constexpr uint64_t W = 4;
+
+    uint64_t states = output.states;
+    batch_lanes<V * W> lanes;
+    load_lanes(output, input, first_stride, count, window_start, lanes);
+
+    auto table = cum_table(_ctable.pointer());
+    const auto &refill = refill_tables(states);
+    const auto *btable = (const long long *) _btable.pointer();
+    const auto *cum = (const long long *) table.cum;
+    const auto *words = (const int *) output.cl_outputs.pointer();
+
+    const __m256i one = _mm256_set1_epi64x(1);
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    const __m256i mask = _mm256_set1_epi64x((long long) slot_mask);
+    const __m256i bound = _mm256_set1_epi64x((long long) lower_bound);
+    const __m256i byte_mask = _mm256_set1_epi64x(0xff);
+    const __m256i start_mask = _mm256_set1_epi64x(0xffffff);
+    const __m256i even_words = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+
+    __m256i x[V], counter[V], groups[V];
+    for (uint64_t v = 0; v < V; v++) {
+        x[v] = _mm256_loadu_si256((const __m256i *) (lanes.state + v * W));
+        counter[v] = _mm256_loadu_si256((const __m256i *) (lanes.counter + v * W));
+        groups[v] = _mm256_loadu_si256((const __m256i *) (lanes.groups + v * W));
+    }
+
+    alignas(32) uint64_t symbols[V * W];
+    uint64_t n_groups = max_groups(lanes);
+
+    // States stay below 2^63, so signed comparisons are safe throughout.
+    for (uint64_t t = 0; t < n_groups; t++) {
+        uint64_t active_lanes = 0;
+        const __m256i step = _mm256_set1_epi64x((long long) t);
+
+        for (uint64_t v = 0; v < V; v++) {
+            __m256i active = _mm256_cmpgt_epi64(groups[v], step);
+            __m256i slot = _mm256_and_si256(x[v], mask);
+
+            __m256i bucket = _mm256_i64gather_epi64(btable, _mm256_srli_epi64(slot, RANS64_LOOKUP_SHIFT), 8);
+            __m256i symbol = _mm256_and_si256(bucket, byte_mask);
+            __m256i start = _mm256_and_si256(_mm256_srli_epi64(bucket, 8), start_mask);
+            __m256i next = _mm256_srli_epi64(bucket, 32);
+
+            for (__m256i le = _mm256_xor_si256(_mm256_cmpgt_epi64(next, slot), ones);
+                 !_mm256_testz_si256(le, le);
+                 le = _mm256_xor_si256(_mm256_cmpgt_epi64(next, slot), ones)) {
+                symbol = _mm256_sub_epi64(symbol, le);
+                start = _mm256_blendv_epi8(start, next, le);
+                next = _mm256_mask_i64gather_epi64(next, cum, _mm256_add_epi64(symbol, one), le, 8);
+            }
+
+            __m256i freq = _mm256_sub_epi64(next, start);
+            __m256i high = _mm256_srli_epi64(x[v], RANS64_SCALE);
+
+            // freq fits in 32 bits but the high part of the state does not, so the product takes two multiplies.
+            __m256i product = _mm256_add_epi64(
+                    _mm256_mul_epu32(freq, high),
+                    _mm256_slli_epi64(_mm256_mul_epu32(freq, _mm256_srli_epi64(high, 32)), 32)
+            );
+
+            __m256i decoded = _mm256_add_epi64(product, _mm256_sub_epi64(slot, start));
+            x[v] = _mm256_blendv_epi8(x[v], decoded, active);
+
+            __m256i renorm = _mm256_and_si256(active, _mm256_cmpgt_epi64(bound, x[v]));
+            uint64_t renorm_lanes = _mm256_movemask_pd(_mm256_castsi256_pd(renorm));
+
+            __m256i rank = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(*(const int *) refill.rank[renorm_lanes]));
+            __m256i used = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(*(const int *) refill.total[renorm_lanes]));
+            __m256i index = _mm256_sub_epi64(_mm256_sub_epi64(counter[v], one), rank);
+            __m128i word_mask = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(renorm, even_words));
+
+            __m128i word = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), words, index, word_mask, 4);
+            __m256i refilled = _mm256_or_si256(_mm256_slli_epi64(x[v], 32), _mm256_cvtepu32_epi64(word));
+
+            x[v] = _mm256_blendv_epi8(x[v], refilled, renorm);
+            counter[v] = _mm256_sub_epi64(counter[v], used);
+
+            _mm256_store_si256((__m256i *) (symbols + v * W), symbol);
+            active_lanes |= (uint64_t) _mm256_movemask_pd(_mm256_castsi256_pd(active)) << (v * W);
+        }
+
+        store_symbols(lanes, symbols, active_lanes, t * states);
+    }
+
+    for (uint64_t v = 0; v < V; v++) {
+        _mm256_storeu_si256((__m256i *) (lanes.state + v * W), x[v]);
+        _mm256_storeu_si256((__m256i *) (lanes.counter + v * W), counter[v]);
+    }
+
+    finish_lanes(output, table, _dtable.pointer(), first_stride, count, lanes);
+}
+
+__attribute__((target("avx512f,avx512dq,avx512bw,avx512vl")))
+void InterlacedRansCodec::decode_strides_avx512(
+        const encoder_output &output,
+        uint8_t *input,
+        uint64_t first_stride,
+        uint64_t count,
+        uint64_t window_start
+) {
+    constexpr uint64_t V = RANS64_SIMD_VECTORS;
+    constexpr uint64_t W = 8;
+
+    uint64_t states = output.states;
+    batch_lanes<V * W> lanes;
+    load_lanes(output, input, first_stride, count, window_start, lanes);
+
+    auto table = cum_table(_ctable.pointer());
+    const auto &refill = refill_tables(states);
+    const auto *btable = (const long long *) _btable.pointer();
+    const auto *cum = (const long long *) table.cum;
+    const auto *words = (const int *) output.cl_outputs.pointer();
+
+    const __m512i one = _mm512_set1_epi64(1);
+    const __m512i mask = _mm512_set1_epi64((long long) slot_mask);
+    const __m512i bound = _mm512_set1_epi64((long long) lower_bound);
+    const __m512i byte_mask = _mm512_set1_epi64(0xff);
+    const __m512i start_mask = _mm512_set1_epi64(0xffffff);
+
+    __m512i x[V], counter[V], groups[V];
+    for (uint64_t v = 0; v < V; v++) {
+        x[v] = _mm512_loadu_si512(lanes.state + v * W);
+        counter[v] = _mm512_loadu_si512(lanes.counter + v * W);
+        groups[v] = _mm512_loadu_si512(lanes.groups + v * W);
+    }
+
+    alignas(64) uint64_t symbols[V * W];
+    uint64_t n_groups = max_groups(lanes);
+
+    for (uint64_t t = 0; t < n_groups; t++) {
+        uint64_t active_lanes = 0;
+        const __m512i step = _mm512_set1_epi64((long long) t);
+
+        for (uint64_t v = 0; v < V; v++) {
+            __mmask8 active = _mm512_cmpgt_epu64_mask(groups[v], step);
+            __m512i slot = _mm512_and_si512(x[v], mask);
+
+            __m512i bucket = _mm512_i64gather_epi64(_mm512_srli_epi64(slot, RANS64_LOOKUP_SHIFT), btable, 8);
+            __m512i symbol = _mm512_and_si512(bucket, byte_mask);
+            __m512i start = _mm512_and_si512(_mm512_srli_epi64(bucket, 8), start_mask);
+            __m512i next = _mm512_srli_epi64(bucket, 32);
+
+            for (__mmask8 le = _mm512_cmple_epu64_mask(next, slot); le != 0; le = _mm512_cmple_epu64_mask(next, slot)) {
+                symbol = _mm512_mask_add_epi64(symbol, le, symbol, one);
+                start = _mm512_mask_mov_epi64(start, le, next);
+                next = _mm512_mask_i64gather_epi64(next, le, _mm512_add_epi64(symbol, one), cum, 8);
+            }
+
+            __m512i freq = _mm512_sub_epi64(next, start);
+            __m512i high = _mm512_srli_epi64(x[v], RANS64_SCALE);
+
+            // Two 32-bit multiplies have a much shorter latency than vpmullq.
+            __m512i product = _mm512_add_epi64(
+                    _mm512_mul_epu32(freq, high),
+                    _mm512_slli_epi64(_mm512_mul_epu32(freq, _mm512_srli_epi64(high, 32)), 32)
+            );
+
+            x[v] = _mm512_mask_add_epi64(x[v], active, product, _mm512_sub_epi64(slot, start));
+
+            __mmask8 renorm = active & _mm512_cmplt_epu64_mask(x[v], bound);
+            __m512i rank = _mm512_cvtepu8_epi64(_mm_loadl_epi64((const __m128i *) refill.rank[renorm]));
+            __m512i used = _mm512_cvtepu8_epi64(_mm_loadl_epi64((const __m128i *) refill.total[renorm]));
+            __m512i index = _mm512_sub_epi64(_mm512_sub_epi64(counter[v], one), rank);
+
+            __m256i word = _mm512_mask_i64gather_epi32(_mm256_setzero_si256(), renorm, index, words, 4);
+            x[v] = _mm512_mask_or_epi64(x[v], renorm, _mm512_slli_epi64(x[v], 32), _mm512_cvtepu32_epi64(word));
+            counter[v] = _mm512_sub_epi64(counter[v], used);
+
+            _mm512_store_si512(symbols + v * W, symbol);
+            active_lanes |= (uint64_t) active << (v * W);
+        }
+
+        store_symbols(lanes, symbols, active_lanes, t * states);
+    }
+
+    for (uint64_t v = 0; v < V; v++) {
+        _mm512_storeu_si512(lanes.state + v * W, x[v]);
+        _mm512_storeu_si512(lanes.counter + v * W, counter[v]);
+    }
+
+    finish_lanes(output, table, _dtable.pointer(), first_stride, count, lanes);
+}
+
+#endif
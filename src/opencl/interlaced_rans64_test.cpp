@@ -0,0 +1,157 @@
+/*
+ * Round-trips data through the host codec for every engine and number of states and checks the whole-blob and
+ * range decoders at every SIMD level.
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <opencl/interlaced_rans64.h>
+#include <opencl/freq_dist.h>
+#include <utils/simd.h>
+
+using namespace interlaced_ans;
+
+namespace {
+    struct dataset {
+        std::string name;
+        std::vector<uint8_t> data;
+    };
+
+    int failures = 0;
+
+    void check(bool condition, const std::string &what) {
+        if (!condition) {
+            std::cerr << "FAIL: " << what << std::endl;
+            failures++;
+        }
+    }
+
+    // Deterministic bytes, either uniform or drawn from a few symbols like text.
+    std::vector<uint8_t> generate(uint64_t n, bool skewed, uint64_t seed) {
+        const std::string alphabet = "eeeeeeeetttttaaaooiinnsshhrdlu  \n";
+        std::vector<uint8_t> data(n);
+
+        for (auto &x: data) {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            uint8_t r = seed >> 56;
+            x = skewed ? alphabet[r % alphabet.size()] : r;
+        }
+
+        return data;
+    }
+
+    std::vector<dataset> datasets() {
+        auto mixed = generate(20000, true, 1);
+        auto noise = generate(6000, false, 2);
+        mixed.insert(mixed.begin() + 7000, noise.begin(), noise.end());
+
+        return {
+                {"text",   generate(50000, true, 3)},
+                {"random", generate(30000, false, 4)},
+                {"mixed",  mixed},
+                {"single", std::vector<uint8_t>(10001, 'a')},
+                {"tiny",   {'x', 'y', 'x'}},
+        };
+    }
+
+    struct encoded {
+        rainman::ptr<uint64_t> ftable;
+        encoder_output output;
+    };
+
+    // Same steps as MultiBlobCodec::encode_blob() with the native executor.
+    encoded encode(const dataset &d, uint64_t stride_size, uint64_t states, Engine engine) {
+        auto histogram = FrequencyDistribution().cpu_freq_dist(d.data.data(), d.data.size());
+        auto ftable = InterlacedRansCodec::normalized(histogram, engine);
+
+        auto codec = InterlacedRansCodec(ftable, false, states, engine);
+        codec.create_ctable();
+
+        return {ftable, codec.cpu_encode(d.data.data(), d.data.size(), stride_size)};
+    }
+
+    void test_decode(const dataset &d, const encoded &e, const std::string &label) {
+        // Decoders take the states and engine from the output, as MultiBlobCodec::decode_blob() does.
+        auto codec = InterlacedRansCodec(e.ftable, false, 1, e.output.engine);
+        codec.create_ctable();
+
+        for (auto level: {SimdLevel::SCALAR, SimdLevel::AVX2, SimdLevel::AVX512}) {
+            Simd::set(level);
+
+            std::vector<uint8_t> decoded(d.data.size());
+            codec.cpu_decode(e.output, decoded.data());
+            check(decoded == d.data, label + " decodes with " + Simd::name(level));
+        }
+
+        uint64_t n = d.data.size();
+        uint64_t stride_size = e.output.stride_size;
+
+        // Ranges inside one stride, across a stride boundary, spanning many strides and at both ends.
+        const std::vector<std::pair<uint64_t, uint64_t>> ranges = {
+                {0,                                n},
+                {0,                                1},
+                {n - 1,                            n},
+                {n / 3,                            std::min(n / 3 + 5, n)},
+                {std::min(stride_size - 1, n - 1), std::min(stride_size + 1, n)},
+                {n / 5,                            n - n / 7},
+        };
+
+        for (auto [begin, end]: ranges) {
+            std::vector<uint8_t> decoded(end - begin);
+            codec.cpu_decode_range(e.output, begin, end, decoded.data());
+
+            check(std::equal(decoded.begin(), decoded.end(), d.data.begin() + begin),
+                  label + " decodes range [" + std::to_string(begin) + ", " + std::to_string(end) + ")");
+        }
+    }
+
+    void test_stored_strides(const dataset &d, const encoded &e, const std::string &label) {
+        // The final states of 64-byte strides outweigh what coding saves, so those may be stored either way.
+        if (e.output.stride_size < 1024) {
+            return;
+        }
+
+        uint64_t n_strides = e.output.output_ns.size();
+        uint64_t stored = 0;
+
+        for (uint64_t i = 0; i < n_strides; i++) {
+            stored += e.output.output_ns.pointer()[i] == 0;
+        }
+
+        // Uniform bytes never shrink, so every full stride of them is stored, while text strides are coded.
+        if (d.name == "random") {
+            check(stored + 1 >= n_strides, label + " stores its strides");
+        } else if (d.name == "text" || d.name == "single") {
+            check(stored == 0, label + " codes its strides");
+        } else if (d.name == "mixed") {
+            check(stored != 0 && stored != n_strides, label + " stores only its random strides");
+        }
+    }
+}
+
+int main() {
+    const std::vector<Engine> engines = {Engine::RANS64, Engine::RANS32};
+
+    for (const auto &d: datasets()) {
+        for (auto engine: engines) {
+            for (uint64_t states: {1, 2, 4, 8}) {
+                for (uint64_t stride_size: {64, 1024, 4096}) {
+                    auto label = d.name + " (" + std::to_string(states) + " states, stride " +
+                                 std::to_string(stride_size) + (engine == Engine::RANS32 ? ", rans32)" : ")");
+
+                    auto e = encode(d, stride_size, states, engine);
+                    test_decode(d, e, label);
+                    test_stored_strides(d, e, label);
+                }
+            }
+        }
+    }
+
+    if (failures == 0) {
+        std::cout << "All codec tests passed" << std::endl;
+    }
+
+    return failures != 0;
+}
@@ -0,0 +1,153 @@
+#include "scheduler.h"
+#include "cl_helper.h"
+
+// Weight of the most recent blob in a device's throughput estimate.
+#define SCHEDULER_THROUGHPUT_DECAY 0.5
+
+using namespace interlaced_ans::opencl;
+
+std::vector<DeviceScheduler::device_state> DeviceScheduler::_devices;
+std::mutex DeviceScheduler::_mutex;
+std::condition_variable DeviceScheduler::_cv;
+
+void DeviceScheduler::load(const std::vector<cl::Device> &devices) {
+    std::unique_lock<std::mutex> lk(_mutex);
+    _devices.clear();
+
+    for (const auto &device: devices) {
+        _devices.push_back(device_state{.device = device});
+    }
+}
+
+void DeviceScheduler::clear() {
+    std::unique_lock<std::mutex> lk(_mutex);
+    _devices.clear();
+}
+
+uint64_t DeviceScheduler::size() {
+    std::unique_lock<std::mutex> lk(_mutex);
+    if (_devices.empty()) {
+        lk.unlock();
+        load(DeviceProvider::devices());
+        lk.lock();
+    }
+
+    return _devices.size();
+}
+
+double DeviceScheduler::estimate(const device_state &state, uint64_t size) {
+    // Unmeasured devices look free so that every device gets measured once.
+    if (state.throughput <= 0.0) {
+        return 0.0;
+    }
+
+    return (double) size / state.throughput;
+}
+
+uint64_t DeviceScheduler::acquire(uint64_t size) {
+    std::unique_lock<std::mutex> lk(_mutex);
+    if (_devices.empty()) {
+        // DeviceProvider takes its own lock, so query it without holding ours.
+        lk.unlock();
+        auto devices = DeviceProvider::devices();
+        lk.lock();
+
+        if (_devices.empty()) {
+            for (const auto &device: devices) {
+                _devices.push_back(device_state{.device = device});
+            }
+        }
+    }
+
+    uint64_t reserved_index = _devices.size();
+
+    while (true) {
+        auto now = clock::now();
+
+        // Our own reservation must not count against the device we are waiting for.
+        if (reserved_index < _devices.size()) {
+            _devices[reserved_index].reserved -= size;
+        }
+
+        uint64_t best_index = 0;
+        double best_finish = 0.0;
+
+        for (uint64_t i = 0; i < _devices.size(); i++) {
+            const auto &state = _devices[i];
+            double finish = finish_time(state, size, now);
+
+            if (i == 0 || finish < best_finish || (finish == best_finish && !state.busy)) {
+                best_index = i;
+                best_finish = finish;
+            }
+        }
+
+        auto &best = _devices[best_index];
+        if (!best.busy) {
+            best.busy = true;
+            best.busy_until = now + std::chrono::duration_cast<clock::duration>(
+                    std::chrono::duration<double>(estimate(best, size)));
+            return best_index;
+        }
+
+        // The device that would finish first is busy: queue behind it until it (or any other device) frees up.
+        // A busy device that overruns its estimate is re-evaluated periodically.
+        best.reserved += size;
+        reserved_index = best_index;
+
+        _cv.wait_for(lk, std::chrono::milliseconds(100));
+    }
+}
+
+double DeviceScheduler::finish_time(const device_state &state, uint64_t size, clock::time_point now) {
+    double wait = 0.0;
+
+    if (state.busy) {
+        wait = std::max(std::chrono::duration<double>(state.busy_until - now).count(), 0.0);
+    }
+
+    return wait + estimate(state, state.reserved + size);
+}
+
+void DeviceScheduler::release(uint64_t index, uint64_t size, double seconds) {
+    {
+        std::unique_lock<std::mutex> lk(_mutex);
+        if (index >= _devices.size()) {
+            return;
+        }
+
+        auto &state = _devices[index];
+        state.busy = false;
+
+        if (seconds > 0.0) {
+            double throughput = (double) size / seconds;
+            state.throughput = state.throughput <= 0.0 ? throughput :
+                               SCHEDULER_THROUGHPUT_DECAY * throughput +
+                               (1.0 - SCHEDULER_THROUGHPUT_DECAY) * state.throughput;
+        }
+    }
+
+    _cv.notify_all();
+}
+
+cl::Device DeviceScheduler::device(uint64_t index) {
+    std::unique_lock<std::mutex> lk(_mutex);
+    return _devices.at(index).device;
+}
+
+DeviceLease::DeviceLease(uint64_t size) : _size(size) {
+    _index = DeviceScheduler::acquire(size);
+    _start = std::chrono::steady_clock::now();
+}
+
+DeviceLease::~DeviceLease() {
+    DeviceScheduler::release(_index, _size, _seconds);
+}
+
+cl::Device DeviceLease::device() const {
+    return DeviceScheduler::device(_index);
+}
+
+void DeviceLease::complete() {
+    _seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+}
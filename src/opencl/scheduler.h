@@ -0,0 +1,82 @@
+#ifndef INTERLACED_ANS_OPENCL_SCHEDULER_H
+#define INTERLACED_ANS_OPENCL_SCHEDULER_H
+
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <condition_variable>
+#include <CL/opencl.hpp>
+
+namespace interlaced_ans::opencl {
+    /*
+     * Hands out devices to blobs. A device runs one blob at a time; a blob goes to an idle device only
+     * if no busy device is expected to finish it sooner, judged by each device's measured throughput and
+     * the blobs already queued for it. Slow devices therefore keep working while there is a backlog but
+     * never pick up the last blobs a faster device would finish first.
+     */
+    class DeviceScheduler {
+    private:
+        typedef std::chrono::steady_clock clock;
+
+        struct device_state {
+            cl::Device device{};
+            bool busy = false;
+
+            // Bytes per second, 0 until the first blob on this device completes.
+            double throughput = 0.0;
+            clock::time_point busy_until{};
+
+            // Bytes of blobs waiting for this device to become idle.
+            uint64_t reserved = 0;
+        };
+
+        static std::vector<device_state> _devices;
+        static std::mutex _mutex;
+        static std::condition_variable _cv;
+
+        static double estimate(const device_state &state, uint64_t size);
+
+        static double finish_time(const device_state &state, uint64_t size, clock::time_point now);
+
+    public:
+        static void load(const std::vector<cl::Device> &devices);
+
+        // Forgets all devices and measurements. Devices are reloaded from DeviceProvider on next use.
+        static void clear();
+
+        static uint64_t size();
+
+        // Blocks until a device should take a blob of 'size' bytes and returns its index.
+        static uint64_t acquire(uint64_t size);
+
+        // Returns a device, folding the observed time into its throughput if the blob completed.
+        static void release(uint64_t index, uint64_t size, double seconds);
+
+        static cl::Device device(uint64_t index);
+    };
+
+    // Holds a device from DeviceScheduler for the lifetime of the object.
+    class DeviceLease {
+    private:
+        uint64_t _index;
+        uint64_t _size;
+        double _seconds = -1.0;
+        std::chrono::steady_clock::time_point _start;
+
+    public:
+        explicit DeviceLease(uint64_t size);
+
+        DeviceLease(const DeviceLease &) = delete;
+
+        DeviceLease &operator=(const DeviceLease &) = delete;
+
+        ~DeviceLease();
+
+        [[nodiscard]] cl::Device device() const;
+
+        // Marks the blob as done so its timing is used for future scheduling.
+        void complete();
+    };
+}
+
+#endif
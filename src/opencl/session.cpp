@@ -0,0 +1,210 @@
+#include "session.h"
+#include "cl_helper.h"
+#include <cstring>
+#include <utility>
+
+using namespace interlaced_ans::opencl;
+
+std::unordered_map<cl_device_id, std::shared_ptr<Session>> SessionProvider::_sessions;
+std::mutex SessionProvider::_mutex;
+bool SessionProvider::_chunked = false;
+
+Session::Session(const cl::Device &device) : _device(device) {
+    _context = cl::Context(device);
+    _queue = cl::CommandQueue(_context, device);
+    _transfer_queue = cl::CommandQueue(_context, device);
+    _unified_memory = device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
+}
+
+cl::Kernel Session::kernel(const std::string &program, const std::string &name) {
+    auto key = program + "." + name;
+    if (!_kernels.contains(key)) {
+        _kernels[key] = KernelProvider::get(program, name, _device);
+    }
+
+    return _kernels[key];
+}
+
+cl::Buffer Session::buffer(const std::string &name, uint64_t size) {
+    // Zero-sized buffers are invalid in OpenCL.
+    size = std::max(size, uint64_t(1));
+
+    auto it = _buffers.find(name);
+    if (it == _buffers.end() || it->second.second < size) {
+        _resident.erase(name);
+
+        auto buf = cl::Buffer(_context, CL_MEM_READ_WRITE, size);
+        _buffers[name] = {buf, size};
+        return buf;
+    }
+
+    return it->second.first;
+}
+
+cl::Buffer Session::upload(const std::string &name, const void *data, uint64_t size) {
+    if (!_unified_memory || size == 0) {
+        auto buf = buffer(name, size);
+        auto &resident = _resident[name];
+
+        if (resident.host_pointer != data || resident.size != size) {
+            _queue.enqueueWriteBuffer(buf, CL_FALSE, 0, size, data);
+            resident = resident_data{.host_pointer = data, .size = size};
+        }
+
+        return buf;
+    }
+
+    auto &host_buffer = _host_buffers[name];
+    if (host_buffer.host_pointer != data || host_buffer.size != size) {
+        auto buf = cl::Buffer(_context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, size, const_cast<void *>(data));
+        host_buffer = host_buffer_data{.host_pointer = data, .size = size, .buffer = buf};
+    }
+
+    return host_buffer.buffer;
+}
+
+cl::Buffer Session::upload_chunks(
+        const std::string &name,
+        const void *data,
+        uint64_t size,
+        uint64_t chunk_size,
+        const std::function<void(const cl::Buffer &, uint64_t, const cl::Event &)> &chunk_ready
+) {
+    chunk_size = std::max(std::min(chunk_size, size), uint64_t(1));
+    uint64_t n_chunks = size / chunk_size + (size % chunk_size != 0);
+
+    auto it = _resident.find(name);
+    if (_unified_memory || !SessionProvider::chunked() ||
+        (it != _resident.end() && it->second.host_pointer == data && it->second.size == size)) {
+        auto buf = upload(name, data, size);
+        for (uint64_t i = 0; i < n_chunks; i++) {
+            chunk_ready(buf, i, cl::Event());
+        }
+
+        return buf;
+    }
+
+    auto buf = buffer(name, size);
+    auto *slots = static_cast<uint8_t *>(pinned(name + ".staging", 2 * chunk_size));
+    std::vector<cl::Event> events(n_chunks);
+
+    for (uint64_t i = 0; i < n_chunks; i++) {
+        uint64_t offset = i * chunk_size;
+        uint64_t length = std::min(chunk_size, size - offset);
+        uint8_t *slot = slots + (i & 1) * chunk_size;
+
+        // The slot is free again once the chunk before the previous one has been transferred.
+        if (i >= 2) {
+            events[i - 2].wait();
+        }
+
+        std::memcpy(slot, static_cast<const uint8_t *>(data) + offset, length);
+        _transfer_queue.enqueueWriteBuffer(buf, CL_FALSE, offset, length, slot, nullptr, &events[i]);
+        _transfer_queue.flush();
+
+        chunk_ready(buf, i, events[i]);
+    }
+
+    // buffer() drops the entry when it grows the pool, so it is looked up again here.
+    _resident[name] = resident_data{.host_pointer = data, .size = size};
+    return buf;
+}
+
+void *Session::pinned(const std::string &name, uint64_t size) {
+    size = std::max(size, uint64_t(1));
+
+    auto &pinned = _pinned[name];
+    if (pinned.size < size) {
+        if (pinned.pointer) {
+            // Chunked transfers may still read or write the old mapping.
+            _transfer_queue.finish();
+            _queue.enqueueUnmapMemObject(pinned.buffer, pinned.pointer);
+            _queue.finish();
+        }
+
+        pinned.buffer = cl::Buffer(_context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size);
+        pinned.pointer = _queue.enqueueMapBuffer(pinned.buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size);
+        pinned.size = size;
+    }
+
+    return pinned.pointer;
+}
+
+cl::Buffer Session::output_buffer(const std::string &name, void *data, uint64_t size) {
+    _resident.erase(name);
+
+    if (!_unified_memory || size == 0) {
+        return buffer(name, size);
+    }
+
+    auto buf = cl::Buffer(_context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, size, data);
+    _host_buffers[name] = host_buffer_data{.host_pointer = data, .size = size, .buffer = buf};
+
+    return buf;
+}
+
+void Session::download(const cl::Buffer &buf, void *data, uint64_t size) {
+    if (!_unified_memory || size == 0) {
+        _queue.enqueueReadBuffer(buf, CL_FALSE, 0, size, data);
+        return;
+    }
+
+    // Mapping a CL_MEM_USE_HOST_PTR buffer synchronizes the host memory without copying on unified devices.
+    void *mapped = _queue.enqueueMapBuffer(buf, CL_FALSE, CL_MAP_READ, 0, size);
+    _queue.enqueueUnmapMemObject(buf, mapped);
+}
+
+void Session::invalidate(const std::string &name) {
+    _resident.erase(name);
+    _host_buffers.erase(name);
+}
+
+ResidencyGuard::ResidencyGuard(Session &session, std::unique_lock<std::mutex> &lock, std::vector<std::string> names)
+        : _session(session), _lock(lock), _names(std::move(names)) {}
+
+void ResidencyGuard::invalidate() {
+    for (const auto &name: _names) {
+        _session.invalidate(name);
+    }
+
+    _names.clear();
+}
+
+void ResidencyGuard::unlock() {
+    invalidate();
+    _lock.unlock();
+}
+
+void ResidencyGuard::dismiss() {
+    _names.clear();
+}
+
+ResidencyGuard::~ResidencyGuard() {
+    // Declared after the lock, so on an exception the session is still locked here.
+    if (_lock.owns_lock()) {
+        invalidate();
+    }
+}
+
+std::shared_ptr<Session> SessionProvider::get(const cl::Device &device) {
+    std::unique_lock<std::mutex> lk(_mutex);
+    auto &session = _sessions[device()];
+    if (!session) {
+        session = std::make_shared<Session>(device);
+    }
+
+    return session;
+}
+
+void SessionProvider::clear() {
+    std::unique_lock<std::mutex> lk(_mutex);
+    _sessions.clear();
+}
+
+void SessionProvider::set_chunked(bool chunked) {
+    _chunked = chunked;
+}
+
+bool SessionProvider::chunked() {
+    return _chunked;
+}
@@ -0,0 +1,191 @@
+#ifndef INTERLACED_ANS_OPENCL_SESSION_H
+#define INTERLACED_ANS_OPENCL_SESSION_H
+
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <CL/opencl.hpp>
+#include <rainman/rainman.h>
+
+// Pooled buffer holding the current blob's symbols, shared by freq_dist and the rANS kernels.
+#define INTERLACED_ANS_OPENCL_BLOB_BUFFER "blob"
+
+namespace interlaced_ans::opencl {
+    /*
+     * Long-lived OpenCL state for one device: a single context shared by every program, a command queue
+     * for kernels, a second one for chunked transfers that overlap them, and pools of named device and
+     * pinned host buffers that only grow. Codec calls lock the session for the duration of a blob.
+     */
+    class Session {
+    private:
+        // Host memory a pooled buffer holds a copy of. Its owner invalidates the name before releasing it, so
+        // that another allocation at the same address is not mistaken for it.
+        struct resident_data {
+            const void *host_pointer = nullptr;
+            uint64_t size = 0;
+        };
+
+        struct host_buffer_data {
+            const void *host_pointer = nullptr;
+            uint64_t size = 0;
+            cl::Buffer buffer;
+        };
+
+        struct pinned_data {
+            void *pointer = nullptr;
+            uint64_t size = 0;
+            cl::Buffer buffer;
+        };
+
+        cl::Device _device;
+        cl::Context _context;
+        cl::CommandQueue _queue;
+        cl::CommandQueue _transfer_queue;
+        std::unordered_map<std::string, std::pair<cl::Buffer, uint64_t>> _buffers;
+        std::unordered_map<std::string, resident_data> _resident;
+        std::unordered_map<std::string, host_buffer_data> _host_buffers;
+        std::unordered_map<std::string, pinned_data> _pinned;
+        std::unordered_map<std::string, cl::Kernel> _kernels;
+        std::unordered_map<std::string, std::string> _variants;
+        std::mutex _mutex;
+        bool _unified_memory;
+
+    public:
+        explicit Session(const cl::Device &device);
+
+        [[nodiscard]] const cl::Device &device() const {
+            return _device;
+        }
+
+        [[nodiscard]] const cl::Context &context() const {
+            return _context;
+        }
+
+        [[nodiscard]] const cl::CommandQueue &queue() const {
+            return _queue;
+        }
+
+        // Queue for chunked transfers, so that they run alongside the kernels on queue().
+        [[nodiscard]] const cl::CommandQueue &transfer_queue() const {
+            return _transfer_queue;
+        }
+
+        std::mutex &mutex() {
+            return _mutex;
+        }
+
+        // True if the device shares physical memory with the host (CPU and integrated GPU devices).
+        [[nodiscard]] bool unified_memory() const {
+            return _unified_memory;
+        }
+
+        cl::Kernel kernel(const std::string &program, const std::string &name);
+
+        // The variant of a kernel picked for this device, e.g. by timing the candidates. Empty until it is set.
+        std::string &variant(const std::string &name) {
+            return _variants[name];
+        }
+
+        // Returns a pooled device buffer holding at least 'size' bytes.
+        cl::Buffer buffer(const std::string &name, uint64_t size);
+
+        // Uploads 'data' into the named pooled buffer unless that exact allocation is already resident. Like the
+        // pointer overload, the caller invalidates the name before 'data' is released or changed.
+        template<typename T>
+        cl::Buffer upload(const std::string &name, const rainman::ptr<T> &data) {
+            uint64_t size = data.size() * sizeof(T);
+            auto buf = buffer(name, size);
+            auto &resident = _resident[name];
+
+            if (resident.host_pointer != data.pointer() || resident.size != size) {
+                _queue.enqueueWriteBuffer(buf, CL_FALSE, 0, size, data.pointer());
+                resident = resident_data{.host_pointer = data.pointer(), .size = size};
+            }
+
+            return buf;
+        }
+
+        // Uploads 'size' bytes at 'data' unless that memory is already resident. On unified-memory devices the
+        // buffer wraps 'data' in place (CL_MEM_USE_HOST_PTR) instead of copying it. The caller keeps 'data'
+        // alive and unchanged until the name is invalidated.
+        cl::Buffer upload(const std::string &name, const void *data, uint64_t size);
+
+        // Like upload(), but copies the data in chunks of 'chunk_size' bytes on the transfer queue. Chunks are staged
+        // through two pinned host buffers, so that filling one overlaps the transfer of the other. 'chunk_ready' gets
+        // the buffer and the index and write event of every chunk as soon as it is enqueued, so that the work on it can be enqueued
+        // while later chunks are still staged. The event is null if nothing had to be transferred. Without
+        // SessionProvider::chunked() this is a plain upload() and every chunk is ready at once.
+        cl::Buffer upload_chunks(
+                const std::string &name,
+                const void *data,
+                uint64_t size,
+                uint64_t chunk_size,
+                const std::function<void(const cl::Buffer &, uint64_t, const cl::Event &)> &chunk_ready
+        );
+
+        // Returns a named, mapped host allocation of at least 'size' bytes made by the runtime (CL_MEM_ALLOC_HOST_PTR),
+        // which the device copies to and from directly. It stays valid until the name is requested with a larger size.
+        void *pinned(const std::string &name, uint64_t size);
+
+        // Returns a buffer for the device to write 'size' bytes destined for 'data'. On unified-memory devices
+        // this is 'data' itself, otherwise the named pooled buffer.
+        cl::Buffer output_buffer(const std::string &name, void *data, uint64_t size);
+
+        // Enqueues the transfer that makes the device's writes to an output buffer visible at 'data'.
+        void download(const cl::Buffer &buf, void *data, uint64_t size);
+
+        // Marks the named buffer as overwritten by the device.
+        void invalidate(const std::string &name);
+    };
+
+    /*
+     * Invalidates named buffers of a locked session when the lock is given up, whether the codec call returns or
+     * throws. It is created right after the lock is taken, so that a cl::Error between an upload and the end of
+     * the call cannot leave a buffer recorded as a copy of host memory that is released or reused afterwards.
+     */
+    class ResidencyGuard {
+    private:
+        Session &_session;
+        std::unique_lock<std::mutex> &_lock;
+        std::vector<std::string> _names;
+
+        void invalidate();
+
+    public:
+        ResidencyGuard(Session &session, std::unique_lock<std::mutex> &lock, std::vector<std::string> names);
+
+        ResidencyGuard(const ResidencyGuard &) = delete;
+
+        ResidencyGuard &operator=(const ResidencyGuard &) = delete;
+
+        // Invalidates the names and releases the lock.
+        void unlock();
+
+        // Keeps the names resident on success, e.g. a blob that the encoder uploads again otherwise.
+        void dismiss();
+
+        ~ResidencyGuard();
+    };
+
+    class SessionProvider {
+    private:
+        static std::unordered_map<cl_device_id, std::shared_ptr<Session>> _sessions;
+        static std::mutex _mutex;
+        static bool _chunked;
+    public:
+        static std::shared_ptr<Session> get(const cl::Device &device);
+
+        static void clear();
+
+        // Splits the transfers of a blob into chunks that overlap the kernels (see upload_chunks()). Off by default,
+        // since its throughput against single-shot transfers has not been measured on real devices yet.
+        static void set_chunked(bool chunked);
+
+        static bool chunked();
+    };
+}
+
+#endif
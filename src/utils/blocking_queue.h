@@ -0,0 +1,50 @@
+#ifndef INTERLACED_ANS_UTILS_BLOCKING_QUEUE_H
+#define INTERLACED_ANS_UTILS_BLOCKING_QUEUE_H
+
+#include <mutex>
+#include <queue>
+#include <optional>
+#include <condition_variable>
+
+template<typename T>
+class BlockingQueue {
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::queue<T> _queue;
+    bool _closed = false;
+
+public:
+    bool push(T &&item) {
+        std::unique_lock<std::mutex> lk(_mutex);
+        if (_closed) {
+            return false;
+        }
+
+        _queue.push(std::move(item));
+        _cv.notify_one();
+        return true;
+    }
+
+    // Blocks until an item is available. Returns nothing once the queue is closed and drained.
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> lk(_mutex);
+        _cv.wait(lk, [this] { return _closed || !_queue.empty(); });
+
+        if (_queue.empty()) {
+            return std::nullopt;
+        }
+
+        std::optional<T> item = std::move(_queue.front());
+        _queue.pop();
+        return item;
+    }
+
+    void close() {
+        std::unique_lock<std::mutex> lk(_mutex);
+        _closed = true;
+        _cv.notify_all();
+    }
+};
+
+#endif
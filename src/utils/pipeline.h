@@ -0,0 +1,137 @@
+#ifndef INTERLACED_ANS_UTILS_PIPELINE_H
+#define INTERLACED_ANS_UTILS_PIPELINE_H
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <optional>
+#include <exception>
+#include <functional>
+#include <utils/semaphore.h>
+#include <utils/blocking_queue.h>
+
+/*
+ * Bounded three-stage pipeline: a reader thread produces items, a set of workers transforms them and the
+ * calling thread consumes the results in the order they were read. At most 'max_in_flight' items exist
+ * between the start of a read and the end of the matching write.
+ */
+template<typename Input, typename Output>
+class Pipeline {
+private:
+    uint64_t _max_in_flight;
+    uint64_t _n_workers;
+
+public:
+    typedef std::function<std::optional<Input>()> reader_t;
+    typedef std::function<Output(Input &, uint64_t worker)> worker_t;
+    typedef std::function<void(Output &)> writer_t;
+
+    explicit Pipeline(uint64_t max_in_flight = 2, uint64_t n_workers = 1) :
+            _max_in_flight(std::max(max_in_flight, uint64_t(1))),
+            _n_workers(std::max(n_workers, uint64_t(1))) {}
+
+    // Runs the pipeline until the reader is exhausted and returns the number of items written.
+    // The first exception thrown by any stage stops the pipeline and is rethrown here.
+    uint64_t run(const reader_t &read, const worker_t &process, const writer_t &write) {
+        Semaphore slots(_max_in_flight);
+        BlockingQueue<std::pair<uint64_t, Input>> inputs;
+        BlockingQueue<std::pair<uint64_t, Output>> outputs;
+
+        std::atomic<bool> aborted = false;
+        std::atomic<uint64_t> active_workers = _n_workers;
+        std::exception_ptr error;
+        std::mutex error_mutex;
+
+        auto fail = [&]() {
+            {
+                std::unique_lock<std::mutex> lk(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+
+            aborted = true;
+            inputs.close();
+            outputs.close();
+            slots.release();
+        };
+
+        std::thread reader([&]() {
+            try {
+                for (uint64_t index = 0; ; index++) {
+                    slots.acquire();
+                    if (aborted) {
+                        break;
+                    }
+
+                    auto item = read();
+                    if (!item) {
+                        break;
+                    }
+
+                    inputs.push({index, std::move(*item)});
+                }
+            } catch (...) {
+                fail();
+            }
+
+            inputs.close();
+        });
+
+        std::vector<std::thread> workers;
+        for (uint64_t w = 0; w < _n_workers; w++) {
+            workers.emplace_back([&, w]() {
+                try {
+                    while (!aborted) {
+                        auto item = inputs.pop();
+                        if (!item) {
+                            break;
+                        }
+
+                        outputs.push({item->first, process(item->second, w)});
+                    }
+                } catch (...) {
+                    fail();
+                }
+
+                if (--active_workers == 0) {
+                    outputs.close();
+                }
+            });
+        }
+
+        // Results may complete out of order, so hold them back until their predecessors are written.
+        std::map<uint64_t, Output> pending;
+        uint64_t next_index = 0;
+
+        try {
+            while (auto item = outputs.pop()) {
+                pending.emplace(item->first, std::move(item->second));
+
+                for (auto it = pending.find(next_index); it != pending.end(); it = pending.find(next_index)) {
+                    write(it->second);
+                    pending.erase(it);
+                    next_index++;
+                    slots.release();
+                }
+            }
+        } catch (...) {
+            fail();
+        }
+
+        reader.join();
+        for (auto &worker: workers) {
+            worker.join();
+        }
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+
+        return next_index;
+    }
+};
+
+#endif
@@ -12,6 +12,20 @@ void Semaphore::release() {
     _cv.notify_all();
 }
 
+uint64_t Semaphore::acquire(uint64_t n) {
+    std::unique_lock<std::mutex> lk(_mutex);
+    n = std::min(n, _max_count);
+    _cv.wait(lk, [this, n] { return _count >= n; });
+    _count -= n;
+    return n;
+}
+
+void Semaphore::release(uint64_t n) {
+    std::unique_lock<std::mutex> lk(_mutex);
+    _count += n;
+    _cv.notify_all();
+}
+
 void Semaphore::wait_all() {
     std::unique_lock<std::mutex> lk(_mutex);
     _cv.wait(lk, [this] { return _count == _max_count; });
@@ -1,6 +1,7 @@
 #ifndef INTERLACED_ANS_UTILS_SEMAPHORE_H
 #define INTERLACED_ANS_UTILS_SEMAPHORE_H
 
+#include <cstdint>
 #include <mutex>
 #include <condition_variable>
 
@@ -18,6 +19,12 @@ public:
 
     void release();
 
+    // Takes 'n' units at once. 'n' is clamped to the initial count so that it can always be satisfied,
+    // and the number of units actually taken is returned.
+    uint64_t acquire(uint64_t n);
+
+    void release(uint64_t n);
+
     void wait_all();
 };
 
@@ -0,0 +1,40 @@
+#include "simd.h"
+#include <algorithm>
+
+SimdLevel Simd::_level = Simd::detect();
+
+SimdLevel Simd::detect() {
+#ifdef INTERLACED_ANS_SIMD_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") &&
+        __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")) {
+        return SimdLevel::AVX512;
+    }
+
+    if (__builtin_cpu_supports("avx2")) {
+        return SimdLevel::AVX2;
+    }
+#endif
+
+    return SimdLevel::SCALAR;
+}
+
+void Simd::set(SimdLevel level) {
+    _level = std::min(level, detect());
+}
+
+SimdLevel Simd::get() {
+    return _level;
+}
+
+std::string Simd::name(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::AVX512:
+            return "avx512";
+        case SimdLevel::AVX2:
+            return "avx2";
+        default:
+            return "scalar";
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef INTERLACED_ANS_UTILS_SIMD_H
+#define INTERLACED_ANS_UTILS_SIMD_H
+
+#include <string>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define INTERLACED_ANS_SIMD_X86
+#endif
+
+enum class SimdLevel {
+    // Portable scalar code.
+    SCALAR,
+
+    // 4 x 64-bit lanes.
+    AVX2,
+
+    // 8 x 64-bit lanes (AVX-512 F, DQ, BW and VL).
+    AVX512
+};
+
+// Selects the widest instruction set the host codecs may use. It is detected once at startup.
+class Simd {
+private:
+    static SimdLevel _level;
+
+public:
+    static SimdLevel detect();
+
+    // Caps the level used by the host codecs. A level the CPU does not support falls back to the detected one.
+    static void set(SimdLevel level);
+
+    static SimdLevel get();
+
+    static std::string name(SimdLevel level);
+};
+
+#endif
@@ -0,0 +1,119 @@
+#include "thread_pool.h"
+#include <atomic>
+#include <memory>
+#include <exception>
+
+uint64_t ThreadPool::_global_threads = 0;
+
+ThreadPool::ThreadPool(uint64_t n_threads) {
+    if (n_threads == 0) {
+        n_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    _n_threads = n_threads;
+
+    // The thread calling parallel_for is the remaining worker.
+    for (uint64_t i = 1; i < _n_threads; i++) {
+        _workers.emplace_back(&ThreadPool::worker, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::unique_lock<std::mutex> lk(_mutex);
+        _stopping = true;
+    }
+    _cv.notify_all();
+
+    for (auto &worker: _workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::worker() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lk(_mutex);
+            _cv.wait(lk, [this] { return _stopping || !_tasks.empty(); });
+            if (_tasks.empty()) {
+                return;
+            }
+
+            task = std::move(_tasks.front());
+            _tasks.pop();
+        }
+
+        task();
+    }
+}
+
+void ThreadPool::parallel_for(uint64_t n, const std::function<void(uint64_t)> &fn) {
+    if (n == 0) {
+        return;
+    }
+
+    struct state {
+        const std::function<void(uint64_t)> *fn = nullptr;
+        uint64_t n = 0;
+        std::atomic<uint64_t> next_index = 0;
+        std::atomic<uint64_t> completed = 0;
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+
+    // Helpers that are only scheduled after all indices were claimed must not touch 'fn',
+    // so they keep the shared state alive and bail out on the index check.
+    auto s = std::make_shared<state>();
+    s->fn = &fn;
+    s->n = n;
+
+    auto run = [s]() {
+        uint64_t i;
+        while ((i = s->next_index++) < s->n) {
+            try {
+                (*s->fn)(i);
+            } catch (...) {
+                std::unique_lock<std::mutex> lk(s->mutex);
+                if (!s->error) {
+                    s->error = std::current_exception();
+                }
+            }
+
+            if (++s->completed == s->n) {
+                std::unique_lock<std::mutex> lk(s->mutex);
+                s->cv.notify_all();
+            }
+        }
+    };
+
+    uint64_t n_helpers = std::min(n, _n_threads) - 1;
+    if (n_helpers > 0) {
+        {
+            std::unique_lock<std::mutex> lk(_mutex);
+            for (uint64_t i = 0; i < n_helpers; i++) {
+                _tasks.emplace(run);
+            }
+        }
+        _cv.notify_all();
+    }
+
+    run();
+
+    std::unique_lock<std::mutex> lk(s->mutex);
+    s->cv.wait(lk, [&s] { return s->completed == s->n; });
+
+    if (s->error) {
+        std::rethrow_exception(s->error);
+    }
+}
+
+void ThreadPool::set_global_threads(uint64_t n_threads) {
+    _global_threads = n_threads;
+}
+
+ThreadPool &ThreadPool::global() {
+    static ThreadPool pool(_global_threads);
+    return pool;
+}
@@ -0,0 +1,44 @@
+#ifndef INTERLACED_ANS_UTILS_THREAD_POOL_H
+#define INTERLACED_ANS_UTILS_THREAD_POOL_H
+
+#include <cstdint>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+class ThreadPool {
+private:
+    std::vector<std::thread> _workers;
+    std::queue<std::function<void()>> _tasks;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    bool _stopping = false;
+    uint64_t _n_threads;
+
+    static uint64_t _global_threads;
+
+    void worker();
+
+public:
+    explicit ThreadPool(uint64_t n_threads = 0);
+
+    ~ThreadPool();
+
+    [[nodiscard]] uint64_t threads() const {
+        return _n_threads;
+    }
+
+    // Runs fn(0) ... fn(n - 1) on the pool and blocks until all of them have returned.
+    // The calling thread takes part in the work, so nested or concurrent calls cannot deadlock.
+    void parallel_for(uint64_t n, const std::function<void(uint64_t)> &fn);
+
+    // Thread count of the shared pool. Must be set before the first call to global().
+    static void set_global_threads(uint64_t n_threads);
+
+    static ThreadPool &global();
+};
+
+#endif
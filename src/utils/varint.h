@@ -0,0 +1,51 @@
+#ifndef INTERLACED_ANS_UTILS_VARINT_H
+#define INTERLACED_ANS_UTILS_VARINT_H
+
+#include <cstdint>
+#include <vector>
+#include <errors/base.h>
+
+// LEB128 varints: 7 bits per byte, least significant group first, with the top bit set on all but the last byte.
+class Varint {
+public:
+    static void put(std::vector<uint8_t> &out, uint64_t x) {
+        while (x >= 0x80) {
+            out.push_back((uint8_t) (x | 0x80));
+            x >>= 7;
+        }
+
+        out.push_back((uint8_t) x);
+    }
+
+    // Number of bytes put() writes for 'x'.
+    static uint64_t size(uint64_t x) {
+        uint64_t n = 1;
+        for (; x >= 0x80; x >>= 7) {
+            n++;
+        }
+
+        return n;
+    }
+
+    // Reads a varint at 'p' and advances it. Throws if the varint runs past 'end' or does not fit in 64 bits.
+    static uint64_t get(const uint8_t *&p, const uint8_t *end) {
+        uint64_t x = 0;
+
+        for (uint32_t shift = 0; shift < 64; shift += 7) {
+            if (p == end) {
+                throw BaseErrors::InvalidOperationException("Truncated varint");
+            }
+
+            uint8_t byte = *p++;
+            x |= (uint64_t) (byte & 0x7f) << shift;
+
+            if ((byte & 0x80) == 0) {
+                return x;
+            }
+        }
+
+        throw BaseErrors::InvalidOperationException("Varint is too long");
+    }
+};
+
+#endif